@@ -0,0 +1,36 @@
+#!/bin/bash
+# Compare the throughput of large sequential reads through unionfs with
+# different data paths. The branch file is read once beforehand, so it is
+# served from the page cache and only unionfs itself is measured.
+#
+# usage: ./bench_read.sh [size in MiB] [unionfs options...]
+# e.g.   ./bench_read.sh 2048 "" "-o splice" "-o passthrough"
+
+set -e
+
+SIZE=${1:-1024}
+shift || true
+if [ $# -eq 0 ]; then
+	set -- "" "-o splice"
+fi
+
+UNIONFS=${UNIONFS:-src/unionfs}
+DIR=$(mktemp -d)
+
+cleanup() {
+	if mountpoint -q "$DIR/union"; then fusermount -u -q "$DIR/union" || umount "$DIR/union"; fi
+	rm -rf "$DIR"
+}
+trap cleanup EXIT
+
+mkdir "$DIR/rw" "$DIR/ro" "$DIR/union"
+dd if=/dev/urandom of="$DIR/ro/file" bs=1M count="$SIZE" status=none
+cat "$DIR/ro/file" >/dev/null
+
+for opts in "$@"; do
+	$UNIONFS $opts "$DIR/rw=rw:$DIR/ro=ro" "$DIR/union"
+	# a fresh mount, so nothing is in the page cache of the union file
+	printf '%-20s ' "${opts:-(default)}"
+	dd if="$DIR/union/file" of=/dev/null bs=1M 2>&1 | tail -n 1 | sed 's/.*, //'
+	fusermount -u "$DIR/union" || umount "$DIR/union"
+done
@@ -0,0 +1,388 @@
+/*
+*  C Implementation: bloom
+*
+* Description: Bloom filters of the paths on each branch
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+*
+* Details:
+*	Most lookups of build systems and interpreters (header search paths,
+*	module imports) are for paths which do not exist, and every miss
+*	costs an lstat() on every branch. With -o bloom_filter all paths of a
+*	branch are put into a Bloom filter on mount, so find_branch() can skip
+*	the branches which definitely do not have a path.
+*	Paths created through unionfs on rw branches are added as they are
+*	created, removed paths stay in the filter (a Bloom filter can't
+*	forget), which only costs an unneeded lstat(). Rw branches get room
+*	for more paths than they have on mount.
+*	As lstat() follows symlinks in the parent directories of a path,
+*	symlinks are put into the filter a second time with another key, and
+*	a path below a possible symlink is always looked up.
+*	Paths created directly in a branch while we are mounted are not
+*	noticed unless -o watch_branches is given (see watch.c), so otherwise
+*	the option must not be used if branches are modified behind our back.
+*/
+
+#if defined __linux__
+	#define _DEFAULT_SOURCE 1
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "unionfs.h"
+#include "opts.h"
+#include "branch.h"
+#include "bloom.h"
+#include "debug.h"
+#include "usyslog.h"
+
+#define BLOOM_BITS_PER_PATH 10	// ~1% false positives with 7 hashes
+#define BLOOM_HASHES 7
+#define BLOOM_MIN_PATHS 65536	// so that small rw branches can grow
+#define BLOOM_RW_HEADROOM 4	// rw branches get room for this many times their paths
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+typedef struct {
+	uint64_t *bits;		// NULL if the branch is not filtered
+	uint64_t mask;		// number of bits - 1
+	uint64_t paths;		// number of paths added
+	uint64_t negatives;	// lookups answered with "not there"
+	uint64_t false_positives; // lookups answered with "maybe", but it was not there
+	bool disabled;		// we failed to add paths, so the filter is incomplete
+} bloom_t;
+
+static bloom_t *filters; // one per branch, NULL if disabled
+
+// the paths found by the walk on mount, before we know the filter size
+typedef struct {
+	uint64_t *keys;
+	size_t n, size;
+} keys_t;
+
+typedef void (*add_fn)(void *arg, uint64_t key);
+
+static uint64_t fnv(uint64_t hash, unsigned char c) {
+	return (hash ^ c) * FNV_PRIME;
+}
+
+/**
+ * splitmix64 finalizer, derives the bit positions from the FNV hash
+ */
+static uint64_t mix(uint64_t h) {
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebULL;
+	h ^= h >> 31;
+	return h;
+}
+
+/**
+ * Key of a path, duplicate and trailing slashes are ignored.
+ */
+static uint64_t path_key(const char *path) {
+	uint64_t hash = FNV_OFFSET;
+
+	while (*path) {
+		while (*path == '/') path++;
+		if (*path == '\0') break;
+
+		hash = fnv(hash, '/');
+		while (*path && *path != '/') hash = fnv(hash, *path++);
+	}
+
+	return hash;
+}
+
+/**
+ * The second key of a symlink
+ */
+static uint64_t link_key(uint64_t key) {
+	return key ^ 0x9e3779b97f4a7c15ULL;
+}
+
+static void set_bits(bloom_t *bf, uint64_t key) {
+	uint64_t a = mix(key);
+	uint64_t b = mix(a) | 1;
+
+	int i;
+	for (i = 0; i < BLOOM_HASHES; i++) {
+		uint64_t bit = (a + i * b) & bf->mask;
+		__atomic_fetch_or(&bf->bits[bit / 64], (uint64_t)1 << (bit % 64), __ATOMIC_RELAXED);
+	}
+}
+
+static bool test_bits(const bloom_t *bf, uint64_t key) {
+	uint64_t a = mix(key);
+	uint64_t b = mix(a) | 1;
+
+	int i;
+	for (i = 0; i < BLOOM_HASHES; i++) {
+		uint64_t bit = (a + i * b) & bf->mask;
+		uint64_t word = __atomic_load_n(&bf->bits[bit / 64], __ATOMIC_RELAXED);
+		if (!(word & ((uint64_t)1 << (bit % 64)))) return false;
+	}
+
+	return true;
+}
+
+static void add_key(bloom_t *bf, const char *path, mode_t mode) {
+	uint64_t key = path_key(path);
+
+	set_bits(bf, key);
+	if (S_ISLNK(mode)) set_bits(bf, link_key(key));
+
+	__atomic_fetch_add(&bf->paths, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Call add for the keys of everything below directory path on branch.
+ * path is a PATHLEN_MAX buffer of length len, which is modified on the
+ * way, but restored on return. Returns -1 if not everything could be read.
+ */
+static int walk(int branch, char *path, size_t len, add_fn add, void *arg) {
+	branch_dir_t *dp = branch_opendir(branch, len ? path : "/");
+	if (dp == NULL) {
+		USYSLOG(LOG_WARNING, "%s: Failed to read %s%s: %s\n", __func__,
+			uopt.branches[branch].path, path, strerror(errno));
+		return -1;
+	}
+
+	int res = 0;
+	struct dirent *de;
+	while (res == 0 && (de = branch_readdir(dp)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+
+		size_t namelen = strlen(de->d_name);
+		if (len + 1 + namelen >= PATHLEN_MAX) {
+			res = -1;
+			break;
+		}
+		path[len] = '/';
+		memcpy(path + len + 1, de->d_name, namelen + 1);
+
+		mode_t mode = DTTOIF(de->d_type);
+		if (de->d_type == DT_UNKNOWN) {
+			struct stat st;
+			if (branch_lstat(branch, path, &st) == -1) {
+				res = -1;
+				break;
+			}
+			mode = st.st_mode;
+		}
+
+		uint64_t key = path_key(path);
+		add(arg, key);
+		if (S_ISLNK(mode)) add(arg, link_key(key));
+
+		if (S_ISDIR(mode)) res = walk(branch, path, len + 1 + namelen, add, arg);
+	}
+
+	path[len] = '\0';
+	branch_closedir(dp);
+
+	return res;
+}
+
+static void keys_add(void *arg, uint64_t key) {
+	keys_t *keys = arg;
+
+	if (keys->n == keys->size) {
+		size_t size = keys->size ? 2 * keys->size : 4096;
+		uint64_t *k = realloc(keys->keys, size * sizeof(uint64_t));
+		if (k == NULL) {
+			// the walk can't fail from here, make the filter useless instead
+			keys->n = SIZE_MAX;
+			return;
+		}
+		keys->keys = k;
+		keys->size = size;
+	}
+
+	if (keys->n != SIZE_MAX) keys->keys[keys->n++] = key;
+}
+
+static void filter_add(void *arg, uint64_t key) {
+	bloom_t *bf = arg;
+
+	set_bits(bf, key);
+	__atomic_fetch_add(&bf->paths, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Build the filter of branch from all its paths
+ */
+static void build(bloom_t *bf, int branch) {
+	keys_t keys = { NULL, 0, 0 };
+	char path[PATHLEN_MAX] = "";
+
+	if (walk(branch, path, 0, keys_add, &keys) || keys.n == SIZE_MAX) {
+		USYSLOG(LOG_WARNING, "Bloom filter of %s disabled, not all paths could be read\n",
+			uopt.branches[branch].path);
+		free(keys.keys);
+		return;
+	}
+
+	uint64_t paths = keys.n + 1; // the root
+	if (uopt.branches[branch].rw) paths *= BLOOM_RW_HEADROOM;
+	if (paths < BLOOM_MIN_PATHS) paths = BLOOM_MIN_PATHS;
+
+	uint64_t nbits = 64;
+	while (nbits < paths * BLOOM_BITS_PER_PATH) nbits *= 2;
+
+	bf->bits = calloc(nbits / 64, sizeof(uint64_t));
+	if (bf->bits == NULL) {
+		USYSLOG(LOG_WARNING, "Bloom filter of %s disabled, out of memory\n",
+			uopt.branches[branch].path);
+		free(keys.keys);
+		return;
+	}
+	bf->mask = nbits - 1;
+
+	set_bits(bf, path_key("/"));
+	size_t i;
+	for (i = 0; i < keys.n; i++) set_bits(bf, keys.keys[i]);
+	bf->paths = keys.n + 1;
+
+	free(keys.keys);
+}
+
+/**
+ * Read all branches and build their filters. Needs to be done after the
+ * chroot, like windex_init().
+ */
+void bloom_init(void) {
+	if (!uopt.bloom_filter) return;
+
+	bloom_t *bfs = calloc(uopt.nbranches, sizeof(bloom_t));
+	if (bfs == NULL) {
+		USYSLOG(LOG_ERR, "%s: out of memory, bloom filters disabled\n", __func__);
+		return;
+	}
+
+	int i;
+	for (i = 0; i < uopt.nbranches; i++) build(&bfs[i], i);
+
+	filters = bfs;
+}
+
+static bloom_t *get_filter(int branch) {
+	if (filters == NULL) return NULL;
+
+	bloom_t *bf = &filters[branch];
+	if (bf->bits == NULL || __atomic_load_n(&bf->disabled, __ATOMIC_RELAXED)) return NULL;
+
+	return bf;
+}
+
+/**
+ * Return false if path is definitely not on branch, so it does not need
+ * to be looked up there.
+ */
+bool bloom_maybe(int branch, const char *path) {
+	bloom_t *bf = get_filter(branch);
+	if (bf == NULL) return true;
+
+	uint64_t hash = FNV_OFFSET;
+	while (*path) {
+		while (*path == '/') path++;
+		if (*path == '\0') break;
+
+		// lstat() follows a symlink in the parent directories
+		if (hash != FNV_OFFSET && test_bits(bf, link_key(hash))) return true;
+
+		hash = fnv(hash, '/');
+		while (*path && *path != '/') hash = fnv(hash, *path++);
+	}
+
+	if (test_bits(bf, hash)) return true;
+
+	__atomic_fetch_add(&bf->negatives, 1, __ATOMIC_RELAXED);
+	return false;
+}
+
+/**
+ * bloom_maybe() said maybe, but path was not on branch
+ */
+void bloom_false_positive(int branch) {
+	bloom_t *bf = get_filter(branch);
+	if (bf) __atomic_fetch_add(&bf->false_positives, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * path with file type mode was created on branch
+ */
+void bloom_add(int branch, const char *path, mode_t mode) {
+	bloom_t *bf = get_filter(branch);
+	if (bf) add_key(bf, path, mode);
+}
+
+/**
+ * path and everything below it appeared on branch, e.g. by a rename()
+ */
+void bloom_add_tree(int branch, const char *path) {
+	bloom_t *bf = get_filter(branch);
+	if (bf == NULL) return;
+
+	struct stat st;
+	if (branch_lstat(branch, path, &st) == -1) return; // gone again
+
+	add_key(bf, path, st.st_mode);
+	if (!S_ISDIR(st.st_mode)) return;
+
+	char p[PATHLEN_MAX];
+	size_t len = strlen(path);
+	while (len && path[len - 1] == '/') len--;
+	if (len >= PATHLEN_MAX) return; // can't be, branch_lstat() would have failed
+	memcpy(p, path, len);
+	p[len] = '\0';
+
+	if (walk(branch, p, len, filter_add, bf)) {
+		USYSLOG(LOG_WARNING, "Bloom filter of %s disabled, %s could not be read\n",
+			uopt.branches[branch].path, path);
+		__atomic_store_n(&bf->disabled, true, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * Write the filter statistics into buf, return the length like snprintf().
+ */
+int bloom_print_stats(char *buf, size_t size) {
+	if (filters == NULL) return snprintf(buf, size, "bloom filters: disabled\n");
+
+	int len = 0;
+	int i;
+	for (i = 0; i < uopt.nbranches; i++) {
+		bloom_t *bf = &filters[i];
+		size_t left = (size_t)len < size ? size - len : 0;
+
+		if (bf->bits == NULL || bf->disabled) {
+			len += snprintf(buf + (size - left), left, "bloom filter branch %d: disabled\n", i);
+			continue;
+		}
+
+		uint64_t neg = __atomic_load_n(&bf->negatives, __ATOMIC_RELAXED);
+		uint64_t fp = __atomic_load_n(&bf->false_positives, __ATOMIC_RELAXED);
+		double rate = neg + fp ? 100.0 * fp / (neg + fp) : 0.0;
+
+		len += snprintf(buf + (size - left), left,
+			"bloom filter branch %d: %" PRIu64 " paths, %" PRIu64 " KiB, "
+			"%" PRIu64 " lookups skipped, %" PRIu64 " false positives (%.2f%%)\n",
+			i, __atomic_load_n(&bf->paths, __ATOMIC_RELAXED), (bf->mask + 1) / 8 / 1024,
+			neg, fp, rate);
+	}
+
+	return len;
+}
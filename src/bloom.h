@@ -0,0 +1,21 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+void bloom_init(void);
+bool bloom_maybe(int branch, const char *path);
+void bloom_false_positive(int branch);
+void bloom_add(int branch, const char *path, mode_t mode);
+void bloom_add_tree(int branch, const char *path);
+int bloom_print_stats(char *buf, size_t size);
+
+#endif
@@ -0,0 +1,496 @@
+/*
+*  C Implementation: branch
+*
+* Description: file system calls on a path within a branch
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+*
+* Details:
+*	All functions take a branch number and a union path. Each branch has
+*	an open directory file descriptor (uopt.branches[i].fd), so we use
+*	the *at() system calls relative to it. The kernel then does not need
+*	to walk the path of the branch itself again on every call, which
+*	matters if branches are deep within a (network) file system.
+*	If *at() support is not available, the full path is built instead.
+*	The functions return like their system call counterparts, so -1 and
+*	errno set on error.
+*	If a read-only branch has an index (-o branch_index), lstat() and
+*	reading directories are answered from the index instead.
+*	On Linux directories are read with getdents64() into a large buffer,
+*	instead of the 32 KiB libc uses. Huge directories then need fewer
+*	system calls, each of which is a round trip on network file systems.
+*	The buffer is kept per thread and only directories opened while
+*	another one is read by the same thread get a buffer of their own.
+*/
+
+#if defined __linux__
+	// For *at() functions
+	#define _XOPEN_SOURCE 700
+
+	#define _DEFAULT_SOURCE 1
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "conf.h"
+#include "unionfs.h"
+#include "opts.h"
+#include "string.h"
+#include "branch.h"
+#include "branch_index.h"
+#include "debug.h"
+#include "usyslog.h"
+
+/**
+ * Return path relative to the branch root, as required by the *at()
+ * functions. The union root "/" becomes ".".
+ */
+const char *branch_relpath(const char *path) {
+	while (*path == '/') path++;
+	if (*path == '\0') return ".";
+
+	return path;
+}
+
+#ifdef UNIONFS_HAVE_AT
+	#define BFD(branch) (uopt.branches[branch].fd)
+	#define REL(path) branch_relpath(path)
+#endif
+
+#if defined __linux__ && defined UNIONFS_HAVE_AT
+	#define UNIONFS_HAVE_GETDENTS
+	#include <sys/syscall.h>
+
+	#define DENTS_BUF_SIZE (256 * 1024)
+#endif
+
+#if !defined UNIONFS_HAVE_AT || defined __APPLE__
+/**
+ * Build the absolute path of path on branch, for the system calls
+ * without an *at() variant.
+ */
+static int full_path(char *p, int branch, const char *path) {
+	if (BUILD_PATH(p, uopt.branches[branch].path, path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	return 0;
+}
+#endif
+
+struct branch_dir {
+	DIR *dp;				// NULL if read from the index or with getdents64()
+	int fd;					// read with getdents64() if not -1
+	char *buf;				// DENTS_BUF_SIZE bytes for getdents64()
+	size_t len, off;			// bytes in buf, the next entry in it
+	const bindex_t *index;
+	const struct bindex_entry *dir;
+	uint32_t pos;				// the next entry, 0 and 1 are "." and ".."
+	struct dirent de;
+};
+
+int branch_lstat(int branch, const char *path, struct stat *st) {
+	if (uopt.branches[branch].index) {
+		// paths through symlinks are left to the file system
+		int res = bindex_lstat(uopt.branches[branch].index, path, st);
+		if (res == 0 || errno != BINDEX_ESYMLINK) return res;
+	}
+
+#ifdef UNIONFS_HAVE_AT
+	return fstatat(BFD(branch), REL(path), st, AT_SYMLINK_NOFOLLOW);
+#else
+	char p[PATHLEN_MAX];
+	if (full_path(p, branch, path)) return -1;
+	return lstat(p, st);
+#endif
+}
+
+int branch_stat(int branch, const char *path, struct stat *st) {
+	if (uopt.branches[branch].index) {
+		// only symlinks need the real stat()
+		int res = bindex_lstat(uopt.branches[branch].index, path, st);
+		if (res == -1 && errno != BINDEX_ESYMLINK) return res;
+		if (res == 0 && !S_ISLNK(st->st_mode)) return res;
+	}
+
+#ifdef UNIONFS_HAVE_AT
+	return fstatat(BFD(branch), REL(path), st, 0);
+#else
+	char p[PATHLEN_MAX];
+	if (full_path(p, branch, path)) return -1;
+	return stat(p, st);
+#endif
+}
+
+int branch_open(int branch, const char *path, int flags, mode_t mode) {
+#ifdef UNIONFS_HAVE_AT
+	return openat(BFD(branch), REL(path), flags, mode);
+#else
+	char p[PATHLEN_MAX];
+	if (full_path(p, branch, path)) return -1;
+	return open(p, flags, mode);
+#endif
+}
+
+#ifdef UNIONFS_HAVE_GETDENTS
+// from <linux/dirent.h>, glibc only has a getdents64() wrapper since 2.30
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+static pthread_key_t dents_key;	// the buffer of the thread, while not in use
+static pthread_once_t dents_once = PTHREAD_ONCE_INIT;
+
+static void dents_key_init(void) {
+	if (pthread_key_create(&dents_key, free)) {
+		USYSLOG(LOG_ERR, "%s: pthread_key_create failed\n", __func__);
+	}
+}
+
+static char *get_dents_buf(void) {
+	pthread_once(&dents_once, dents_key_init);
+
+	char *buf = pthread_getspecific(dents_key);
+	if (buf) {
+		pthread_setspecific(dents_key, NULL);
+		return buf;
+	}
+
+	return malloc(DENTS_BUF_SIZE);
+}
+
+static void put_dents_buf(char *buf) {
+	if (pthread_getspecific(dents_key) == NULL && pthread_setspecific(dents_key, buf) == 0) return;
+	free(buf);
+}
+
+static int dents_opendir(branch_dir_t *dir, int branch, const char *path) {
+	dir->buf = get_dents_buf();
+	if (dir->buf == NULL) return -1;
+
+	dir->fd = openat(BFD(branch), REL(path), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir->fd == -1) {
+		int err = errno;
+		put_dents_buf(dir->buf);
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
+static struct dirent *dents_readdir(branch_dir_t *dir) {
+	if (dir->off >= dir->len) {
+		long n = syscall(SYS_getdents64, dir->fd, dir->buf, DENTS_BUF_SIZE);
+		if (n <= 0) return NULL; // end of directory or errno set
+
+		dir->len = n;
+		dir->off = 0;
+	}
+
+	const struct linux_dirent64 *d = (const struct linux_dirent64 *)(dir->buf + dir->off);
+	dir->off += d->d_reclen;
+
+	size_t len = strlen(d->d_name);
+	if (len >= sizeof(dir->de.d_name)) len = sizeof(dir->de.d_name) - 1;
+
+	dir->de.d_ino = d->d_ino;
+	dir->de.d_type = d->d_type;
+	memcpy(dir->de.d_name, d->d_name, len);
+	dir->de.d_name[len] = '\0';
+
+	return &dir->de;
+}
+#endif // UNIONFS_HAVE_GETDENTS
+
+static DIR *do_opendir(int branch, const char *path) {
+#ifdef UNIONFS_HAVE_AT
+	int fd = openat(BFD(branch), REL(path), O_RDONLY | O_DIRECTORY);
+	if (fd == -1) return NULL;
+
+	DIR *dp = fdopendir(fd);
+	if (dp == NULL) {
+		int err = errno;
+		close(fd);
+		errno = err;
+	}
+
+	return dp;
+#else
+	char p[PATHLEN_MAX];
+	if (full_path(p, branch, path)) return NULL;
+	return opendir(p);
+#endif
+}
+
+/**
+ * opendir() of path on branch, use branch_readdir() and branch_closedir()
+ * on the result.
+ */
+branch_dir_t *branch_opendir(int branch, const char *path) {
+	const bindex_t *index = uopt.branches[branch].index;
+	const struct bindex_entry *e = NULL;
+
+	if (index) {
+		e = bindex_lookup(index, path);
+		if (e == NULL && errno != BINDEX_ESYMLINK) return NULL;
+		// opendir() follows symlinks, the index does not know where to
+		if (e && !S_ISLNK(e->mode) && !S_ISDIR(e->mode)) {
+			errno = ENOTDIR;
+			return NULL;
+		}
+		if (e && S_ISLNK(e->mode)) e = NULL;
+	}
+
+	branch_dir_t *dir = calloc(1, sizeof(branch_dir_t));
+	if (dir == NULL) return NULL;
+	dir->fd = -1;
+
+	if (e) {
+		dir->index = index;
+		dir->dir = e;
+		return dir;
+	}
+
+#ifdef UNIONFS_HAVE_GETDENTS
+	if (dents_opendir(dir, branch, path) == 0) return dir;
+	if (errno != ENOMEM) {
+		int err = errno;
+		free(dir);
+		errno = err;
+		return NULL;
+	}
+	// without the large buffer, libc still might manage
+#endif
+
+	dir->dp = do_opendir(branch, path);
+	if (dir->dp == NULL) {
+		int err = errno;
+		free(dir);
+		errno = err;
+		return NULL;
+	}
+
+	return dir;
+}
+
+struct dirent *branch_readdir(branch_dir_t *dir) {
+	if (dir->dp) return readdir(dir->dp);
+#ifdef UNIONFS_HAVE_GETDENTS
+	if (dir->fd != -1) return dents_readdir(dir);
+#endif
+
+	const char *name;
+	ino_t ino = 0;
+	unsigned char type = DT_DIR;
+
+	if (dir->pos == 0) {
+		name = ".";
+		ino = dir->dir->ino;
+	} else if (dir->pos == 1) {
+		name = "..";
+	} else {
+		const struct bindex_entry *e = bindex_child(dir->index, dir->dir, dir->pos - 2);
+		if (e == NULL) return NULL;
+
+		name = bindex_name(dir->index, e);
+		ino = e->ino;
+		type = IFTODT(e->mode);
+	}
+	dir->pos++;
+
+	dir->de.d_ino = ino;
+	dir->de.d_type = type;
+	strncpy(dir->de.d_name, name, sizeof(dir->de.d_name) - 1);
+	dir->de.d_name[sizeof(dir->de.d_name) - 1] = '\0';
+
+	return &dir->de;
+}
+
+int branch_closedir(branch_dir_t *dir) {
+	int res = 0;
+	if (dir->dp) res = closedir(dir->dp);
+#ifdef UNIONFS_HAVE_GETDENTS
+	if (dir->fd != -1) {
+		res = close(dir->fd);
+		put_dents_buf(dir->buf);
+	}
+#endif
+
+	free(dir);
+	return res;
+}
+
+int branch_mkdir(int branch, const char *path, mode_t mode) {
+#ifdef UNIONFS_HAVE_AT
+	return mkdirat(BFD(branch), REL(path), mode);
+#else
+	char p[PATHLEN_MAX];
+	if (full_path(p, branch, path)) return -1;
+	return mkdir(p, mode);
+#endif
+}
+
+// MacOS only got mknodat() and mkfifoat() very late
+int branch_mknod(int branch, const char *path, mode_t mode, dev_t rdev) {
+#if defined (UNIONFS_HAVE_AT) && !defined (__APPLE__)
+	return mknodat(BFD(branch), REL(path), mode, rdev);
+#else
+	char p[PATHLEN_MAX];
+	if (full_path(p, branch, path)) return -1;
+	return mknod(p, mode, rdev);
+#endif
+}
+
+int branch_mkfifo(int branch, const char *path, mode_t mode) {
+#if defined (UNIONFS_HAVE_AT) && !defined (__APPLE__)
+	return mkfifoat(BFD(branch), REL(path), mode);
+#else
+	char p[PATHLEN_MAX];
+	if (full_path(p, branch, path)) return -1;
+	return mkfifo(p, mode);
+#endif
+}
+
+int branch_unlink(int branch, const char *path) {
+#ifdef UNIONFS_HAVE_AT
+	return unlinkat(BFD(branch), REL(path), 0);
+#else
+	char p[PATHLEN_MAX];
+	if (full_path(p, branch, path)) return -1;
+	return unlink(p);
+#endif
+}
+
+int branch_rmdir(int branch, const char *path) {
+#ifdef UNIONFS_HAVE_AT
+	return unlinkat(BFD(branch), REL(path), AT_REMOVEDIR);
+#else
+	char p[PATHLEN_MAX];
+	if (full_path(p, branch, path)) return -1;
+	return rmdir(p);
+#endif
+}
+
+int branch_rename(int branch, const char *from, const char *to) {
+#ifdef UNIONFS_HAVE_AT
+	return renameat(BFD(branch), REL(from), BFD(branch), REL(to));
+#else
+	char f[PATHLEN_MAX], t[PATHLEN_MAX];
+	if (full_path(f, branch, from) || full_path(t, branch, to)) return -1;
+	return rename(f, t);
+#endif
+}
+
+int branch_link(int from_branch, const char *from, int to_branch, const char *to) {
+#ifdef UNIONFS_HAVE_AT
+	return linkat(BFD(from_branch), REL(from), BFD(to_branch), REL(to), 0);
+#else
+	char f[PATHLEN_MAX], t[PATHLEN_MAX];
+	if (full_path(f, from_branch, from) || full_path(t, to_branch, to)) return -1;
+	return link(f, t);
+#endif
+}
+
+/**
+ * Create path on branch as a symlink pointing to target. Just like
+ * symlink(), target is taken literally.
+ */
+int branch_symlink(const char *target, int branch, const char *path) {
+#ifdef UNIONFS_HAVE_AT
+	return symlinkat(target, BFD(branch), REL(path));
+#else
+	char p[PATHLEN_MAX];
+	if (full_path(p, branch, path)) return -1;
+	return symlink(target, p);
+#endif
+}
+
+ssize_t branch_readlink(int branch, const char *path, char *buf, size_t size) {
+#ifdef UNIONFS_HAVE_AT
+	return readlinkat(BFD(branch), REL(path), buf, size);
+#else
+	char p[PATHLEN_MAX];
+	if (full_path(p, branch, path)) return -1;
+	return readlink(p, buf, size);
+#endif
+}
+
+int branch_chmod(int branch, const char *path, mode_t mode) {
+#ifdef UNIONFS_HAVE_AT
+	return fchmodat(BFD(branch), REL(path), mode, 0);
+#else
+	char p[PATHLEN_MAX];
+	if (full_path(p, branch, path)) return -1;
+	return chmod(p, mode);
+#endif
+}
+
+/**
+ * chmod() which does not follow a symlink. Only possible with *at()
+ * support, otherwise the symlink target is modified.
+ */
+int branch_lchmod(int branch, const char *path, mode_t mode) {
+#ifdef UNIONFS_HAVE_AT
+	return fchmodat(BFD(branch), REL(path), mode, AT_SYMLINK_NOFOLLOW);
+#else
+	char p[PATHLEN_MAX];
+	if (full_path(p, branch, path)) return -1;
+	return chmod(p, mode);
+#endif
+}
+
+int branch_chown(int branch, const char *path, uid_t uid, gid_t gid) {
+#ifdef UNIONFS_HAVE_AT
+	return fchownat(BFD(branch), REL(path), uid, gid, 0);
+#else
+	char p[PATHLEN_MAX];
+	if (full_path(p, branch, path)) return -1;
+	return chown(p, uid, gid);
+#endif
+}
+
+int branch_lchown(int branch, const char *path, uid_t uid, gid_t gid) {
+#ifdef UNIONFS_HAVE_AT
+	return fchownat(BFD(branch), REL(path), uid, gid, AT_SYMLINK_NOFOLLOW);
+#else
+	char p[PATHLEN_MAX];
+	if (full_path(p, branch, path)) return -1;
+	return lchown(p, uid, gid);
+#endif
+}
+
+/**
+ * Set access and modification time, does not follow symlinks.
+ */
+int branch_utimens(int branch, const char *path, const struct timespec ts[2]) {
+#ifdef UNIONFS_HAVE_AT
+	return utimensat(BFD(branch), REL(path), ts, AT_SYMLINK_NOFOLLOW);
+#else
+	char p[PATHLEN_MAX];
+	if (full_path(p, branch, path)) return -1;
+
+	struct timeval tv[2];
+	tv[0].tv_sec = ts[0].tv_sec;
+	tv[0].tv_usec = ts[0].tv_nsec / 1000;
+	tv[1].tv_sec = ts[1].tv_sec;
+	tv[1].tv_usec = ts[1].tv_nsec / 1000;
+	return utimes(p, tv);
+#endif
+}
@@ -0,0 +1,39 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef BRANCH_H
+#define BRANCH_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <time.h>
+
+typedef struct branch_dir branch_dir_t;
+
+const char *branch_relpath(const char *path);
+int branch_lstat(int branch, const char *path, struct stat *st);
+int branch_stat(int branch, const char *path, struct stat *st);
+int branch_open(int branch, const char *path, int flags, mode_t mode);
+branch_dir_t *branch_opendir(int branch, const char *path);
+struct dirent *branch_readdir(branch_dir_t *dir);
+int branch_closedir(branch_dir_t *dir);
+int branch_mkdir(int branch, const char *path, mode_t mode);
+int branch_mknod(int branch, const char *path, mode_t mode, dev_t rdev);
+int branch_mkfifo(int branch, const char *path, mode_t mode);
+int branch_unlink(int branch, const char *path);
+int branch_rmdir(int branch, const char *path);
+int branch_rename(int branch, const char *from, const char *to);
+int branch_link(int from_branch, const char *from, int to_branch, const char *to);
+int branch_symlink(const char *target, int branch, const char *path);
+ssize_t branch_readlink(int branch, const char *path, char *buf, size_t size);
+int branch_chmod(int branch, const char *path, mode_t mode);
+int branch_lchmod(int branch, const char *path, mode_t mode);
+int branch_chown(int branch, const char *path, uid_t uid, gid_t gid);
+int branch_lchown(int branch, const char *path, uid_t uid, gid_t gid);
+int branch_utimens(int branch, const char *path, const struct timespec ts[2]);
+
+#endif
@@ -0,0 +1,326 @@
+/*
+*  C Implementation: branch_index
+*
+* Description: look up paths of a read-only branch in its mmap'ed index
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+*
+* Details:
+*	Read-only branches, e.g. base system images, usually do not change
+*	while they are mounted. unionfs-index writes the metadata of such a
+*	branch into an index file (see branch_index.h for the format), which
+*	is attached to the branch with -o branch_index=<branch>:<file>.
+*	branch_lstat() and branch_opendir() then answer from the mapped index
+*	without any system call; reading file data still goes to the branch.
+*	The index is not updated, if the branch is modified anyway it needs
+*	to be rebuilt. On mount only the root of the branch is compared with
+*	the index, so that large images mount without touching the branch.
+*	With -o branch_index_verify all its directories are compared, which
+*	catches files added, removed or renamed anywhere since the index was
+*	built, but not files modified in place.
+*	unionfs-index does not follow symlinks. Paths through a symlinked
+*	directory (e.g. /lib -> usr/lib) are not in the index, for them the
+*	lookups fall back to the file system, which resolves the link the
+*	same way the open() of the file does.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "unionfs.h"
+#include "branch_index.h"
+
+struct bindex {
+	const char *map;
+	size_t size;
+	const struct bindex_header *hdr;
+	const struct bindex_entry *entries;
+	const uint32_t *children;
+	const char *names;
+	dev_t dev;		// of the branch, the index does not know it
+};
+
+/**
+ * Check that all offsets in the index are within the file, so that a
+ * corrupt index can't make us read outside of the mapping.
+ */
+static const char *check_index(const bindex_t *idx) {
+	const struct bindex_header *hdr = idx->hdr;
+
+	if (idx->size < sizeof(*hdr)) return "file too small";
+	if (memcmp(hdr->magic, BINDEX_MAGIC, sizeof(hdr->magic))) return "not an index";
+	if (hdr->version != BINDEX_VERSION) return "unsupported version";
+
+	if (hdr->entries_off > idx->size
+	|| (idx->size - hdr->entries_off) / sizeof(struct bindex_entry) < hdr->nentries) {
+		return "entries out of range";
+	}
+	if (hdr->children_off > idx->size
+	|| (idx->size - hdr->children_off) / sizeof(uint32_t) < hdr->nchildren) {
+		return "children out of range";
+	}
+	if (hdr->names_off > idx->size || idx->size - hdr->names_off < hdr->names_size
+	|| hdr->names_size == 0 || idx->map[hdr->names_off + hdr->names_size - 1] != '\0') {
+		return "names out of range";
+	}
+	if (hdr->nentries == 0) return "no root entry";
+	if (hdr->entries_off % sizeof(uint64_t) || hdr->children_off % sizeof(uint32_t)) {
+		return "misaligned";
+	}
+
+	uint32_t i;
+	for (i = 0; i < hdr->nentries; i++) {
+		const struct bindex_entry *e = &idx->entries[i];
+		if (e->path_off >= hdr->names_size || e->name_off >= hdr->names_size) {
+			return "path out of range";
+		}
+		if (e->children > hdr->nchildren || hdr->nchildren - e->children < e->nchildren) {
+			return "child list out of range";
+		}
+	}
+	for (i = 0; i < hdr->nchildren; i++) {
+		if (idx->children[i] >= hdr->nentries) return "child out of range";
+	}
+
+	return NULL;
+}
+
+/**
+ * Check that the directories of the branch are still those the index was
+ * built from. Adding, removing or renaming anything changes the mtime of
+ * its directory, only modifications of files in place go unnoticed.
+ */
+static const char *check_branch(const bindex_t *idx, int branch_fd) {
+	static char err[PATHLEN_MAX + 64];
+
+	uint32_t i;
+	for (i = 0; i < idx->hdr->nentries; i++) {
+		const struct bindex_entry *e = &idx->entries[i];
+		if (!S_ISDIR(e->mode)) continue;
+
+		const char *path = idx->names + e->path_off;
+		struct stat st;
+		if (fstatat(branch_fd, *path ? path : ".", &st, AT_SYMLINK_NOFOLLOW) == -1
+		|| st.st_ino != e->ino || BINDEX_MTIME(&st) != (int64_t)e->mtime_sec * 1000000000 + e->mtime_nsec) {
+			snprintf(err, sizeof(err), "the branch was modified at /%s", path);
+			return err;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Map the index file and check it belongs to the branch, which is open
+ * as branch_fd. With verify all directories of the branch are compared
+ * with the index, otherwise only its root. Errors are fatal, as the index
+ * is given on the command line.
+ */
+bindex_t *bindex_open(const char *file, int branch_fd, bool verify) {
+	int fd = open(file, O_RDONLY);
+	if (fd == -1) {
+		fprintf(stderr, "Failed to open index %s: %s\n", file, strerror(errno));
+		return NULL;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		fprintf(stderr, "Failed to stat index %s: %s\n", file, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	bindex_t *idx = calloc(1, sizeof(bindex_t));
+	if (idx == NULL) {
+		fprintf(stderr, "%s: out of memory\n", __func__);
+		close(fd);
+		return NULL;
+	}
+
+	idx->size = st.st_size;
+	idx->map = idx->size ? mmap(NULL, idx->size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (idx->map == MAP_FAILED) {
+		fprintf(stderr, "Failed to map index %s: %s\n", file,
+			idx->size ? strerror(errno) : "empty file");
+		free(idx);
+		return NULL;
+	}
+
+	idx->hdr = (const struct bindex_header *)idx->map;
+	if (idx->size >= sizeof(struct bindex_header)) {
+		idx->entries = (const struct bindex_entry *)(idx->map + idx->hdr->entries_off);
+		idx->children = (const uint32_t *)(idx->map + idx->hdr->children_off);
+		idx->names = idx->map + idx->hdr->names_off;
+	}
+
+	const char *err = check_index(idx);
+
+	struct stat root;
+	if (!err && (fstat(branch_fd, &root) == -1 || root.st_ino != idx->hdr->root_ino
+	|| BINDEX_MTIME(&root) != idx->hdr->root_mtime)) {
+		err = "it was built for a different branch or the branch was modified";
+	}
+	if (!err && verify) err = check_branch(idx, branch_fd);
+	if (!err) idx->dev = root.st_dev;
+
+	if (err) {
+		fprintf(stderr, "Index %s can't be used: %s\n", file, err);
+		munmap((void *)idx->map, idx->size);
+		free(idx);
+		return NULL;
+	}
+
+	// we are going to need most of it anyway
+	madvise((void *)idx->map, idx->size, MADV_WILLNEED);
+
+	return idx;
+}
+
+/**
+ * Look up a normalized path in the index, NULL if it's not there.
+ */
+static const struct bindex_entry *find_entry(const bindex_t *idx, const char *p) {
+	uint64_t hash = bindex_hash(p);
+
+	// find the first entry with this hash
+	uint32_t lo = 0, hi = idx->hdr->nentries;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (idx->entries[mid].hash < hash) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	for (; lo < idx->hdr->nentries && idx->entries[lo].hash == hash; lo++) {
+		const struct bindex_entry *e = &idx->entries[lo];
+		if (strcmp(idx->names + e->path_off, p) == 0) return e;
+	}
+
+	return NULL;
+}
+
+/**
+ * p is not in the index, find out why from its nearest parent which is.
+ * Sets errno to ENOENT, ENOTDIR or BINDEX_ESYMLINK, which the index can't
+ * resolve. p is modified.
+ */
+static void not_found(const bindex_t *idx, char *p) {
+	char *slash;
+	while ((slash = strrchr(p, '/')) != NULL) {
+		*slash = '\0';
+
+		const struct bindex_entry *e = find_entry(idx, p);
+		if (e == NULL) continue;
+
+		if (S_ISLNK(e->mode)) {
+			errno = BINDEX_ESYMLINK;
+		} else if (!S_ISDIR(e->mode)) {
+			errno = ENOTDIR;
+		} else {
+			errno = ENOENT;
+		}
+		return;
+	}
+
+	// not even the top level directory exists
+	errno = ENOENT;
+}
+
+/**
+ * Look up a union path, NULL with errno set if it's not on the branch
+ * (ENOENT, ENOTDIR), too long (ENAMETOOLONG) or below a symlink, which
+ * has to be followed by the file system (BINDEX_ESYMLINK).
+ */
+const struct bindex_entry *bindex_lookup(const bindex_t *idx, const char *path) {
+	// normalizing never makes it longer
+	if (strlen(path) >= PATHLEN_MAX) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	// normalize to the format of the index, e.g. "/dir1//dir2/" -> "dir1/dir2"
+	char p[PATHLEN_MAX];
+	char *w = p;
+	while (*path) {
+		while (*path == '/') path++;
+		if (*path == '\0') break;
+
+		if (w != p) *w++ = '/';
+		while (*path && *path != '/') *w++ = *path++;
+	}
+	*w = '\0';
+
+	const struct bindex_entry *e = find_entry(idx, p);
+	if (e == NULL) not_found(idx, p);
+
+	return e;
+}
+
+void bindex_to_stat(const bindex_t *idx, const struct bindex_entry *e, struct stat *st) {
+	memset(st, 0, sizeof(*st));
+
+	st->st_dev = idx->dev;
+	st->st_ino = e->ino;
+	st->st_mode = e->mode;
+	st->st_nlink = e->nlink;
+	st->st_uid = e->uid;
+	st->st_gid = e->gid;
+	st->st_rdev = e->rdev;
+	st->st_size = e->size;
+	st->st_blocks = e->blocks;
+	st->st_blksize = 4096;
+#ifdef __APPLE__
+	st->st_atimespec.tv_sec = e->atime_sec;
+	st->st_atimespec.tv_nsec = e->atime_nsec;
+	st->st_mtimespec.tv_sec = e->mtime_sec;
+	st->st_mtimespec.tv_nsec = e->mtime_nsec;
+	st->st_ctimespec.tv_sec = e->ctime_sec;
+	st->st_ctimespec.tv_nsec = e->ctime_nsec;
+#else
+	st->st_atim.tv_sec = e->atime_sec;
+	st->st_atim.tv_nsec = e->atime_nsec;
+	st->st_mtim.tv_sec = e->mtime_sec;
+	st->st_mtim.tv_nsec = e->mtime_nsec;
+	st->st_ctim.tv_sec = e->ctime_sec;
+	st->st_ctim.tv_nsec = e->ctime_nsec;
+#endif
+}
+
+/**
+ * lstat() from the index, returns like lstat()
+ */
+int bindex_lstat(const bindex_t *idx, const char *path, struct stat *st) {
+	const struct bindex_entry *e = bindex_lookup(idx, path);
+	if (e == NULL) return -1;
+
+	bindex_to_stat(idx, e, st);
+	return 0;
+}
+
+/**
+ * The n-th entry of directory dir, NULL after the last one.
+ */
+const struct bindex_entry *bindex_child(const bindex_t *idx, const struct bindex_entry *dir, uint32_t n) {
+	if (n >= dir->nchildren) return NULL;
+
+	return &idx->entries[idx->children[dir->children + n]];
+}
+
+/**
+ * The last path element of e, e.g. "file" for "dir/file"
+ */
+const char *bindex_name(const bindex_t *idx, const struct bindex_entry *e) {
+	return idx->names + e->name_off;
+}
@@ -0,0 +1,99 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+* On-disk index of a read-only branch, written by unionfs-index and
+* mmap'ed by unionfs (-o branch_index=). All numbers are in host byte
+* order, so the index has to be built on the same architecture.
+*
+* The file is a header, followed by the entries sorted by (hash, path),
+* an array of entry numbers for the directory children (sorted by name
+* within each directory) and the NUL terminated paths. Paths are relative
+* to the branch root without leading or trailing slashes, the root itself
+* is "".
+*/
+
+#ifndef BRANCH_INDEX_H
+#define BRANCH_INDEX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define BINDEX_MAGIC "UFSINDEX"
+#define BINDEX_VERSION 1
+
+#define BINDEX_WHITEOUT 0x1 // a .unionfs/..._HIDDEN~ entry
+
+struct bindex_header {
+	char magic[8];		// BINDEX_MAGIC, not NUL terminated
+	uint32_t version;
+	uint32_t nentries;
+	uint64_t entries_off;	// struct bindex_entry[nentries]
+	uint64_t children_off;	// uint32_t[nchildren]
+	uint64_t nchildren;
+	uint64_t names_off;	// NUL terminated paths
+	uint64_t names_size;
+	uint64_t root_ino;	// to check the index belongs to the branch
+	int64_t root_mtime;	// in ns
+};
+
+#ifdef __APPLE__
+	#define BINDEX_MTIME(st) ((int64_t)(st)->st_mtimespec.tv_sec * 1000000000 + (st)->st_mtimespec.tv_nsec)
+#else
+	#define BINDEX_MTIME(st) ((int64_t)(st)->st_mtim.tv_sec * 1000000000 + (st)->st_mtim.tv_nsec)
+#endif
+
+struct bindex_entry {
+	uint64_t hash;		// bindex_hash() of the path
+	uint64_t ino;
+	uint64_t size;
+	uint64_t blocks;
+	uint64_t rdev;
+	int64_t atime_sec;
+	int64_t mtime_sec;
+	int64_t ctime_sec;
+	uint32_t atime_nsec;
+	uint32_t mtime_nsec;
+	uint32_t ctime_nsec;
+	uint32_t mode;
+	uint32_t nlink;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t path_off;	// offset of the path in the names
+	uint32_t name_off;	// offset of the last path element in the names
+	uint32_t children;	// first child in the children array
+	uint32_t nchildren;
+	uint32_t flags;		// BINDEX_*
+};
+
+/**
+ * 64-bit FNV-1a hash of a normalized path
+ */
+static inline uint64_t bindex_hash(const char *path) {
+	uint64_t hash = 14695981039346656037ULL;
+
+	while (*path) {
+		hash ^= (unsigned char)*path++;
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+// bindex_lookup() of a path below a symlink, only the file system can resolve it
+#define BINDEX_ESYMLINK EXDEV
+
+typedef struct bindex bindex_t;
+
+bindex_t *bindex_open(const char *file, int branch_fd, bool verify);
+int bindex_lstat(const bindex_t *idx, const char *path, struct stat *st);
+const struct bindex_entry *bindex_lookup(const bindex_t *idx, const char *path);
+const struct bindex_entry *bindex_child(const bindex_t *idx, const struct bindex_entry *dir, uint32_t n);
+const char *bindex_name(const bindex_t *idx, const struct bindex_entry *e);
+void bindex_to_stat(const bindex_t *idx, const struct bindex_entry *e, struct stat *st);
+
+#endif
@@ -16,16 +16,147 @@
 #include <errno.h>
 #include <stdio.h>
 #include <dirent.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
 
 #include "opts.h"
 #include "findbranch.h"
 #include "general.h"
 #include "cow.h"
 #include "cow_utils.h"
+#include "branch.h"
+#include "lookup_cache.h"
+#include "bloom.h"
+#include "name_set.h"
+#include "readdir.h"
 #include "string.h"
+#include "hashtable.h"
 #include "debug.h"
 #include "usyslog.h"
 
+// a copy-up in progress, see cow_single_flight()
+typedef struct {
+	bool done;
+	int res;		// of the copy
+	int err;		// errno, if res != 0
+	unsigned int refs;	// the copying caller and the waiting ones
+	pthread_cond_t cond;	// signalled when done
+} inflight_t;
+
+static pthread_mutex_t inflight_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct hashtable *inflight;	// union path -> inflight_t
+static uint64_t ninflight_waits;	// callers which waited for another copy-up
+
+/**
+ * Called with inflight_lock held
+ */
+static void put_inflight(inflight_t *f) {
+	if (--f->refs > 0) return;
+
+	pthread_cond_destroy(&f->cond);
+	free(f);
+}
+
+/**
+ * Copy up path by calling copy(arg), but only once at a time: callers
+ * coming in while path is copied up wait for that copy and get its result
+ * instead of copying (and truncating) the file again. copy() needs to check
+ * if path was copied up by an earlier caller already.
+ */
+int cow_single_flight(const char *path, int (*copy)(void *arg), void *arg) {
+	DBG("%s\n", path);
+
+	pthread_mutex_lock(&inflight_lock);
+
+	if (inflight == NULL) inflight = create_hashtable(64, string_hash, string_equal);
+
+	inflight_t *f = inflight ? hashtable_search(inflight, (void *)path) : NULL;
+	if (f) {
+		DBG("waiting for the copy-up of %s\n", path);
+		f->refs++;
+		ninflight_waits++;
+		while (!f->done) pthread_cond_wait(&f->cond, &inflight_lock);
+
+		int res = f->res;
+		int err = f->err;
+		put_inflight(f);
+		pthread_mutex_unlock(&inflight_lock);
+
+		errno = err;
+		RETURN(res);
+	}
+
+	if (inflight) {
+		f = calloc(1, sizeof(inflight_t));
+		char *key = strdup(path);
+		if (f == NULL || key == NULL || !hashtable_insert(inflight, key, f)) {
+			// out of memory, copy without telling the others
+			free(f);
+			free(key);
+			f = NULL;
+		} else {
+			f->refs = 1;
+			pthread_cond_init(&f->cond, NULL);
+		}
+	}
+
+	pthread_mutex_unlock(&inflight_lock);
+
+	int res = copy(arg);
+	int err = errno;
+
+	if (f) {
+		pthread_mutex_lock(&inflight_lock);
+		hashtable_remove(inflight, (void *)path); // frees the key
+		f->done = true;
+		f->res = res;
+		f->err = err;
+		pthread_cond_broadcast(&f->cond);
+		put_inflight(f);
+		pthread_mutex_unlock(&inflight_lock);
+	}
+
+	errno = err;
+	RETURN(res);
+}
+
+struct cow_file_args {
+	const char *path;
+	int branch_ro;
+	int branch_rw;
+	const struct stat *st;
+};
+
+static int copy_up(void *arg) {
+	struct cow_file_args *args = arg;
+
+	// copied up by an earlier caller, while we looked up path
+	struct stat st;
+	if (branch_lstat(args->branch_rw, args->path, &st) == 0) return 0;
+
+	return cow_cp(args->path, args->branch_ro, args->branch_rw, args->st, false);
+}
+
+/**
+ * cow_cp() of a single file, concurrent calls for the same path only copy
+ * it once, see cow_single_flight().
+ */
+int cow_cp_file(const char *path, int branch_ro, int branch_rw, const struct stat *st) {
+	struct cow_file_args args = { path, branch_ro, branch_rw, st };
+
+	return cow_single_flight(path, copy_up, &args);
+}
+
+int cow_inflight_print_stats(char *buf, size_t size) {
+	pthread_mutex_lock(&inflight_lock);
+	int len = snprintf(buf, size, "copy-up in flight: %u paths, %" PRIu64 " callers waited for "
+		"another copy-up of the same path\n", inflight ? hashtable_count(inflight) : 0,
+		ninflight_waits);
+	pthread_mutex_unlock(&inflight_lock);
+
+	return len;
+}
 
 /**
  * l_nbranch (lower nbranch than nbranch) is write protected, create the dir path on
@@ -56,22 +187,15 @@ int path_create_cutlast_cow(const char *path, int nbranch_ro, int nbranch_rw) {
 
 /**
  * initiate the cow-copy action
+ * @st	- lstat() of path on branch_ro if the caller has it already, or NULL
  */
-int cow_cp(const char *path, int branch_ro, int branch_rw, bool recursive) {
+int cow_cp(const char *path, int branch_ro, int branch_rw, const struct stat *st, bool recursive) {
 	DBG("%s\n", path);
 
 	// create the path to the file
 	int res = path_create_cutlast_cow(path, branch_ro, branch_rw);
 	if (res != 0) RETURN(res);
 
-	char from[PATHLEN_MAX], to[PATHLEN_MAX];
-	if (BUILD_PATH(from, uopt.branches[branch_ro].path, path)) {
-		RETURN(-ENAMETOOLONG);
-	}
-	if (BUILD_PATH(to, uopt.branches[branch_rw].path, path)) {
-		RETURN(-ENAMETOOLONG);
-	}
-
 	setlocale(LC_ALL, "");
 
 	struct cow cow;
@@ -82,11 +206,16 @@ int cow_cp(const char *path, int branch_ro, int branch_rw, bool recursive) {
 	cow.umask = umask(0);
 	umask(cow.umask);
 
-	cow.from_path = from;
-	cow.to_path = to;
+	cow.path = path;
+	cow.from_branch = branch_ro;
+	cow.to_branch = branch_rw;
 
 	struct stat buf;
-	lstat(cow.from_path, &buf);
+	if (st) {
+		buf = *st;
+	} else if (branch_lstat(branch_ro, path, &buf)) {
+		RETURN(1); // removed in the mean time?
+	}
 	cow.stat = &buf;
 
 	switch (buf.st_mode & S_IFMT) {
@@ -108,12 +237,21 @@ int cow_cp(const char *path, int branch_ro, int branch_rw, bool recursive) {
 			res = copy_fifo(&cow);
 			break;
 		case S_IFSOCK:
-			USYSLOG(LOG_WARNING, "COW of sockets not supported: %s\n", cow.from_path);
+			USYSLOG(LOG_WARNING, "COW of sockets not supported: %s\n", cow.path);
 			RETURN(1);
 		default:
 			res = copy_file(&cow);
 	}
 
+	if (res == 0) bloom_add(branch_rw, path, buf.st_mode);
+
+	// path now resolves to branch_rw, a recursive copy moves a whole sub-tree
+	if (recursive && S_ISDIR(buf.st_mode)) {
+		lcache_invalidate_all();
+	} else {
+		lcache_invalidate(path);
+	}
+
 	RETURN(res);
 }
 
@@ -129,15 +267,34 @@ int copy_directory(const char *path, int branch_ro, int branch_rw) {
 		RETURN(res);
 	}
 
-	/* determine path to source directory on read-only branch */
-	char from[PATHLEN_MAX];
-	if (BUILD_PATH(from, uopt.branches[branch_ro].path, path)) RETURN(1);
+	// Source files hidden by a higher branch must not be copied. Only rw
+	// branches can have whiteouts, collect them once for all members.
+	name_set_t hidden;
+	name_set_init(&hidden);
+	bool all_hidden = false;
+	for (int i = 0; i < branch_ro; i++) {
+		if (!uopt.branches[i].rw) continue;
+
+		res = path_hidden(path, i);
+		if (res < 0) {
+			name_set_free(&hidden);
+			RETURN(res);
+		}
+		if (res > 0) {
+			all_hidden = true;
+			break;
+		}
+		read_whiteouts(path, &hidden, i);
+	}
 
-	DIR *dp = opendir(from);
-	if (dp == NULL) RETURN(1);
+	branch_dir_t *dp = all_hidden ? NULL : branch_opendir(branch_ro, path);
+	if (dp == NULL) {
+		name_set_free(&hidden);
+		RETURN(all_hidden ? 0 : 1);
+	}
 
 	struct dirent *de;
-	while ((de = readdir(dp)) != NULL) {
+	while ((de = branch_readdir(dp)) != NULL) {
 		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
 
 		char member[PATHLEN_MAX];
@@ -158,37 +315,17 @@ int copy_directory(const char *path, int branch_ro, int branch_rw) {
 			continue;
 		}
 
-		// If source file is hidden by a higher branch, we should not copy
-		// anything. We do this by iterating through all higher branches and
-		// checking if they have a whiteout. This is somewhat inefficient, but
-		// it is the only simple way to handle this case. A more complex
-		// solution would be to collect whiteouts to a hashtable, as has been
-		// done in readdir.
-		bool skip = false;
-		for (int i = 0; i < branch_ro; i++) {
-			// Assuming that only rw branches can have whiteouts
-			if (uopt.branches[i].rw) {
-				int hidden = path_hidden(member, i);
-				if (hidden > 0) {
-					// File was hidden, skip it
-					DBG("file %s copy skipped, hidden by layer %i\n", member, i);
-					skip = true;
-					break;
-				} else if (hidden < 0) {
-					// error in path_hidden
-					res = hidden;
-					break;
-				}
-			}
+		if (name_set_contains(&hidden, de->d_name)) {
+			DBG("file %s copy skipped, hidden by a higher branch\n", member);
+			continue;
 		}
-		if (res != 0) break;
-		if (skip) continue;
 
-		res = cow_cp(member, branch_ro, branch_rw, true);
+		res = cow_cp(member, branch_ro, branch_rw, NULL, true);
 		if (res != 0) break;
 	}
 
-	closedir(dp);
+	branch_closedir(dp);
+	name_set_free(&hidden);
 	RETURN(res);
 }
 
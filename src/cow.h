@@ -9,9 +9,12 @@
 
 #include <sys/stat.h>
 
-int cow_cp(const char *path, int branch_ro, int branch_rw, bool recursive);
+int cow_cp(const char *path, int branch_ro, int branch_rw, const struct stat *st, bool recursive);
+int cow_cp_file(const char *path, int branch_ro, int branch_rw, const struct stat *st);
+int cow_single_flight(const char *path, int (*copy)(void *arg), void *arg);
 int path_create_cow(const char *path, int nbranch_ro, int nbranch_rw);
 int path_create_cutlast_cow(const char *path, int nbranch_ro, int nbranch_rw);
 int copy_directory(const char *path, int branch_ro, int branch_rw);
+int cow_inflight_print_stats(char *buf, size_t size);
 
 #endif
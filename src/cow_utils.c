@@ -30,6 +30,10 @@
  *	This file was taken from OpenBSD and modified to fit the unionfs requirements.
  */
 
+#if defined __linux__
+	// For copy_file_range()
+	#define _GNU_SOURCE
+#endif
 
 #include <err.h>
 #include <errno.h>
@@ -37,12 +41,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <unistd.h>
-#include <utime.h>
-#include <sys/mman.h>
 #include <sys/stat.h>
 
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#endif
+
 #include "unionfs.h"
+#include "opts.h"
+#include "string.h"
+#include "branch.h"
 #include "cow_utils.h"
 #include "debug.h"
 #include "general.h"
@@ -53,35 +65,245 @@
 #define S_ISTXT S_ISVTX
 #endif
 
+#ifdef __linux__
+// from <linux/fs.h>, which conflicts with <sys/mount.h>
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+#endif
+
+#define COPY_CHUNK (1024 * 1024 * 1024)	// per copy_file_range() and sendfile() call
+#define COPY_BUFSIZE (128 * 1024)
+
+// the ways copy_data() copies files, cheapest first
+enum copy_method {
+	COPY_REFLINK,
+	COPY_RANGE,
+	COPY_SENDFILE,
+	COPY_BUFFERED,
+	COPY_METHODS
+};
+
+static const char *const copy_method_names[COPY_METHODS] = {
+	"reflink", "copy_file_range", "sendfile", "buffered"
+};
+
+static uint64_t copy_files[COPY_METHODS];	// files finished by the method
+static uint64_t copy_bytes[COPY_METHODS];	// bytes copied by it
+
+static void count_copy(enum copy_method method, off_t bytes, bool done) {
+	__atomic_add_fetch(&copy_bytes[method], bytes, __ATOMIC_RELAXED);
+	if (done) __atomic_add_fetch(&copy_files[method], 1, __ATOMIC_RELAXED);
+}
+
+#ifdef __linux__
+/**
+ * The method is not possible for these files, try the next one.
+ */
+static bool copy_unsupported(int err) {
+	return err == EXDEV || err == ENOSYS || err == EOPNOTSUPP || err == EINVAL || err == ENOTTY;
+}
+#endif
+
+struct copy_state {
+	enum copy_method method;	// the cheapest method which works for the files
+	char *buf;			// COPY_BUFSIZE bytes for COPY_BUFFERED
+	off_t eof;			// where from_fd ended unexpectedly, -1 if it didn't
+};
+
+/**
+ * Copy up to len bytes at off with the current method, return the number
+ * of bytes copied, 0 at the end of from_fd or -1 with errno set.
+ */
+static ssize_t copy_chunk(int from_fd, int to_fd, off_t off, size_t len, struct copy_state *cs) {
+	off_t off_in = off;
+	ssize_t n;
+
+	switch (cs->method) {
+#ifdef __linux__
+	case COPY_RANGE: {
+		off_t off_out = off;
+		return copy_file_range(from_fd, &off_in, to_fd, &off_out, len, 0);
+	}
+	case COPY_SENDFILE:
+		// sendfile() writes at the file position of to_fd
+		if (lseek(to_fd, off, SEEK_SET) == -1) return -1;
+		return sendfile(to_fd, from_fd, &off_in, len);
+#endif
+	default:
+		if (cs->buf == NULL && (cs->buf = malloc(COPY_BUFSIZE)) == NULL) return -1;
+
+		n = pread(from_fd, cs->buf, len < COPY_BUFSIZE ? len : COPY_BUFSIZE, off);
+		ssize_t written = 0;
+		while (written < n) {
+			ssize_t wcount = pwrite(to_fd, cs->buf + written, n - written, off + written);
+			if (wcount == -1) return -1;
+			written += wcount;
+		}
+		return n;
+	}
+}
+
+/**
+ * Copy the bytes from off to end of from_fd to to_fd. If the method is not
+ * supported for the files, the next one continues where it stopped. If
+ * from_fd ends before end, cs->eof is set to where it ended.
+ * Returns 0 or -1 with errno set.
+ */
+static int copy_range(int from_fd, int to_fd, off_t off, off_t end, struct copy_state *cs) {
+	while (off < end) {
+		size_t len = end - off < COPY_CHUNK ? (size_t)(end - off) : COPY_CHUNK;
+
+		ssize_t n = copy_chunk(from_fd, to_fd, off, len, cs);
+		if (n == 0) {
+#ifdef __linux__
+			// copy_file_range() and sendfile() return 0 for some files
+			// (e.g. in /proc, on some FUSE and network file systems)
+			// which do have data, only a read() tells
+			if (cs->method != COPY_BUFFERED) {
+				cs->method++;
+				continue;
+			}
+#endif
+			// the file got shorter
+			cs->eof = off;
+			break;
+		}
+		if (n == -1) {
+#ifdef __linux__
+			if (cs->method != COPY_BUFFERED && copy_unsupported(errno)) {
+				cs->method++;
+				continue;
+			}
+#endif
+			return -1;
+		}
+
+		count_copy(cs->method, n, false);
+		off += n;
+	}
+
+	return 0;
+}
+
+/**
+ * Copy the data regions of from_fd (size bytes) to the empty to_fd, the
+ * holes of sparse files are left as holes. A reflink shares the blocks
+ * without copying anything, copy_file_range() lets the file system copy
+ * without reading the data to user space (server side on NFS 4.2) and
+ * sendfile() at least avoids the copy to user space.
+ * Returns 0 or -1 with errno set.
+ */
+static int copy_data(int from_fd, int to_fd, off_t size) {
+#ifdef __linux__
+	if (ioctl(to_fd, FICLONE, from_fd) == 0) {
+		count_copy(COPY_REFLINK, size, true);
+		return 0;
+	}
+	if (!copy_unsupported(errno)) return -1;
+
+	struct copy_state cs = { COPY_RANGE, NULL, -1 };
+#else
+	struct copy_state cs = { COPY_BUFFERED, NULL, -1 };
+#endif
+	int res = 0;
+
+	off_t off, data, hole;
+	for (off = 0; off < size; off = hole) {
+#ifdef SEEK_DATA
+		data = lseek(from_fd, off, SEEK_DATA);
+		if (data == -1) {
+			if (errno == ENXIO) break; // only a hole up to the end
+			if (errno != EINVAL) {
+				res = -1;
+				break;
+			}
+			// not supported, all data then
+			data = off;
+		}
+		if (data >= size) break;
+		hole = lseek(from_fd, data, SEEK_HOLE);
+		if (hole == -1 || hole > size) hole = size;
+#else
+		data = off;
+		hole = size;
+#endif
+
+		res = copy_range(from_fd, to_fd, data, hole, &cs);
+		if (res || cs.eof != -1) break;
+	}
+
+	// a hole at the end, but not beyond where the file ended while copying
+	if (res == 0) res = ftruncate(to_fd, cs.eof != -1 ? cs.eof : size);
+	if (res == 0) count_copy(cs.method, 0, true);
+
+	int err = errno;
+	free(cs.buf);
+	errno = err;
+
+	return res;
+}
+
 /**
- * set the stat() data of a file
+ * Copy the bytes from off to end of from_fd to to_fd, for files which are
+ * copied in parts. Returns 0 or -1 with errno set.
+ */
+int cow_copy_range(int from_fd, int to_fd, off_t off, off_t end) {
+#ifdef __linux__
+	struct copy_state cs = { COPY_RANGE, NULL, -1 };
+#else
+	struct copy_state cs = { COPY_BUFFERED, NULL, -1 };
+#endif
+
+	int res = copy_range(from_fd, to_fd, off, end, &cs);
+
+	int err = errno;
+	free(cs.buf);
+	errno = err;
+
+	return res;
+}
+
+int cow_print_stats(char *buf, size_t size) {
+	int len = snprintf(buf, size, "copy-up:");
+
+	int i;
+	for (i = 0; i < COPY_METHODS; i++) {
+		size_t left = (size_t)len < size ? size - len : 0;
+		len += snprintf(left ? buf + len : NULL, left, "%s %" PRIu64 " files / %" PRIu64 " KiB %s",
+			i ? "," : "", __atomic_load_n(&copy_files[i], __ATOMIC_RELAXED),
+			__atomic_load_n(&copy_bytes[i], __ATOMIC_RELAXED) / 1024, copy_method_names[i]);
+	}
+
+	size_t left = (size_t)len < size ? size - len : 0;
+	len += snprintf(left ? buf + len : NULL, left, "\n");
+
+	return len;
+}
+
+/**
+ * set the stat() data of path on branch
  **/
-int setfile(const char *path, struct stat *fs)
+int setfile(int branch, const char *path, struct stat *fs)
 {
 	DBG("%s\n", path);
 
-#ifdef __APPLE__
-	struct utimbuf ut;
-#else
 	struct timespec ut[2];
-#endif
 	int rval = 0;
 
 	fs->st_mode &= S_ISUID | S_ISGID | S_ISTXT | S_IRWXU | S_IRWXG | S_IRWXO;
 
-// TODO: bring the macos version in line with the linux one. but macos does not seem to have st_atim and st_mtim defined (but has st_atimespec and st_mtimespec) - investigate!
-// https://developer.apple.com/library/archive/documentation/System/Conceptual/ManPages_iPhoneOS/man2/stat.2.html
+	// macos does not have st_atim and st_mtim, but st_atimespec and st_mtimespec
+	// https://developer.apple.com/library/archive/documentation/System/Conceptual/ManPages_iPhoneOS/man2/stat.2.html
 #ifdef __APPLE__
-	ut.actime  = fs->st_atime;
-	ut.modtime = fs->st_mtime;
-	if (utime(path, &ut)) {
-		USYSLOG(LOG_WARNING, "utimes: %s", path);
+	ut[0] = fs->st_atimespec;
+	ut[1] = fs->st_mtimespec;
 #else
 	ut[0] = fs->st_atim;
 	ut[1] = fs->st_mtim;
-	if (utimensat(AT_FDCWD, path, ut, 0)) {
-		USYSLOG(LOG_WARNING, "utimensat: %s", path);
 #endif
+	if (branch_utimens(branch, path, ut)) {
+		USYSLOG(LOG_WARNING, "utimensat: %s", path);
 		rval = 1;
 	}
 	/*
@@ -90,7 +312,7 @@ int setfile(const char *path, struct stat *fs)
 	* the mode; current BSD behavior is to remove all setuid bits on
 	* chown.  If chown fails, lose setuid/setgid bits.
 	*/
-	if (chown(path, fs->st_uid, fs->st_gid)) {
+	if (branch_chown(branch, path, fs->st_uid, fs->st_gid)) {
 		/* EPERM if no permissions
 		 * EINVAL if user was nobody or group was nogroup */
 		if (errno != EPERM && errno != EINVAL) {
@@ -100,8 +322,8 @@ int setfile(const char *path, struct stat *fs)
 		fs->st_mode &= ~(S_ISTXT | S_ISUID | S_ISGID);
 	}
 
-	if (chmod(path, fs->st_mode)) {
-		USYSLOG(LOG_WARNING, "chown: %s", path);
+	if (branch_chmod(branch, path, fs->st_mode)) {
+		USYSLOG(LOG_WARNING, "chmod: %s", path);
 		rval = 1;
 	}
 
@@ -114,7 +336,8 @@ int setfile(const char *path, struct stat *fs)
 		 * on a file that we copied, i.e., that we didn't create.)
 		 */
 		errno = 0;
-		if (chflags(path, fs->st_flags)) {
+		char p[PATHLEN_MAX];
+		if (BUILD_PATH(p, uopt.branches[branch].path, path) == 0 && chflags(p, fs->st_flags)) {
 			if (errno != EOPNOTSUPP || fs->st_flags != 0) {
 				USYSLOG(LOG_WARNING, "chflags: %s", path);
 				rval = 1;
@@ -128,11 +351,11 @@ int setfile(const char *path, struct stat *fs)
 /**
  * set the stat() data of a link
  **/
-static int setlink(const char *path, struct stat *fs)
+static int setlink(int branch, const char *path, struct stat *fs)
 {
 	DBG("%s\n", path);
 
-	if (lchown(path, fs->st_uid, fs->st_gid)) {
+	if (branch_lchown(branch, path, fs->st_uid, fs->st_gid)) {
 		if (errno != EPERM) {
 			USYSLOG(LOG_WARNING, "lchown: %s", path);
 			RETURN(1);
@@ -147,70 +370,31 @@ static int setlink(const char *path, struct stat *fs)
  **/
 int copy_file(struct cow *cow)
 {
-	DBG("from %s to %s\n", cow->from_path, cow->to_path);
+	DBG("%s from %d to %d\n", cow->path, cow->from_branch, cow->to_branch);
 
-	static char buf[MAXBSIZE];
 	struct stat to_stat, *fs;
-	int from_fd, rcount, to_fd, wcount;
+	int from_fd, to_fd;
 	int rval = 0;
-#ifdef VM_AND_BUFFER_CACHE_SYNCHRONIZED
-	char *p;
-#endif
 
-	if ((from_fd = open(cow->from_path, O_RDONLY, 0)) == -1) {
-		USYSLOG(LOG_WARNING, "%s", cow->from_path);
+	if ((from_fd = branch_open(cow->from_branch, cow->path, O_RDONLY, 0)) == -1) {
+		USYSLOG(LOG_WARNING, "%s", cow->path);
 		RETURN(1);
 	}
 
 	fs = cow->stat;
 
-	to_fd = open(cow->to_path, O_WRONLY | O_TRUNC | O_CREAT,
+	to_fd = branch_open(cow->to_branch, cow->path, O_WRONLY | O_TRUNC | O_CREAT,
 	             fs->st_mode & ~(S_ISTXT | S_ISUID | S_ISGID));
 
 	if (to_fd == -1) {
-		USYSLOG(LOG_WARNING, "%s", cow->to_path);
+		USYSLOG(LOG_WARNING, "%s", cow->path);
 		(void)close(from_fd);
 		RETURN(1);
 	}
 
-	/*
-	 * Mmap and write if less than 8M (the limit is so we don't totally
-	 * trash memory on big files.  This is really a minor hack, but it
-	 * wins some CPU back.
-	 */
-#ifdef VM_AND_BUFFER_CACHE_SYNCHRONIZED
-	if (fs->st_size > 0 && fs->st_size <= 8 * 1048576) {
-		if ((p = mmap(NULL, (size_t)fs->st_size, PROT_READ,
-		    MAP_FILE|MAP_SHARED, from_fd, (off_t)0)) == MAP_FAILED) {
-			USYSLOG(LOG_WARNING, "mmap: %s", cow->from_path);
-			rval = 1;
-		} else {
-			madvise(p, fs->st_size, MADV_SEQUENTIAL);
-			if (write(to_fd, p, fs->st_size) != fs->st_size) {
-				USYSLOG(LOG_WARNING, "%s", cow->to_path);
-				rval = 1;
-			}
-			/* Some systems don't unmap on close(2). */
-			if (munmap(p, fs->st_size) < 0) {
-				USYSLOG(LOG_WARNING, "%s", cow->from_path);
-				rval = 1;
-			}
-		}
-	} else
-#endif
-	{
-		while ((rcount = read(from_fd, buf, MAXBSIZE)) > 0) {
-			wcount = write(to_fd, buf, rcount);
-			if (rcount != wcount || wcount == -1) {
-				USYSLOG(LOG_WARNING, "%s", cow->to_path);
-				rval = 1;
-				break;
-			}
-		}
-		if (rcount < 0) {
-			USYSLOG(LOG_WARNING, "copy failed: %s", cow->from_path);
-			rval = 1;
-		}
+	if (copy_data(from_fd, to_fd, fs->st_size)) {
+		USYSLOG(LOG_WARNING, "copy failed: %s: %s", cow->path, strerror(errno));
+		rval = 1;
 	}
 
 	if (rval == 1) {
@@ -219,7 +403,7 @@ int copy_file(struct cow *cow)
 		RETURN(1);
 	}
 
-	if (setfile(cow->to_path, cow->stat))
+	if (setfile(cow->to_branch, cow->path, cow->stat))
 		rval = 1;
 	/*
 	 * If the source was setuid or setgid, lose the bits unless the
@@ -229,17 +413,17 @@ int copy_file(struct cow *cow)
 	(S_ISUID | S_ISGID | S_ISVTX | S_IRWXU | S_IRWXG | S_IRWXO)
 	else if (fs->st_mode & (S_ISUID | S_ISGID) && fs->st_uid == cow->uid) {
 		if (fstat(to_fd, &to_stat)) {
-			USYSLOG(LOG_WARNING, "%s", cow->to_path);
+			USYSLOG(LOG_WARNING, "%s", cow->path);
 			rval = 1;
 		} else if (fs->st_gid == to_stat.st_gid &&
 		    fchmod(to_fd, fs->st_mode & RETAINBITS & ~cow->umask)) {
-			USYSLOG(LOG_WARNING, "%s", cow->to_path);
+			USYSLOG(LOG_WARNING, "%s", cow->path);
 			rval = 1;
 		}
 	}
 	(void)close(from_fd);
 	if (close(to_fd)) {
-		USYSLOG(LOG_WARNING, "%s", cow->to_path);
+		USYSLOG(LOG_WARNING, "%s", cow->path);
 		rval = 1;
 	}
 
@@ -251,24 +435,24 @@ int copy_file(struct cow *cow)
  */
 int copy_link(struct cow *cow)
 {
-	DBG("from %s to %s\n", cow->from_path, cow->to_path);
+	DBG("%s from %d to %d\n", cow->path, cow->from_branch, cow->to_branch);
 
 	int len;
 	char link[PATHLEN_MAX];
 
-	if ((len = readlink(cow->from_path, link, sizeof(link)-1)) == -1) {
-		USYSLOG(LOG_WARNING, "readlink: %s", cow->from_path);
+	if ((len = branch_readlink(cow->from_branch, cow->path, link, sizeof(link)-1)) == -1) {
+		USYSLOG(LOG_WARNING, "readlink: %s", cow->path);
 		RETURN(1);
 	}
 
 	link[len] = '\0';
 
-	if (symlink(link, cow->to_path)) {
+	if (branch_symlink(link, cow->to_branch, cow->path)) {
 		USYSLOG(LOG_WARNING, "symlink: %s", link);
 		RETURN(1);
 	}
 
-	RETURN(setlink(cow->to_path, cow->stat));
+	RETURN(setlink(cow->to_branch, cow->path, cow->stat));
 }
 
 /**
@@ -277,13 +461,13 @@ int copy_link(struct cow *cow)
  **/
 int copy_fifo(struct cow *cow)
 {
-	DBG("from %s to %s\n", cow->from_path, cow->to_path);
+	DBG("%s from %d to %d\n", cow->path, cow->from_branch, cow->to_branch);
 
-	if (mkfifo(cow->to_path, cow->stat->st_mode)) {
-		USYSLOG(LOG_WARNING, "mkfifo: %s", cow->to_path);
+	if (branch_mkfifo(cow->to_branch, cow->path, cow->stat->st_mode)) {
+		USYSLOG(LOG_WARNING, "mkfifo: %s", cow->path);
 		RETURN(1);
 	}
-	RETURN(setfile(cow->to_path, cow->stat));
+	RETURN(setfile(cow->to_branch, cow->path, cow->stat));
 }
 
 /**
@@ -292,11 +476,11 @@ int copy_fifo(struct cow *cow)
  */
 int copy_special(struct cow *cow)
 {
-	DBG("from %s to %s\n", cow->from_path, cow->to_path);
+	DBG("%s from %d to %d\n", cow->path, cow->from_branch, cow->to_branch);
 
-	if (mknod(cow->to_path, cow->stat->st_mode, cow->stat->st_rdev)) {
-		USYSLOG(LOG_WARNING, "mknod: %s", cow->to_path);
+	if (branch_mknod(cow->to_branch, cow->path, cow->stat->st_mode, cow->stat->st_rdev)) {
+		USYSLOG(LOG_WARNING, "mknod: %s", cow->path);
 		RETURN(1);
 	}
-	RETURN(setfile(cow->to_path, cow->stat));
+	RETURN(setfile(cow->to_branch, cow->path, cow->stat));
 }
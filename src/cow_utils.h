@@ -7,29 +7,27 @@
 #ifndef COW_UTILS_H
 #define COW_UTILS_H
 
-#define VM_AND_BUFFER_CACHE_SYNCHRONIZED
-
-// this is defined on bsd systems (thus, also on macos) but linux lacks it
-#ifndef MAXBSIZE
-	#define MAXBSIZE 4096  // TODO: isn't this too low? some bsds have this at 16k, macos seems to have this at (256 * 4096)
-#endif
-
 struct cow {
 	mode_t umask;
 	uid_t uid;
 
+	// the union path, the same on both branches
+	const char *path;
+
 	// source file
-	char  *from_path;
+	int from_branch;
 	struct stat *stat;
 
 	// destination file
-	char *to_path;
+	int to_branch;
 };
 
-int setfile(const char *path, struct stat *fs);
+int setfile(int branch, const char *path, struct stat *fs);
 int copy_special(struct cow *cow);
 int copy_fifo(struct cow *cow);
 int copy_link(struct cow *cow);
 int copy_file(struct cow *cow);
+int cow_copy_range(int from_fd, int to_fd, off_t off, off_t end);
+int cow_print_stats(char *buf, size_t size);
 
 #endif
@@ -41,12 +41,17 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <inttypes.h>
 
 #include "unionfs.h"
 #include "opts.h"
 #include "general.h"
+#include "branch.h"
 #include "cow.h"
 #include "findbranch.h"
+#include "lookup_cache.h"
+#include "bloom.h"
+#include "probe.h"
 #include "string.h"
 #include "debug.h"
 #include "usyslog.h"
@@ -56,15 +61,8 @@ bool branch_contains_path(int branch, const char *path, bool *is_dir) {
 		RETURN(false);
 	}
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[branch].path, path)) {
-		errno = ENAMETOOLONG;
-		RETURN(false);
-	}
-
-	printf("***** p: %s\n", p);
 	struct stat stbuf;
-	int res = lstat(p, &stbuf);
+	int res = branch_lstat(branch, path, &stbuf);
 
 	if (res == 0) {
 		(*is_dir) = S_ISDIR(stbuf.st_mode);
@@ -94,29 +92,125 @@ bool branch_contains_file_or_parent_dir(int branch, const char *path) {
 	RETURN(found && is_dir);
 }
 
+/**
+ * Return the dirmask (see lcache_set_dirmask()) of the parent directory
+ * of path, path can't be on any other branch. If it is not cached yet, the
+ * parent is looked up on all branches once, which pays off as soon as a
+ * few entries of the directory are looked up.
+ * Returns all bits set if we don't know.
+ */
+static uint64_t parent_dirmask(const char *path) {
+	uint64_t dirmask = ~(uint64_t)0;
+
+	if (!lcache_enabled() || uopt.nbranches > LCACHE_MAX_BRANCHES) return dirmask;
+
+	char dname[PATHLEN_MAX];
+	if (strlen(path) >= PATHLEN_MAX) return dirmask;
+	strcpy(dname, path);
+
+	char *slash = strrchr(dname, '/');
+	if (slash == NULL || slash[1] == '\0') return dirmask; // the root itself
+	if (slash == dname) slash++; // keep the root as "/"
+	*slash = '\0';
+
+	if (lcache_lookup_dirmask(dname, &dirmask)) return dirmask;
+
+	unsigned int seq = lcache_seq();
+
+	uint64_t mask = 0;
+	int top = -1;
+	filetype_t type = NOT_EXISTING;
+
+	int i;
+	for (i = 0; i < uopt.nbranches; i++) {
+		struct stat stbuf;
+		if (bloom_maybe(i, dname) && branch_lstat(i, dname, &stbuf) == 0) {
+			if (top < 0) {
+				top = i;
+				type = S_ISDIR(stbuf.st_mode) ? IS_DIR : IS_FILE;
+			}
+			// a symlink might point to a directory
+			if (S_ISDIR(stbuf.st_mode) || S_ISLNK(stbuf.st_mode)) mask |= BRANCH_BIT(i);
+		}
+
+		// nothing below a whiteout is visible
+		int res = path_hidden(dname, i);
+		if (res < 0) return dirmask;
+		if (res > 0) break;
+	}
+
+	DBG("%s: %" PRIx64 "\n", dname, mask);
+
+	// we know everything find_branch() would find out, too
+	lcache_insert(dname, top, type, seq);
+	lcache_set_dirmask(dname, mask, seq);
+
+	return mask;
+}
+
 /**
  *  Find a branch that has "path". Return the branch number.
+ *  If st is not NULL, it's filled with the lstat() of path on that branch,
+ *  which we need to do anyway to find it.
  */
-static int find_branch(const char *path, searchflag_t flag) {
+static int find_branch(const char *path, searchflag_t flag, struct stat *st) {
 	DBG("%s\n", path);
 
+	// the cache only knows the top-most branch, so it can't help RWONLY
+	if (flag == RWRO) {
+		int branch;
+		filetype_t type;
+		if (lcache_lookup(path, &branch, &type)) {
+			if (branch < 0) {
+				errno = ENOENT;
+				RETURN(-1);
+			}
+			if (st == NULL || branch_lstat(branch, path, st) == 0) RETURN(branch);
+
+			// removed behind our back, look it up again
+			lcache_invalidate(path);
+		}
+	}
+
+	unsigned int seq = lcache_seq();
+
+	// with -o io_uring, look at all branches at once
+	mode_t modes[uopt.nbranches];
+	int hidden[uopt.nbranches];
+	bool probed = probe_branches(path, modes, hidden) == 0;
+
+	// otherwise skip the branches the parent directory is not on
+	uint64_t dirmask = probed ? ~(uint64_t)0 : parent_dirmask(path);
+
+	bool want_stat = st != NULL;
+	struct stat stbuf;
+	if (st == NULL) st = &stbuf;
+
 	int i = 0;
 	for (i = 0; i < uopt.nbranches; i++) {
-		char p[PATHLEN_MAX];
-		if (BUILD_PATH(p, uopt.branches[i].path, path)) {
-			errno = ENAMETOOLONG;
-			RETURN(-1);
+		int res;
+		if (probed && modes[i] && want_stat) {
+			// the probe only asks for the file type
+			res = branch_lstat(i, path, st);
+		} else if (probed) {
+			st->st_mode = modes[i];
+			res = modes[i] ? 0 : -1;
+		} else if (i < LCACHE_MAX_BRANCHES && !(dirmask & BRANCH_BIT(i))) {
+			res = -1;
+		} else if (!bloom_maybe(i, path)) {
+			res = -1;
+		} else {
+			res = branch_lstat(i, path, st);
+			if (res == -1 && errno == ENOENT) bloom_false_positive(i);
 		}
 
-		struct stat stbuf;
-		int res = lstat(p, &stbuf);
-
-		DBG("%s: res = %d\n", p, res);
+		DBG("%s%s: res = %d\n", uopt.branches[i].path, path, res);
 
 		if (res == 0) { // path was found
 			switch (flag) {
 			case RWRO:
 				// any path we found is fine
+				lcache_insert(path, i, S_ISDIR(st->st_mode) ? IS_DIR : IS_FILE, seq);
 				RETURN(i);
 			case RWONLY:
 				// we need a rw-branch
@@ -128,9 +222,10 @@ static int find_branch(const char *path, searchflag_t flag) {
 		}
 
 		// check check for a hide file, checking first here is the magic to hide files *below* this level
-		res = path_hidden(path, i);
+		res = probed ? hidden[i] : path_hidden(path, i);
 		if (res > 0) {
 			// So no path, but whiteout found. No need to search in further branches
+			if (flag == RWRO) lcache_insert(path, -1, NOT_EXISTING, seq);
 			errno = ENOENT;
 			RETURN(-1);
 		} else if (res < 0) {
@@ -139,6 +234,7 @@ static int find_branch(const char *path, searchflag_t flag) {
 		}
 	}
 
+	if (flag == RWRO) lcache_insert(path, -1, NOT_EXISTING, seq);
 	errno = ENOENT;
 	RETURN(-1);
 }
@@ -148,7 +244,17 @@ static int find_branch(const char *path, searchflag_t flag) {
  */
 int find_rorw_branch(const char *path) {
 	DBG("%s\n", path);
-	int res = find_branch(path, RWRO);
+	int res = find_branch(path, RWRO, NULL);
+	RETURN(res);
+}
+
+/**
+ * Find a ro or rw branch and return the lstat() of path on it in st, so
+ * the caller does not need to lstat() it once more.
+ */
+int find_rorw_branch_stat(const char *path, struct stat *st) {
+	DBG("%s\n", path);
+	int res = find_branch(path, RWRO, st);
 	RETURN(res);
 }
 
@@ -240,7 +346,8 @@ int find_rw_branch_cutlast(const char *path) {
 int find_rw_branch_cow(const char *path) {
 	DBG("%s\n", path);
 
-	int branch_rorw = find_rorw_branch(path);
+	struct stat st;
+	int branch_rorw = find_rorw_branch_stat(path, &st);
 
 	// not found anywhere
 	if (branch_rorw < 0) RETURN(-1);
@@ -261,7 +368,7 @@ int find_rw_branch_cow(const char *path) {
 		RETURN(-1);
 	}
 
-	if (cow_cp(path, branch_rorw, branch_rw, false)) RETURN(-1);
+	if (cow_cp_file(path, branch_rorw, branch_rw, &st)) RETURN(-1);
 
 	// remove a file that might hide the copied file
 	remove_hidden(path, branch_rw);
@@ -321,7 +428,7 @@ int find_rw_branch_cow_recursive(const char *path) {
 			// Recursive copy. File overwriting is not allowed so previously
 			// copied higher priority branches are not overwritten.
 			DBG("starting recursive copy from %i to %i\n", i, branch_rw);
-			if (cow_cp(path, i, branch_rw, true)) RETURN(-1);
+			if (cow_cp(path, i, branch_rw, NULL, true)) RETURN(-1);
 		}
 	}
 
@@ -17,6 +17,9 @@
 	// For chroot
 	#define _BSD_SOURCE // this is deprecated since glibc 2.20 but let's keep it for a while
 	#define _DEFAULT_SOURCE 1
+
+	// For copy_file_range(), fallocate() and SEEK_DATA/SEEK_HOLE
+	#define _GNU_SOURCE
 #endif
 
 #include <fuse.h>
@@ -53,6 +56,14 @@
 #include "debug.h"
 #include "findbranch.h"
 #include "general.h"
+#include "branch.h"
+#include "lookup_cache.h"
+#include "whiteout_index.h"
+#include "bloom.h"
+#include "watch.h"
+#include "passthrough.h"
+#include "lazy_copy.h"
+#include "stats.h"
 
 #include "unlink.h"
 #include "rmdir.h"
@@ -67,7 +78,13 @@
 static int unionfs_chmod(const char *path, mode_t mode) {
 #else
 static int unionfs_chmod(const char *path, mode_t mode, struct fuse_file_info *fi) {
-	(void) fi;  // just to prevent the compiler complaining about unused variables
+	// the kernel only passes writable files, so fi->fh is on a rw branch
+	if (fi) {
+		DBG("fd = %"PRIx64"\n", fi->fh);
+
+		if (fchmod(fi->fh, mode) == -1) RETURN(-errno);
+		RETURN(0);
+	}
 #endif
 
 	DBG("%s\n", path);
@@ -75,14 +92,7 @@ static int unionfs_chmod(const char *path, mode_t mode, struct fuse_file_info *f
 	int i = find_rw_branch_cow(path);
 	if (i == -1) RETURN(-errno);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
-
-  #ifdef UNIONFS_HAVE_AT
-    int res = fchmodat(AT_FDCWD, p, mode, AT_SYMLINK_NOFOLLOW);
-  #else
-    int res = chmod(p, mode);
-  #endif
+	int res = branch_lchmod(i, path, mode);
 
 	if (res == -1) RETURN(-errno);
 
@@ -93,7 +103,12 @@ static int unionfs_chmod(const char *path, mode_t mode, struct fuse_file_info *f
 static int unionfs_chown(const char *path, uid_t uid, gid_t gid) {
 #else
 static int unionfs_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi) {
-	(void) fi;  // just to prevent the compiler complaining about unused variables
+	if (fi) {
+		DBG("fd = %"PRIx64"\n", fi->fh);
+
+		if (fchown(fi->fh, uid, gid) == -1) RETURN(-errno);
+		RETURN(0);
+	}
 #endif
 
 	DBG("%s\n", path);
@@ -101,10 +116,7 @@ static int unionfs_chown(const char *path, uid_t uid, gid_t gid, struct fuse_fil
 	int i = find_rw_branch_cow(path);
 	if (i == -1) RETURN(-errno);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
-
-	int res = lchown(p, uid, gid);
+	int res = branch_lchown(i, path, uid, gid);
 	if (res == -1) RETURN(-errno);
 
 	RETURN(0);
@@ -120,26 +132,28 @@ static int unionfs_create(const char *path, mode_t mode, struct fuse_file_info *
 	int i = find_rw_branch_cutlast(path);
 	if (i == -1) RETURN(-errno);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
-
 	// NOTE: We should do:
 	//       Create the file with mode=0 first, otherwise we might create
 	//       a file as root + x-bit + suid bit set, which might be used for
 	//       security racing!
-	int res = open(p, fi->flags, 0);
-	if (res == -1) RETURN(-errno);
+	int fd = branch_open(i, path, fi->flags, 0);
+	if (fd == -1) RETURN(-errno);
+
+	lcache_invalidate(path);
+	bloom_add(i, path, S_IFREG);
 
-	set_owner(p); // no error check, since creating the file succeeded
+	set_owner(i, path); // no error check, since creating the file succeeded
 
 	// NOW, that the file has the proper owner we may set the requested mode
-	fchmod(res, mode);
+	fchmod(fd, mode);
 
 	if (uopt.direct_io) {
 		fi->direct_io = 1;
 	}
 
-	fi->fh = res;
+	passthrough_open(path, fd, fi);
+
+	fi->fh = fd;
 	remove_hidden(path, i);
 
 	DBG("fd = %" PRIx64 "\n", fi->fh);
@@ -200,20 +214,17 @@ static int unionfs_fsync(const char *path, int isdatasync, struct fuse_file_info
 static int unionfs_getattr(const char *path, struct stat *stbuf) {
 #else
 static int unionfs_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
+	// A file opened read-only might have been copied up by another opener
+	// since, so fi->fh is not the union view; look the path up instead.
 	(void) fi;  // just to prevent the compiler complaining about unused variables
 #endif
 
 	DBG("%s\n", path);
 
-	int i = find_rorw_branch(path);
+	// finding the branch lstat()s path anyway
+	int i = find_rorw_branch_stat(path, stbuf);
 	if (i == -1) RETURN(-errno);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
-
-	int res = lstat(p, stbuf);
-	if (res == -1) RETURN(-errno);
-
 	/* This is a workaround for broken gnu find implementations. Actually,
 	 * n_links is not defined at all for directories by posix. However, it
 	 * seems to be common for filesystems to set it to one if the actual value
@@ -273,6 +284,25 @@ static void *unionfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
 		}
 	}
 
+	// needs to be done after chroot, the branch paths are relative to it
+	windex_init();
+	bloom_init();
+	watch_init();
+	lazy_init();
+
+#ifdef FUSE_CAP_SPLICE_READ
+	// splice() only pays off for large requests, so it is optional
+	if (uopt.splice) {
+		conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+	} else {
+		conn->want &= ~(FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+	}
+#endif
+
+#if FUSE_USE_VERSION >= 30
+	passthrough_init(conn);
+#endif
+
 #ifdef FUSE_CAP_IOCTL_DIR
 	if (conn->capable & FUSE_CAP_IOCTL_DIR)
 		conn->want |= FUSE_CAP_IOCTL_DIR;
@@ -281,6 +311,16 @@ static void *unionfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
 	return NULL;
 }
 
+/**
+ * destroy method, called on unmount
+ */
+static void unionfs_destroy(void *private_data) {
+	(void) private_data;
+
+	// files still to be copied would be left with holes
+	lazy_destroy();
+}
+
 static int unionfs_link(const char *from, const char *to) {
 	DBG("from %s to %s\n", from, to);
 
@@ -293,13 +333,12 @@ static int unionfs_link(const char *from, const char *to) {
 
 	DBG("from branch: %d to branch: %d\n", i, j);
 
-	char f[PATHLEN_MAX], t[PATHLEN_MAX];
-	if (BUILD_PATH(f, uopt.branches[i].path, from)) RETURN(-ENAMETOOLONG);
-	if (BUILD_PATH(t, uopt.branches[j].path, to)) RETURN(-ENAMETOOLONG);
-
-	int res = link(f, t);
+	int res = branch_link(i, from, j, to);
 	if (res == -1) RETURN(-errno);
 
+	lcache_invalidate(to);
+	bloom_add_tree(j, to); // might be a hard link to a symlink
+
 	// no need for set_owner(), since owner and permissions are copied over by link()
 
 	remove_hidden(to, i); // remove hide file (if any)
@@ -339,6 +378,9 @@ static int unionfs_ioctl(const char *path, unsigned int cmd, void *arg, struct f
 		debug_init();
 		return 0;
 	}
+	case UNIONFS_GET_STATS:
+		stats_print((char *) data, _IOC_SIZE(cmd));
+		return 0;
 	default:
 		USYSLOG(LOG_ERR, "Unknown ioctl: %d", cmd);
 		return -EINVAL;
@@ -360,15 +402,15 @@ static int unionfs_mkdir(const char *path, mode_t mode) {
 	int i = find_rw_branch_cutlast(path);
 	if (i == -1) RETURN(-errno);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
-
-	int res = mkdir(p, 0);
+	int res = branch_mkdir(i, path, 0);
 	if (res == -1) RETURN(-errno);
 
-	set_owner(p); // no error check, since creating the file succeeded
+	lcache_invalidate(path);
+	bloom_add(i, path, S_IFDIR);
+
+	set_owner(i, path); // no error check, since creating the file succeeded
 	// NOW, that the file has the proper owner we may set the requested mode
-	chmod(p, mode);
+	branch_chmod(i, path, mode);
 
 	RETURN(0);
 }
@@ -379,9 +421,6 @@ static int unionfs_mknod(const char *path, mode_t mode, dev_t rdev) {
 	int i = find_rw_branch_cutlast(path);
 	if (i == -1) RETURN(-errno);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
-
 	int file_type = mode & S_IFMT;
 	int file_perm = mode & (S_PROT_MASK);
 
@@ -394,10 +433,14 @@ static int unionfs_mknod(const char *path, mode_t mode, dev_t rdev) {
 
 		USYSLOG (LOG_INFO, "deprecated mknod workaround, tell the unionfs-fuse authors if you see this!\n");
 
-		res = creat(p, 0);
+		res = branch_open(i, path, O_CREAT | O_WRONLY | O_TRUNC, 0);
 		if (res > 0 && close(res) == -1) USYSLOG(LOG_WARNING, "Warning, cannot close file\n");
 #ifdef __APPLE__
 	} else if ((file_type) == S_IFSOCK) {
+		// there is no bindat(), so we need the full path here
+		char p[PATHLEN_MAX];
+		if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
+
         int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
 
         if (sockfd >= 0) {
@@ -413,14 +456,17 @@ static int unionfs_mknod(const char *path, mode_t mode, dev_t rdev) {
         }
 #endif
 	} else {
-		res = mknod(p, file_type, rdev);
+		res = branch_mknod(i, path, file_type, rdev);
 	}
 
 	if (res == -1) RETURN(-errno);
 
-	set_owner(p); // no error check, since creating the file succeeded
+	lcache_invalidate(path);
+	bloom_add(i, path, file_type);
+
+	set_owner(i, path); // no error check, since creating the file succeeded
 	// NOW, that the file has the proper owner we may set the requested mode
-	chmod(p, file_perm);
+	branch_chmod(i, path, file_perm);
 
 	remove_hidden(path, i);
 
@@ -432,17 +478,14 @@ static int unionfs_open(const char *path, struct fuse_file_info *fi) {
 
 	int i;
 	if (fi->flags & (O_WRONLY | O_RDWR)) {
-		i = find_rw_branch_cutlast(path);
+		i = lazy_cow(path, fi->flags);
 	} else {
 		i = find_rorw_branch(path);
 	}
 
 	if (i == -1) RETURN(-errno);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
-
-	int fd = open(p, fi->flags);
+	int fd = branch_open(i, path, fi->flags, 0);
 	if (fd == -1) RETURN(-errno);
 
 	if (fi->flags & (O_WRONLY | O_RDWR)) {
@@ -458,6 +501,15 @@ static int unionfs_open(const char *path, struct fuse_file_info *fi) {
 		fi->direct_io = 1;
 	}
 
+	int res = lazy_open(fd);
+	if (res < 0) {
+		close(fd);
+		RETURN(res);
+	}
+
+	// -o lazy_copyup and -o passthrough exclude each other
+	passthrough_open(path, fd, fi);
+
 	fi->fh = (unsigned long)fd;
 
 	DBG("fd = %"PRIx64"\n", fi->fh);
@@ -469,23 +521,47 @@ static int unionfs_read(const char *path, char *buf, size_t size, off_t offset,
 
 	DBG("fd = %"PRIx64"\n", fi->fh);
 
-	int res = pread(fi->fh, buf, size, offset);
+	int res = lazy_pread(fi->fh, buf, size, offset);
 
 	if (res == -1) RETURN(-errno);
 
 	RETURN(res);
 }
 
+/**
+ * Let libfuse read the data from the branch file, with -o splice it moves
+ * it into /dev/fuse without copying it through our memory.
+ */
+static int unionfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+	(void) path;  // just to prevent the compiler complaining about unused variables
+
+	DBG("fd = %"PRIx64"\n", fi->fh);
+
+	// partly still on the read-only branch
+	int res = lazy_read_buf(fi->fh, size, offset, bufp);
+	if (res < 0) RETURN(res);
+	if (res > 0) RETURN(0);
+
+	struct fuse_bufvec *src = malloc(sizeof(struct fuse_bufvec));
+	if (src == NULL) RETURN(-ENOMEM);
+
+	*src = FUSE_BUFVEC_INIT(size);
+	src->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	src->buf[0].fd = fi->fh;
+	src->buf[0].pos = offset;
+
+	*bufp = src; // freed by libfuse
+
+	RETURN(0);
+}
+
 static int unionfs_readlink(const char *path, char *buf, size_t size) {
 	DBG("%s\n", path);
 
 	int i = find_rorw_branch(path);
 	if (i == -1) RETURN(-errno);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
-
-	int res = readlink(p, buf, size - 1);
+	int res = branch_readlink(i, path, buf, size - 1);
 
 	if (res == -1) RETURN(-errno);
 
@@ -499,6 +575,9 @@ static int unionfs_release(const char *path, struct fuse_file_info *fi) {
 
 	DBG("fd = %"PRIx64"\n", fi->fh);
 
+	passthrough_release(fi->fh);
+	lazy_release(fi->fh);
+
 	int res = close(fi->fh);
 	if (res == -1) RETURN(-errno);
 
@@ -518,14 +597,16 @@ static int unionfs_rename(const char *from, const char *to, unsigned int flags)
 	DBG("from %s to %s\n", from, to);
 
 	int res;
-	bool is_dir = false; // is 'from' a file or directory
 
 	int j = find_rw_branch_cutlast(to);
 	if (j == -1) RETURN(-errno);
 
-	int i = find_rorw_branch(from);
+	struct stat st;
+	int i = find_rorw_branch_stat(from, &st);
 	if (i == -1) RETURN(-errno);
 
+	bool is_dir = S_ISDIR(st.st_mode); // is 'from' a file or directory
+
 	if (uopt.preserve_branch && uopt.branches[i].rw) {
 		int existing = find_rorw_branch(to);
 
@@ -548,16 +629,6 @@ static int unionfs_rename(const char *from, const char *to, unsigned int flags)
 		}
 	}
 
-	char f[PATHLEN_MAX], t[PATHLEN_MAX];
-	if (BUILD_PATH(f, uopt.branches[i].path, from)) RETURN(-ENAMETOOLONG);
-
-	filetype_t ftype = path_is_dir(f);
-	if (ftype == NOT_EXISTING) {
-		RETURN(-ENOENT);
-	} else if (ftype == IS_DIR) {
-		is_dir = true;
-	}
-
 	if (is_dir) {
 		i = find_rw_branch_cow_recursive(from);
 	} else if (!uopt.branches[i].rw) {
@@ -571,16 +642,6 @@ static int unionfs_rename(const char *from, const char *to, unsigned int flags)
 		RETURN(-EXDEV);
 	}
 
-	if (BUILD_PATH(f, uopt.branches[i].path, from)) RETURN(-ENAMETOOLONG);
-	if (BUILD_PATH(t, uopt.branches[i].path, to)) RETURN(-ENAMETOOLONG);
-
-	ftype = path_is_dir(f);
-	if (ftype == NOT_EXISTING) {
-		RETURN(-ENOENT);
-	} else if (ftype == IS_DIR) {
-		is_dir = true;
-	}
-
 	if (!uopt.branches[i].rw) {
 		// since original file is on a read-only branch, we copied the from file to a writable branch,
 		// but since we will rename from, we also need to hide the from file on the read-only branch
@@ -592,13 +653,13 @@ static int unionfs_rename(const char *from, const char *to, unsigned int flags)
 		if (res) RETURN(-errno);
 	}
 
-	res = rename(f, t);
+	res = branch_rename(i, from, to);
 
 	if (res == -1) {
 		int err = errno; // unlink() might overwrite errno
 		// if from was on a read-only branch we copied it, but now rename failed so we need to delete it
 		if (!uopt.branches[i].rw) {
-			if (unlink(f)) {
+			if (branch_unlink(i, from)) {
 				USYSLOG(LOG_ERR, "%s: cow of %s succeeded, but rename() failed and now "
 					"also unlink()  failed\n", __func__, from);
 			}
@@ -611,6 +672,17 @@ static int unionfs_rename(const char *from, const char *to, unsigned int flags)
 		RETURN(-err);
 	}
 
+	// a renamed directory moves a whole sub-tree
+	if (is_dir) {
+		lcache_invalidate_all();
+		bloom_add_tree(i, to);
+	} else {
+		lcache_invalidate(from);
+		lcache_invalidate(to);
+		bloom_add(i, to, st.st_mode);
+	}
+	passthrough_rename(from, to);
+
 	if (uopt.branches[i].rw) {
 		// A lower branch still *might* have a file called 'from', we need to delete this.
 		// We only need to do this if we have been on a rw-branch, since we created
@@ -633,7 +705,7 @@ static int unionfs_rename(const char *from, const char *to, unsigned int flags)
  * the filesystem itself again - which would result in a deadlock.
  * TODO: BSD/MacOSX
  */
-static int statvfs_local(const char *path, struct statvfs *stbuf) {
+static int statvfs_local(int fd, struct statvfs *stbuf) {
 #ifdef linux
 	/* glibc's statvfs walks /proc/mounts and stats entries found there
 	 * in order to extract their mount flags, which may deadlock if they
@@ -641,7 +713,7 @@ static int statvfs_local(const char *path, struct statvfs *stbuf) {
 	 * ourselves.
 	 */
 	struct statfs stfs;
-	int res = statfs(path, &stfs);
+	int res = fstatfs(fd, &stfs);
 	if (res == -1) RETURN(res);
 
 	memset(stbuf, 0, sizeof(*stbuf));
@@ -668,7 +740,7 @@ static int statvfs_local(const char *path, struct statvfs *stbuf) {
 
 	RETURN(0);
 #else
-	RETURN(statvfs(path, stbuf));
+	RETURN(fstatvfs(fd, stbuf));
 #endif
 }
 
@@ -691,14 +763,14 @@ static int unionfs_statfs(const char *path, struct statvfs *stbuf) {
 	int i = 0;
 	for (i = 0; i < uopt.nbranches; i++) {
 		struct statvfs stb;
-		int res = statvfs_local(uopt.branches[i].path, &stb);
+		int res = statvfs_local(uopt.branches[i].fd, &stb);
 		if (res == -1) {
 			retVal = -errno;
 			break;
 		}
 
 		struct stat st;
-		res = stat(uopt.branches[i].path, &st);
+		res = fstat(uopt.branches[i].fd, &st);
 		if (res == -1) {
 			retVal = -errno;
 			break;
@@ -754,13 +826,13 @@ static int unionfs_symlink(const char *from, const char *to) {
 	int i = find_rw_branch_cutlast(to);
 	if (i == -1) RETURN(-errno);
 
-	char t[PATHLEN_MAX];
-	if (BUILD_PATH(t, uopt.branches[i].path, to)) RETURN(-ENAMETOOLONG);
-
-	int res = symlink(from, t);
+	int res = branch_symlink(from, i, to);
 	if (res == -1) RETURN(-errno);
 
-	set_owner(t); // no error check, since creating the file succeeded
+	lcache_invalidate(to);
+	bloom_add(i, to, S_IFLNK);
+
+	set_owner(i, to); // no error check, since creating the file succeeded
 
 	remove_hidden(to, i); // remove hide file (if any)
 	RETURN(0);
@@ -770,7 +842,13 @@ static int unionfs_symlink(const char *from, const char *to) {
 static int unionfs_truncate(const char *path, off_t size) {
 #else
 static int unionfs_truncate(const char *path, off_t size, struct fuse_file_info *fi) {
-	(void) fi;  // just to prevent the compiler complaining about unused variables
+	if (fi) {
+		DBG("fd = %"PRIx64"\n", fi->fh);
+
+		lazy_truncate(fi->fh, size);
+		if (ftruncate(fi->fh, size) == -1) RETURN(-errno);
+		RETURN(0);
+	}
 #endif
 
 	DBG("%s\n", path);
@@ -781,6 +859,7 @@ static int unionfs_truncate(const char *path, off_t size, struct fuse_file_info
 	char p[PATHLEN_MAX];
 	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
 
+	lazy_truncate_path(i, path, size);
 	int res = truncate(p, size);
 
 	if (res == -1) RETURN(-errno);
@@ -792,7 +871,12 @@ static int unionfs_truncate(const char *path, off_t size, struct fuse_file_info
 static int unionfs_utimens(const char *path, const struct timespec ts[2]) {
 #else
 static int unionfs_utimens(const char *path, const struct timespec ts[2], struct fuse_file_info *fi) {
-	(void) fi;  // just to prevent the compiler complaining about unused variables
+	if (fi) {
+		DBG("fd = %"PRIx64"\n", fi->fh);
+
+		if (futimens(fi->fh, ts) == -1) RETURN(-errno);
+		RETURN(0);
+	}
 #endif
 
 	DBG("%s\n", path);
@@ -800,19 +884,7 @@ static int unionfs_utimens(const char *path, const struct timespec ts[2], struct
 	int i = find_rw_branch_cow(path);
 	if (i == -1) RETURN(-errno);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
-
-#ifdef UNIONFS_HAVE_AT
-	int res = utimensat(0, p, ts, AT_SYMLINK_NOFOLLOW);
-#else
-	struct timeval tv[2];
-	tv[0].tv_sec = ts[0].tv_sec;
-	tv[0].tv_usec = ts[0].tv_nsec / 1000;
-	tv[1].tv_sec = ts[1].tv_sec;
-	tv[1].tv_usec = ts[1].tv_nsec / 1000;
-	int res = utimes(p, tv);
-#endif
+	int res = branch_utimens(i, path, ts);
 
 	if (res == -1) RETURN(-errno);
 
@@ -824,12 +896,136 @@ static int unionfs_write(const char *path, const char *buf, size_t size, off_t o
 
 	DBG("fd = %"PRIx64"\n", fi->fh);
 
-	int res = pwrite(fi->fh, buf, size, offset);
+	int res = lazy_prepare_write(fi->fh, offset, size);
+	if (res) RETURN(res);
+
+	res = pwrite(fi->fh, buf, size, offset);
 	if (res == -1) RETURN(-errno);
 
 	RETURN(res);
 }
 
+static int unionfs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
+	(void) path;  // just to prevent the compiler complaining about unused variables
+
+	DBG("fd = %"PRIx64"\n", fi->fh);
+
+	size_t size = fuse_buf_size(buf);
+	int res = lazy_prepare_write(fi->fh, offset, size);
+	if (res) RETURN(res);
+
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+	dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	dst.buf[0].fd = fi->fh;
+	dst.buf[0].pos = offset;
+
+	// splice() from the pipe of the request, if the kernel gave us one
+	res = fuse_buf_copy(&dst, buf, uopt.splice ? FUSE_BUF_SPLICE_NONBLOCK : FUSE_BUF_NO_SPLICE);
+
+	RETURN(res);
+}
+
+/**
+ * Preallocate or punch holes in the branch file, this keeps sparse files
+ * sparse and saves writing zeros.
+ */
+static int unionfs_fallocate(const char *path, int mode, off_t offset, off_t len, struct fuse_file_info *fi) {
+	(void) path;  // just to prevent the compiler complaining about unused variables
+
+	DBG("fd = %"PRIx64" mode %x\n", fi->fh, mode);
+
+	int res = lazy_finish(fi->fh);
+	if (res) RETURN(res);
+
+#ifdef __linux__
+	if (fallocate(fi->fh, mode, offset, len) == -1) RETURN(-errno);
+#else
+	// punching holes etc. is linux specific
+	if (mode) RETURN(-EOPNOTSUPP);
+
+	res = posix_fallocate(fi->fh, offset, len);
+	if (res) RETURN(-res);
+#endif
+
+	RETURN(0);
+}
+
+#if FUSE_USE_VERSION >= 30
+/**
+ * The kernel only asks for SEEK_DATA and SEEK_HOLE
+ */
+static off_t unionfs_lseek(const char *path, off_t off, int whence, struct fuse_file_info *fi) {
+	(void) path;  // just to prevent the compiler complaining about unused variables
+
+	DBG("fd = %"PRIx64" whence %d\n", fi->fh, whence);
+
+	// the holes of a file being copied lazily are not holes of the file
+	int err = lazy_finish(fi->fh);
+	if (err) RETURN(err);
+
+	off_t res = lseek(fi->fh, off, whence);
+	if (res == -1) RETURN(-errno);
+
+	DBG("return %jd\n", (intmax_t)res);
+	return res;
+}
+
+#define COPY_BUFSIZE (128 * 1024)
+
+/**
+ * Copy within the union, let the branch file systems do it if they can
+ * (reflinks, server side copies), otherwise copy it here. Either way the
+ * data doesn't go through the kernel and us twice.
+ */
+static ssize_t unionfs_copy_file_range(const char *path_in, struct fuse_file_info *fi_in, off_t offset_in,
+		const char *path_out, struct fuse_file_info *fi_out, off_t offset_out, size_t size, int flags) {
+	(void) path_in;  // just to prevent the compiler complaining about unused variables
+	(void) path_out;
+
+	DBG("fd = %"PRIx64" -> %"PRIx64"\n", fi_in->fh, fi_out->fh);
+
+	int err = lazy_finish(fi_in->fh);
+	if (err == 0) err = lazy_finish(fi_out->fh);
+	if (err) RETURN(err);
+
+#ifdef __linux__
+	ssize_t res = copy_file_range(fi_in->fh, &offset_in, fi_out->fh, &offset_out, size, flags);
+	if (res >= 0) {
+		DBG("return %zd\n", res);
+		return res;
+	}
+	// not supported by the kernel or between these file systems
+	if (errno != EXDEV && errno != ENOSYS && errno != EOPNOTSUPP) RETURN(-errno);
+#endif
+	if (flags) RETURN(-EINVAL);
+
+	char *buf = malloc(COPY_BUFSIZE);
+	if (buf == NULL) RETURN(-ENOMEM);
+
+	ssize_t copied = 0;
+	while ((size_t)copied < size) {
+		size_t n = size - copied < COPY_BUFSIZE ? size - copied : COPY_BUFSIZE;
+
+		ssize_t r = pread(fi_in->fh, buf, n, offset_in + copied);
+		if (r == 0) break; // end of file
+		if (r > 0) r = pwrite(fi_out->fh, buf, r, offset_out + copied);
+		if (r == -1) {
+			// report what we copied so far, the error comes with the next call
+			if (copied == 0) copied = -errno;
+			break;
+		}
+
+		copied += r;
+		if ((size_t)r < n) break;
+	}
+
+	free(buf);
+
+	DBG("return %zd\n", copied);
+	return copied;
+}
+#endif
+
 #ifdef HAVE_XATTR
 
 #if __APPLE__
@@ -930,14 +1126,18 @@ struct fuse_operations unionfs_oper = {
 	.getattr = unionfs_getattr,
 	.access = unionfs_access,
 	.init = unionfs_init,
+	.destroy = unionfs_destroy,
 	.ioctl = unionfs_ioctl,
 	.link = unionfs_link,
 	.mkdir = unionfs_mkdir,
 	.mknod = unionfs_mknod,
 	.open = unionfs_open,
 	.read = unionfs_read,
+	.read_buf = unionfs_read_buf,
 	.readlink = unionfs_readlink,
+	.opendir = unionfs_opendir,
 	.readdir = unionfs_readdir,
+	.releasedir = unionfs_releasedir,
 	.release = unionfs_release,
 	.rename = unionfs_rename,
 	.rmdir = unionfs_rmdir,
@@ -947,6 +1147,12 @@ struct fuse_operations unionfs_oper = {
 	.unlink = unionfs_unlink,
 	.utimens = unionfs_utimens,
 	.write = unionfs_write,
+	.write_buf = unionfs_write_buf,
+	.fallocate = unionfs_fallocate,
+#if FUSE_USE_VERSION >= 30
+	.copy_file_range = unionfs_copy_file_range,
+	.lseek = unionfs_lseek,
+#endif
 #ifdef HAVE_XATTR
 	.getxattr = unionfs_getxattr,
 	.listxattr = unionfs_listxattr,
@@ -30,13 +30,18 @@
 #include "cow_utils.h"
 #include "findbranch.h"
 #include "general.h"
+#include "branch.h"
+#include "lookup_cache.h"
+#include "bloom.h"
+#include "whiteout_index.h"
 #include "debug.h"
 #include "usyslog.h"
 
 /**
- * Check if a file or directory with the hidden flag exists.
+ * Check if a file or directory with the hidden flag exists on branch.
+ * path is relative to the branch, e.g. .unionfs/dir1
  */
-static int filedir_hidden(const char *path) {
+static int filedir_hidden(int branch, const char *path) {
 	// cow mode disabled, no need for hidden files
 	if (!uopt.cow_enabled) RETURN(false);
 
@@ -46,7 +51,7 @@ static int filedir_hidden(const char *path) {
 	DBG("%s\n", p);
 
 	struct stat stbuf;
-	int res = lstat(p, &stbuf);
+	int res = branch_lstat(branch, p, &stbuf);
 	if (res == 0) RETURN(1);
 
 	RETURN(0);
@@ -60,11 +65,13 @@ int path_hidden(const char *path, int branch) {
 
 	if (!uopt.cow_enabled) RETURN(false);
 
+	if (windex_enabled()) RETURN(windex_hidden(path, branch));
+
 	char whiteoutpath[PATHLEN_MAX];
-	if (BUILD_PATH(whiteoutpath, uopt.branches[branch].path, METADIR, path)) RETURN(false);
+	if (BUILD_PATH(whiteoutpath, METADIR, path)) RETURN(false);
 
 	// -1 as we MUST not end on the next path element
-	char *walk = whiteoutpath + uopt.branches[branch].path_len + strlen(METADIR) - 1;
+	char *walk = whiteoutpath + strlen(METADIR) - 1;
 
 	// first slashes, e.g. we have path = /dir1/dir2/, will set walk = dir1/dir2/
 	while (*walk == '/') walk++;
@@ -77,7 +84,7 @@ int path_hidden(const char *path, int branch) {
 		char p[PATHLEN_MAX];
 		// walk - path = strlen(/dir1)
 		snprintf(p, (walk - whiteoutpath) + 1, "%s", whiteoutpath);
-		int res = filedir_hidden(p);
+		int res = filedir_hidden(branch, p);
 		if (res) RETURN(res); // path is hidden or error
 
 		// as above the do loop, walk over the next slashes, walk = dir2/
@@ -101,13 +108,24 @@ int remove_hidden(const char *path, int maxbranch) {
 	int i;
 	for (i = 0; i <= maxbranch; i++) {
 		char p[PATHLEN_MAX];
-		if (BUILD_PATH(p, uopt.branches[i].path, METADIR, path)) RETURN(-ENAMETOOLONG);
-		if (strlen(p) + strlen(HIDETAG) > PATHLEN_MAX) RETURN(-ENAMETOOLONG);
-		strcat(p, HIDETAG); // TODO check length
-
-		switch (path_is_dir(p)) {
-			case IS_FILE: unlink(p); break;
-			case IS_DIR: rmdir(p); break;
+		if (BUILD_PATH(p, METADIR, path)) RETURN(-ENAMETOOLONG);
+		if (strlen(p) + strlen(HIDETAG) >= PATHLEN_MAX) RETURN(-ENAMETOOLONG);
+		strcat(p, HIDETAG);
+
+		switch (path_is_dir(i, p)) {
+			case IS_FILE:
+				if (branch_unlink(i, p) == 0) {
+					windex_remove(path, i);
+					lcache_invalidate(path);
+				}
+				break;
+			case IS_DIR:
+				// the whiteout directory did hide a whole sub-tree
+				if (branch_rmdir(i, p) == 0) {
+					windex_remove(path, i);
+					lcache_invalidate_all();
+				}
+				break;
 			case NOT_EXISTING: continue;
 		}
 	}
@@ -116,16 +134,16 @@ int remove_hidden(const char *path, int maxbranch) {
 }
 
 /**
- * check if path is a directory
+ * check if path is a directory on branch
  *
  * return proper types given by filetype_t
  */
-filetype_t path_is_dir(const char *path) {
+filetype_t path_is_dir(int branch, const char *path) {
 	DBG("%s\n", path);
 
 	struct stat buf;
 
-	if (lstat(path, &buf) == -1) RETURN(NOT_EXISTING);
+	if (branch_lstat(branch, path, &buf) == -1) RETURN(NOT_EXISTING);
 
 	if (S_ISDIR(buf.st_mode)) RETURN(IS_DIR);
 
@@ -147,18 +165,26 @@ static int do_create_whiteout(const char *path, int branch_rw, enum whiteout mod
 	path_create_cutlast_cow(metapath, branch_rw, branch_rw);
 
 	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[branch_rw].path, metapath)) RETURN(-1);
-	strcat(p, HIDETAG); // TODO check length
+	if (BUILD_PATH(p, metapath, HIDETAG)) RETURN(-1);
 
 	int res;
 	if (mode == WHITEOUT_FILE) {
-		res = open(p, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+		res = branch_open(branch_rw, p, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
 		if (res == -1) RETURN(-1);
 		res = close(res);
+		windex_add(path, branch_rw);
+		lcache_invalidate(path);
+		bloom_add(branch_rw, p, S_IFREG);
 	} else {
-		res = mkdir(p, S_IRWXU);
-		if (res)
-			USYSLOG(LOG_ERR, "Creating %s failed: %s\n", p, strerror(errno));
+		res = branch_mkdir(branch_rw, p, S_IRWXU);
+		if (res) {
+			USYSLOG(LOG_ERR, "Creating %s%s failed: %s\n",
+				uopt.branches[branch_rw].path, p, strerror(errno));
+		} else {
+			windex_add(path, branch_rw);
+			bloom_add(branch_rw, p, S_IFDIR);
+		}
+		lcache_invalidate_all();
 	}
 
 	RETURN(res);
@@ -199,12 +225,12 @@ int maybe_whiteout(const char *path, int branch_rw, enum whiteout mode) {
 }
 
 /**
- * Set file owner of after an operation, which created a file.
+ * Set file owner of after an operation, which created path on branch.
  */
-int set_owner(const char *path) {
+int set_owner(int branch, const char *path) {
 	struct fuse_context *ctx = fuse_get_context();
 	if (ctx->uid != 0 && ctx->gid != 0) {
-		int res = lchown(path, ctx->uid, ctx->gid);
+		int res = branch_lchown(branch, path, ctx->uid, ctx->gid);
 		if (res) {
 			USYSLOG(LOG_WARNING,
 			       ":%s: Setting the correct file owner failed: %s !\n",
@@ -221,11 +247,8 @@ int set_owner(const char *path) {
 static int do_create(const char *path, int nbranch_ro, int nbranch_rw) {
 	DBG("%s\n", path);
 
-	char dirp[PATHLEN_MAX]; // dir path to create
-	sprintf(dirp, "%s%s", uopt.branches[nbranch_rw].path, path);
-
 	struct stat buf;
-	int res = stat(dirp, &buf);
+	int res = branch_stat(nbranch_rw, path, &buf);
 	if (res != -1) RETURN(0); // already exists
 
 	if (nbranch_ro == nbranch_rw) {
@@ -234,34 +257,36 @@ static int do_create(const char *path, int nbranch_ro, int nbranch_rw) {
 		buf.st_mode = S_IRWXU | S_IRWXG;
 	} else {
 		// data from the ro-branch
-		char o_dirp[PATHLEN_MAX]; // the pathname we want to copy
-		sprintf(o_dirp, "%s%s", uopt.branches[nbranch_ro].path, path);
-		res = stat(o_dirp, &buf);
+		res = branch_stat(nbranch_ro, path, &buf);
 		if (res == -1) RETURN(1); // lower level branch removed in the mean time?
 	}
 
 	bool _call_setfile = true;
 
-	res = mkdir(dirp, buf.st_mode);
+	res = branch_mkdir(nbranch_rw, path, buf.st_mode);
 	if (res == -1) {
 		if (errno == EEXIST) {
 			// In an NFS environment with many clients trying to write to the same directory tree
 			// and if that tree does not exist on the read write mount, there's a race between them.
 			// The directory may have been created by another client. It's not a fatal error.
-			// TODO: actually, this may also happen locally. anyway, it would probably be better to just
-			// some internal locking instead of relying on return error (!) codes
-			USYSLOG(LOG_INFO, "Directory %s already existed - probably another client made it", dirp);
+			// This also happens locally, when two threads copy up files in the same directory.
+			// Copying up the files themselves is coordinated by cow_single_flight().
+			USYSLOG(LOG_INFO, "Directory %s%s already existed - probably another client made it",
+				uopt.branches[nbranch_rw].path, path);
 			_call_setfile = false;  // leave the call to the thread which had a successful mkdir
 		} else {
-			USYSLOG(LOG_ERR, "Creating %s failed: \n", dirp);
+			USYSLOG(LOG_ERR, "Creating %s%s failed: \n", uopt.branches[nbranch_rw].path, path);
 			RETURN(1);
 		}
 	}
 
+	lcache_invalidate(path);
+	bloom_add(nbranch_rw, path, S_IFDIR);
+
 	if (nbranch_ro == nbranch_rw) RETURN(0); // the special case again
 
 	if (_call_setfile) {
-		if (setfile(dirp, &buf)) RETURN(1); // directory already removed by another process?
+		if (setfile(nbranch_rw, path, &buf)) RETURN(1); // directory already removed by another process?
 	}
 
 	// TODO: time, but its values are modified by the next dir/file creation steps?
@@ -275,15 +300,15 @@ static int do_create(const char *path, int nbranch_ro, int nbranch_rw) {
 int path_create(const char *path, int nbranch_ro, int nbranch_rw) {
 	DBG("%s\n", path);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[nbranch_rw].path, path)) RETURN(-ENAMETOOLONG);
-
 	struct stat st;
-	if (!stat(p, &st)) {
+	if (!branch_stat(nbranch_rw, path, &st)) {
 		// path does already exists, no need to create it
 		RETURN(0);
 	}
 
+	char p[PATHLEN_MAX];
+	if (strlen(path) >= PATHLEN_MAX) RETURN(-ENAMETOOLONG);
+
 	char *walk = (char *)path;
 
 	// first slashes, e.g. we have path = /dir1/dir2/, will set walk = dir1/dir2/
@@ -0,0 +1,1118 @@
+/*
+*  C Implementation: lazy_copy
+*
+* Description: copy up large files chunk by chunk
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+*
+* Details:
+*	With -o lazy_copyup=<MiB>, opening a file of at least MiB on a
+*	read-only branch for writing does not copy it before open() returns.
+*	A sparse file of the same size is created on the rw branch instead,
+*	and a bitmap tracks which LAZY_CHUNK sized chunks are copied already.
+*	Reads of chunks not copied yet go to the file on the read-only
+*	branch, writes first copy the chunks they touch. A pool of
+*	-o copyup_threads background threads copies the remaining chunks,
+*	oldest file first and one thread per file, after that the file is a
+*	normal file on the rw branch.
+*	Open files are matched by the inode of the rw file, which follows
+*	renames and hard links. truncate() shrinks the part still to be read
+*	from the read-only branch. Operations which need the whole file, such
+*	as fallocate() and SEEK_DATA, complete it first.
+*	Unmounting waits for all files to complete. In case unionfs is killed
+*	before, the state of each file is kept in LAZY_DIR on the rw branch:
+*	<ino> is a hard link to the rw file, <ino>.state holds the bitmap and
+*	the path of the file on the read-only branch. The rw file is only
+*	linked to its path once the state exists, a bit is only saved after
+*	the data of its chunk was synced, and before the chunk is written.
+*	The next mount resumes the copies of files still linked to a path,
+*	and drops those which were removed. Until then the extra link shows
+*	in st_nlink. rw branches without hard links get normal copy-ups.
+*/
+
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "unionfs.h"
+#include "opts.h"
+#include "branch.h"
+#include "findbranch.h"
+#include "general.h"
+#include "cow.h"
+#include "cow_utils.h"
+#include "lookup_cache.h"
+#include "bloom.h"
+#include "lazy_copy.h"
+#include "debug.h"
+#include "usyslog.h"
+
+#define LAZY_CHUNK (1024 * 1024)
+#define LAZY_SAVE_CHUNKS 64	// background chunks between saving the bitmap
+
+#define LAZY_DIR "/" METANAME "/lazy_copyup~"
+#define LAZY_MAGIC "UFSLAZY1"
+
+// start of <ino>.state, followed by the bitmap and the NUL terminated path
+struct lazy_state {
+	char magic[8];		// LAZY_MAGIC, not NUL terminated
+	uint64_t ino;		// of the rw file
+	uint64_t lower_ino;	// to find the read-only file again
+	int64_t lower_mtime;	// in ns
+	uint64_t lower_size;	// lazy_file_t.lower_size
+	uint64_t nchunks;
+	uint32_t written;
+	uint32_t padding;
+};
+
+typedef struct lazy_file {
+	struct lazy_file *next, *prev;	// in files
+	dev_t dev;			// the file on the rw branch
+	ino_t ino;
+	int lower_fd;			// the file on the read-only branch
+	int upper_fd;			// the file on the rw branch, read-write
+	int state_fd;			// <ino>.state in LAZY_DIR
+	int branch_rw;
+	struct timespec times[2];	// of the lower file, kept if not written
+	size_t nchunks;
+	unsigned int refs;		// open fds, +1 while in files
+	bool complete;			// no longer in files
+	bool failed;			// the background copy failed, leave it
+	bool busy;			// a background thread works on it
+	struct timespec start;		// when it was created, for the latency
+
+	pthread_mutex_t lock;		// for the members below
+	off_t lower_size;		// data beyond is on the rw branch, truncate() shrinks it
+	uint8_t *copied;		// bitmap of the copied chunks
+	size_t next_chunk;		// the background copy is done up to here
+	bool written;
+	struct lazy_state state;	// as last saved
+	size_t unsaved;			// chunks copied since
+} lazy_file_t;
+
+// a part of a read, from one of the files
+typedef struct {
+	int fd;
+	off_t off;
+	size_t size;
+} lazy_seg_t;
+
+static bool enabled;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;	// files to copy were added
+static pthread_cond_t idle = PTHREAD_COND_INITIALIZER;	// a background thread is done with a file
+static lazy_file_t *files, *files_tail;	// not complete yet, oldest first
+static lazy_file_t **fds;	// our fd -> lazy_file_t
+static int nfds;
+static unsigned int nfiles;	// allocated, nothing to look up if 0
+
+static uint64_t nlazy;		// files copied up lazily
+static uint64_t nresumed;	// of them interrupted by a crash
+static uint64_t nwrite_chunks;	// chunks copied for writes
+static uint64_t nbackground_chunks;	// chunks copied in the background
+static unsigned int nthreads;	// running background threads
+static uint64_t ncompleted;	// files completed
+static uint64_t latency_sum;	// ms from open() to completion, of all completed files
+static uint64_t latency_max;
+
+static bool chunk_copied(const lazy_file_t *lf, size_t chunk) {
+	if (chunk >= lf->nchunks) return true;
+	return lf->copied[chunk / 8] & (1 << (chunk % 8));
+}
+
+/**
+ * Copy chunk from the read-only branch, lf->lock must be held.
+ * Returns 0 or a negative errno.
+ */
+static int copy_chunk(lazy_file_t *lf, size_t chunk) {
+	off_t start = (off_t)chunk * LAZY_CHUNK;
+	off_t end = start + LAZY_CHUNK;
+	if (end > lf->lower_size) end = lf->lower_size;
+
+	if (start < end && cow_copy_range(lf->lower_fd, lf->upper_fd, start, end)) return -errno;
+
+	lf->copied[chunk / 8] |= 1 << (chunk % 8);
+	lf->unsaved++;
+	return 0;
+}
+
+static int64_t mtime_ns(const struct stat *st) {
+#ifdef __APPLE__
+	return (int64_t)st->st_mtimespec.tv_sec * 1000000000 + st->st_mtimespec.tv_nsec;
+#else
+	return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#endif
+}
+
+/**
+ * Write the state of lf to its state file, lf->lock must be held. The
+ * copied chunks are synced first, so that no bit is saved for data which
+ * might still be lost. With sync the state itself is synced as well, as
+ * needed before writing to the copied chunks. Returns 0 or a negative errno.
+ */
+static int save_state(lazy_file_t *lf, bool sync) {
+	if (lf->unsaved && fdatasync(lf->upper_fd) == -1) return -errno;
+
+	lf->state.lower_size = lf->lower_size;
+	lf->state.written = lf->written;
+
+	size_t len = (lf->nchunks + 7) / 8;
+	if (pwrite(lf->state_fd, &lf->state, sizeof(lf->state), 0) != sizeof(lf->state)
+	|| pwrite(lf->state_fd, lf->copied, len, sizeof(lf->state)) != (ssize_t)len) {
+		return errno ? -errno : -EIO;
+	}
+	if (sync && fdatasync(lf->state_fd) == -1) return -errno;
+
+	lf->unsaved = 0;
+	return 0;
+}
+
+/**
+ * Remove the state of the file with ino from LAZY_DIR, the link first,
+ * so that a remaining state file is known to be stale.
+ */
+static void remove_state(int branch_rw, uint64_t ino) {
+	char p[PATHLEN_MAX];
+
+	snprintf(p, sizeof(p), "%s/%" PRIu64, LAZY_DIR, ino);
+	if (branch_unlink(branch_rw, p) == -1 && errno != ENOENT) {
+		USYSLOG(LOG_WARNING, "%s: removing %s failed: %s\n", __func__, p, strerror(errno));
+	}
+
+	snprintf(p, sizeof(p), "%s/%" PRIu64 ".state", LAZY_DIR, ino);
+	if (branch_unlink(branch_rw, p) == -1 && errno != ENOENT) {
+		USYSLOG(LOG_WARNING, "%s: removing %s failed: %s\n", __func__, p, strerror(errno));
+	}
+}
+
+/**
+ * Called with lock held
+ */
+static void put_file(lazy_file_t *lf) {
+	if (--lf->refs > 0) return;
+
+	close(lf->lower_fd);
+	close(lf->upper_fd);
+	close(lf->state_fd);
+	pthread_mutex_destroy(&lf->lock);
+	free(lf->copied);
+	free(lf);
+
+	__atomic_sub_fetch(&nfiles, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * The file needs no more copying, called with lock held
+ */
+static void finish_file(lazy_file_t *lf) {
+	if (lf->complete) return;
+	lf->complete = true;
+
+	remove_state(lf->branch_rw, lf->state.ino);
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t ms = (now.tv_sec - lf->start.tv_sec) * 1000 + (now.tv_nsec - lf->start.tv_nsec) / 1000000;
+	ncompleted++;
+	latency_sum += ms;
+	if (ms > latency_max) latency_max = ms;
+
+	if (lf->prev) {
+		lf->prev->next = lf->next;
+	} else {
+		files = lf->next;
+	}
+	if (lf->next) {
+		lf->next->prev = lf->prev;
+	} else {
+		files_tail = lf->prev;
+	}
+
+	put_file(lf);
+}
+
+static lazy_file_t *find_file(dev_t dev, ino_t ino) {
+	lazy_file_t *lf;
+	for (lf = files; lf; lf = lf->next) {
+		if (lf->dev == dev && lf->ino == ino) return lf;
+	}
+	return NULL;
+}
+
+static lazy_file_t *get_file(int fd) {
+	// the fast path while no file is copied lazily
+	if (__atomic_load_n(&nfiles, __ATOMIC_ACQUIRE) == 0) return NULL;
+
+	pthread_mutex_lock(&lock);
+	lazy_file_t *lf = fd < nfds ? fds[fd] : NULL;
+	pthread_mutex_unlock(&lock);
+
+	return lf;
+}
+
+/**
+ * Copy the next chunk which is not copied yet. Returns 1 if there might
+ * be more, 0 if the file is complete or a negative errno.
+ */
+static int copy_next(lazy_file_t *lf) {
+	int res = 0;
+
+	pthread_mutex_lock(&lf->lock);
+
+	// removed from the rw branch, nobody will see the copy. The last
+	// link is our own in LAZY_DIR.
+	struct stat st;
+	bool unlinked = fstat(lf->upper_fd, &st) == 0 && st.st_nlink <= 1;
+
+	while (lf->next_chunk < lf->nchunks && chunk_copied(lf, lf->next_chunk)) lf->next_chunk++;
+
+	if (!unlinked && (off_t)lf->next_chunk * LAZY_CHUNK < lf->lower_size) {
+		res = copy_chunk(lf, lf->next_chunk);
+		if (res == 0 && lf->unsaved >= LAZY_SAVE_CHUNKS) res = save_state(lf, false);
+		if (res == 0) {
+			__atomic_add_fetch(&nbackground_chunks, 1, __ATOMIC_RELAXED);
+			res = 1;
+		}
+	} else if (!unlinked && !lf->written) {
+		// our own writes must not count as modification
+		if (futimens(lf->upper_fd, lf->times) == -1) {
+			USYSLOG(LOG_WARNING, "%s: restoring the times of inode %ju failed: %s\n",
+				__func__, (uintmax_t)lf->ino, strerror(errno));
+		}
+	}
+
+	pthread_mutex_unlock(&lf->lock);
+
+	return res;
+}
+
+/**
+ * The oldest file a background thread can work on, called with lock held
+ */
+static lazy_file_t *next_file(void) {
+	lazy_file_t *lf;
+	for (lf = files; lf && (lf->failed || lf->busy); lf = lf->next);
+	return lf;
+}
+
+/**
+ * Copy lf completely, called with lock held
+ */
+static int complete_file(lazy_file_t *lf) {
+	lf->refs++;
+	pthread_mutex_unlock(&lock);
+
+	int res;
+	while ((res = copy_next(lf)) > 0);
+
+	pthread_mutex_lock(&lock);
+	if (res == 0) {
+		finish_file(lf);
+	} else if (!lf->failed) {
+		USYSLOG(LOG_ERR, "%s: copying up inode %ju failed: %s, it is still read from the "
+			"read-only branch\n", __func__, (uintmax_t)lf->ino, strerror(-res));
+		lf->failed = true;
+	}
+	put_file(lf);
+
+	return res;
+}
+
+static void *lazy_thread(void *arg) {
+	(void)arg;
+
+	pthread_mutex_lock(&lock);
+	for (;;) {
+		lazy_file_t *lf = next_file();
+		if (lf == NULL) {
+			pthread_cond_wait(&work, &lock);
+			continue;
+		}
+
+		// the others take the next files
+		lf->busy = true;
+		lf->refs++;
+		complete_file(lf);
+		lf->busy = false;
+		put_file(lf);
+
+		pthread_cond_broadcast(&idle);
+	}
+
+	return NULL;
+}
+
+/**
+ * Queue lf for the background copy, lf->refs is taken over by files.
+ */
+static void add_file(lazy_file_t *lf) {
+	lf->refs = 1;
+	clock_gettime(CLOCK_MONOTONIC, &lf->start);
+	pthread_mutex_init(&lf->lock, NULL);
+
+	pthread_mutex_lock(&lock);
+	lf->prev = files_tail;
+	if (files_tail) {
+		files_tail->next = lf;
+	} else {
+		files = lf;
+	}
+	files_tail = lf;
+
+	__atomic_add_fetch(&nfiles, 1, __ATOMIC_RELEASE);
+	nlazy++;
+	pthread_cond_signal(&work);
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Read the state file name in LAZY_DIR of branch_rw, of a file whose copy
+ * was interrupted, and queue the file again. Files no longer linked to
+ * any path are dropped.
+ */
+static void resume_file(int branch_rw, const char *name) {
+	char p[PATHLEN_MAX];
+	snprintf(p, sizeof(p), "%s/%s", LAZY_DIR, name);
+
+	int state_fd = branch_open(branch_rw, p, O_RDWR, 0);
+	if (state_fd == -1) {
+		USYSLOG(LOG_ERR, "%s: opening %s failed: %s\n", __func__, p, strerror(errno));
+		return;
+	}
+
+	lazy_file_t *lf = calloc(1, sizeof(lazy_file_t));
+	if (lf == NULL) {
+		USYSLOG(LOG_ERR, "%s: out of memory\n", __func__);
+		close(state_fd);
+		return;
+	}
+	lf->state_fd = state_fd;
+	lf->upper_fd = -1;
+	lf->lower_fd = -1;
+	lf->branch_rw = branch_rw;
+
+	struct stat st;
+	struct lazy_state *state = &lf->state;
+	size_t len = 0;
+	char lower[PATHLEN_MAX];
+	ssize_t n = -1;
+	if (fstat(state_fd, &st) == 0 && pread(state_fd, state, sizeof(*state), 0) == sizeof(*state)
+	&& memcmp(state->magic, LAZY_MAGIC, sizeof(state->magic)) == 0
+	&& state->nchunks && state->nchunks / 8 < (uint64_t)st.st_size
+	&& state->lower_size <= state->nchunks * LAZY_CHUNK) {
+		len = (state->nchunks + 7) / 8;
+		lf->copied = malloc(len);
+	}
+	if (lf->copied && pread(state_fd, lf->copied, len, sizeof(*state)) == (ssize_t)len) {
+		n = pread(state_fd, lower, sizeof(lower), sizeof(*state) + len);
+	}
+	if (n <= 1 || memchr(lower, '\0', n) == NULL) {
+		// the rw file is only linked once the state is written completely
+		USYSLOG(LOG_ERR, "%s: %s is corrupt, not resumed\n", __func__, p);
+		goto out;
+	}
+
+	snprintf(p, sizeof(p), "%s/%" PRIu64, LAZY_DIR, state->ino);
+	lf->upper_fd = branch_open(branch_rw, p, O_RDWR, 0);
+	if (lf->upper_fd == -1 || fstat(lf->upper_fd, &st) == -1 || st.st_nlink <= 1) {
+		// not linked to its path yet, or removed since
+		DBG("dropping %s\n", p);
+		remove_state(branch_rw, state->ino);
+		goto out;
+	}
+	lf->dev = st.st_dev;
+	lf->ino = st.st_ino;
+
+	// the branch order might have changed
+	int i;
+	for (i = 0; i < uopt.nbranches; i++) {
+		if (uopt.branches[i].rw || branch_lstat(i, lower, &st) == -1) continue;
+		if (S_ISREG(st.st_mode) && st.st_ino == state->lower_ino && mtime_ns(&st) == state->lower_mtime) break;
+	}
+	if (i == uopt.nbranches || (lf->lower_fd = branch_open(i, lower, O_RDONLY, 0)) == -1) {
+		USYSLOG(LOG_ERR, "%s: %s is not on a read-only branch any more, inode %" PRIu64
+			" can't be completed\n", __func__, lower, state->ino);
+		goto out;
+	}
+
+#ifdef __APPLE__
+	lf->times[0] = st.st_atimespec;
+	lf->times[1] = st.st_mtimespec;
+#else
+	lf->times[0] = st.st_atim;
+	lf->times[1] = st.st_mtim;
+#endif
+	lf->nchunks = state->nchunks;
+	lf->lower_size = state->lower_size;
+	lf->written = state->written;
+
+	add_file(lf);
+	nresumed++;
+	USYSLOG(LOG_INFO, "Resuming the copy-up of %s\n", lower);
+	return;
+
+out:
+	if (lf->lower_fd != -1) close(lf->lower_fd);
+	if (lf->upper_fd != -1) close(lf->upper_fd);
+	close(state_fd);
+	free(lf->copied);
+	free(lf);
+}
+
+/**
+ * Resume the copies interrupted on all rw branches
+ */
+static void resume_files(void) {
+	int i;
+	for (i = 0; i < uopt.nbranches; i++) {
+		if (!uopt.branches[i].rw) continue;
+
+		branch_dir_t *dir = branch_opendir(i, LAZY_DIR);
+		if (dir == NULL) continue;
+
+		struct dirent *de;
+		while ((de = branch_readdir(dir)) != NULL) {
+			size_t len = strlen(de->d_name);
+			if (strncmp(de->d_name, "new~", 4) == 0) {
+				// never got a state
+				char p[PATHLEN_MAX];
+				snprintf(p, sizeof(p), "%s/%s", LAZY_DIR, de->d_name);
+				branch_unlink(i, p);
+			} else if (len > 6 && strcmp(de->d_name + len - 6, ".state") == 0) {
+				resume_file(i, de->d_name);
+			}
+		}
+
+		branch_closedir(dir);
+	}
+}
+
+/**
+ * Copy the resumed files before anything is served, without background
+ * threads.
+ */
+static void complete_resumed(void) {
+	pthread_mutex_lock(&lock);
+
+	lazy_file_t *lf;
+	while ((lf = next_file()) != NULL) complete_file(lf);
+
+	pthread_mutex_unlock(&lock);
+}
+
+void lazy_init(void) {
+	// files with holes left by a crash
+	resume_files();
+
+	if (!uopt.lazy_copyup || !uopt.cow_enabled) {
+		complete_resumed();
+		return;
+	}
+
+	if (uopt.passthrough) {
+		USYSLOG(LOG_WARNING, "-o lazy_copyup can't be used with -o passthrough, ignored\n");
+		complete_resumed();
+		return;
+	}
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	unsigned int i;
+	for (i = 0; i < uopt.copyup_threads; i++) {
+		pthread_t thread;
+		int res = pthread_create(&thread, &attr, lazy_thread, NULL);
+		if (res != 0) {
+			USYSLOG(LOG_ERR, "%s: failed to start copy-up thread %u: %s\n", __func__, i, strerror(res));
+			break;
+		}
+	}
+	pthread_attr_destroy(&attr);
+
+	if (i == 0) {
+		USYSLOG(LOG_ERR, "%s: no copy-up thread, -o lazy_copyup ignored\n", __func__);
+		complete_resumed();
+		return;
+	}
+
+	nthreads = i;
+	enabled = true;
+}
+
+/**
+ * Complete all files before unmounting
+ */
+void lazy_destroy(void) {
+	if (!enabled) return;
+
+	pthread_mutex_lock(&lock);
+
+	// help the background threads and wait for them
+	lazy_file_t *lf;
+	for (;;) {
+		for (lf = files; lf && lf->failed; lf = lf->next);
+		if (lf == NULL) break;
+
+		if ((lf = next_file()) != NULL) {
+			complete_file(lf);
+		} else {
+			pthread_cond_wait(&idle, &lock);
+		}
+	}
+
+	for (lf = files; lf; lf = lf->next) {
+		USYSLOG(LOG_ERR, "%s: inode %ju is left incomplete, retried on the next mount\n",
+			__func__, (uintmax_t)lf->ino);
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+static void truncate_file(lazy_file_t *lf, off_t size) {
+	pthread_mutex_lock(&lf->lock);
+	if (size < lf->lower_size) lf->lower_size = size;
+	lf->written = true;
+
+	// a resumed copy must not extend the file again
+	int res = save_state(lf, true);
+	if (res) {
+		USYSLOG(LOG_ERR, "%s: saving the state of inode %ju failed: %s\n",
+			__func__, (uintmax_t)lf->ino, strerror(-res));
+	}
+	pthread_mutex_unlock(&lf->lock);
+}
+
+/**
+ * Like truncate_file() for the file with dev and ino, if it is copied
+ * lazily. Saving the state syncs, so it is done without lock held like
+ * in complete_file().
+ */
+static void truncate_inode(dev_t dev, ino_t ino, off_t size) {
+	pthread_mutex_lock(&lock);
+	lazy_file_t *lf = find_file(dev, ino);
+	if (lf) lf->refs++;
+	pthread_mutex_unlock(&lock);
+
+	if (lf == NULL) return;
+
+	truncate_file(lf, size);
+
+	pthread_mutex_lock(&lock);
+	put_file(lf);
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Create LAZY_DIR on branch_rw, if it does not exist yet
+ */
+static int make_lazy_dir(int branch_rw) {
+	if (branch_mkdir(branch_rw, "/" METANAME, 0755) == -1 && errno != EEXIST) return -errno;
+	if (branch_mkdir(branch_rw, LAZY_DIR, 0700) == -1 && errno != EEXIST) return -errno;
+	return 0;
+}
+
+/**
+ * Create the rw file of lf in LAZY_DIR as <ino> with its state <ino>.state.
+ * Returns the fd of the file, -1 with errno set on error.
+ */
+static int create_lazy(lazy_file_t *lf, const char *lower, const struct stat *st) {
+	static unsigned int seq;
+	char tmp[PATHLEN_MAX], p[PATHLEN_MAX];
+
+	if (make_lazy_dir(lf->branch_rw) < 0) return -1;
+
+	// named by the inode, which is only known after creating it
+	snprintf(tmp, sizeof(tmp), "%s/new~%d~%u", LAZY_DIR, (int)getpid(),
+		__atomic_add_fetch(&seq, 1, __ATOMIC_RELAXED));
+	int fd = branch_open(lf->branch_rw, tmp, O_RDWR | O_CREAT | O_EXCL, st->st_mode & (S_IRWXU | S_IRWXG | S_IRWXO));
+	if (fd == -1) return -1;
+
+	struct stat upper;
+	if (fstat(fd, &upper) == -1) goto fail;
+
+	memcpy(lf->state.magic, LAZY_MAGIC, sizeof(lf->state.magic));
+	lf->state.ino = upper.st_ino;
+	lf->state.lower_ino = st->st_ino;
+	lf->state.lower_mtime = mtime_ns(st);
+	lf->state.nchunks = lf->nchunks;
+	lf->upper_fd = fd;
+
+	snprintf(p, sizeof(p), "%s/%" PRIu64 ".state", LAZY_DIR, lf->state.ino);
+	lf->state_fd = branch_open(lf->branch_rw, p, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (lf->state_fd == -1) goto fail;
+
+	size_t len = strlen(lower) + 1;
+	off_t off = sizeof(lf->state) + (lf->nchunks + 7) / 8;
+	errno = 0;
+	if (save_state(lf, false) || pwrite(lf->state_fd, lower, len, off) != (ssize_t)len
+	|| fdatasync(lf->state_fd) == -1) {
+		if (errno == 0) errno = EIO;
+		goto fail;
+	}
+
+	snprintf(p, sizeof(p), "%s/%" PRIu64, LAZY_DIR, lf->state.ino);
+	if (branch_rename(lf->branch_rw, tmp, p) == -1) goto fail;
+
+	return fd;
+
+fail:;
+	int err = errno;
+	if (lf->state_fd != -1) {
+		close(lf->state_fd);
+		lf->state_fd = -1;
+		snprintf(p, sizeof(p), "%s/%" PRIu64 ".state", LAZY_DIR, lf->state.ino);
+		branch_unlink(lf->branch_rw, p);
+	}
+	close(fd);
+	branch_unlink(lf->branch_rw, tmp);
+	errno = err;
+	return -1;
+}
+
+/**
+ * Create path on branch_rw as sparse file to be copied lazily from branch.
+ * Only called for one path at a time, see lazy_cow(), so the file system
+ * work is done without lock. Returns 0 or a negative errno.
+ */
+static int create_upper(const char *path, int branch, int branch_rw, const struct stat *st, int flags) {
+	// copied up by somebody else in the mean time
+	struct stat upper;
+	if (branch_lstat(branch_rw, path, &upper) == 0) return 0;
+
+	int res = path_create_cutlast_cow(path, branch, branch_rw);
+	if (res) return res < 0 ? res : -EIO;
+
+	// with O_TRUNC there is nothing to copy at all
+	off_t size = (flags & O_TRUNC) ? 0 : st->st_size;
+	struct stat copy = *st;
+
+	if (size == 0) {
+		int fd = branch_open(branch_rw, path, O_WRONLY | O_CREAT | O_EXCL, st->st_mode & (S_IRWXU | S_IRWXG | S_IRWXO));
+		if (fd == -1) return -errno;
+		close(fd);
+
+		if (setfile(branch_rw, path, &copy)) {
+			branch_unlink(branch_rw, path);
+			return -EIO;
+		}
+	} else {
+		lazy_file_t *lf = calloc(1, sizeof(lazy_file_t));
+		size_t nchunks = (size + LAZY_CHUNK - 1) / LAZY_CHUNK;
+		if (lf == NULL || (lf->copied = calloc((nchunks + 7) / 8, 1)) == NULL) {
+			free(lf);
+			return -ENOMEM;
+		}
+		lf->nchunks = nchunks;
+		lf->lower_size = size;
+		lf->branch_rw = branch_rw;
+		lf->state_fd = -1;
+
+		char p[PATHLEN_MAX];
+		lf->lower_fd = branch_open(branch, path, O_RDONLY, 0);
+		lf->upper_fd = lf->lower_fd == -1 ? -1 : create_lazy(lf, path, st);
+		if (lf->upper_fd == -1) {
+			res = -errno;
+		} else {
+			// only now the file shows up, its state is complete
+			snprintf(p, sizeof(p), "%s/%" PRIu64, LAZY_DIR, lf->state.ino);
+			if (ftruncate(lf->upper_fd, size) == -1 || fstat(lf->upper_fd, &upper) == -1) {
+				res = -errno;
+			} else if (setfile(branch_rw, p, &copy)) {
+				res = -EIO;
+			} else if (branch_link(branch_rw, p, branch_rw, path) == -1) {
+				res = -errno;
+			}
+		}
+
+		if (res) {
+			if (lf->upper_fd != -1) {
+				remove_state(branch_rw, lf->state.ino);
+				close(lf->upper_fd);
+				close(lf->state_fd);
+			}
+			if (lf->lower_fd != -1) close(lf->lower_fd);
+			free(lf->copied);
+			free(lf);
+			return res;
+		}
+
+		lf->dev = upper.st_dev;
+		lf->ino = upper.st_ino;
+#ifdef __APPLE__
+		lf->times[0] = st->st_atimespec;
+		lf->times[1] = st->st_mtimespec;
+#else
+		lf->times[0] = st->st_atim;
+		lf->times[1] = st->st_mtim;
+#endif
+		add_file(lf);
+	}
+
+	bloom_add(branch_rw, path, st->st_mode);
+	lcache_invalidate(path);
+
+	return 0;
+}
+
+struct upper_args {
+	const char *path;
+	int branch;
+	int branch_rw;
+	const struct stat *st;
+	int flags;
+};
+
+static int schedule_copy(void *arg) {
+	struct upper_args *args = arg;
+
+	return create_upper(args->path, args->branch, args->branch_rw, args->st, args->flags);
+}
+
+/**
+ * Like find_rw_branch_cutlast() for opening path with flags for writing,
+ * but large files on read-only branches are only prepared to be copied
+ * lazily.
+ */
+int lazy_cow(const char *path, int flags) {
+	if (!enabled) RETURN(find_rw_branch_cutlast(path));
+
+	DBG("%s\n", path);
+
+	struct stat st;
+	int branch = find_rorw_branch_stat(path, &st);
+
+	if (branch >= 0 && uopt.branches[branch].rw) {
+		// O_TRUNC also drops what is still to be copied
+		if ((flags & O_TRUNC) && __atomic_load_n(&nfiles, __ATOMIC_ACQUIRE)) {
+			truncate_inode(st.st_dev, st.st_ino, 0);
+		}
+		RETURN(branch);
+	}
+
+	// setuid files are copied as before, see copy_file()
+	if (branch < 0 || !S_ISREG(st.st_mode) || (st.st_mode & (S_ISUID | S_ISGID))
+	|| (st.st_size < (off_t)uopt.lazy_copyup * 1024 * 1024 && !(flags & O_TRUNC))) {
+		RETURN(find_rw_branch_cutlast(path));
+	}
+
+	int branch_rw = find_lowest_rw_branch(branch);
+	if (branch_rw < 0) RETURN(find_rw_branch_cutlast(path)); // fails the same way
+
+	// not at the same time as a normal copy-up of path
+	struct upper_args args = { path, branch, branch_rw, &st, flags };
+	int res = cow_single_flight(path, schedule_copy, &args);
+
+	// The rw branch can't keep the extra hard link in LAZY_DIR (e.g. vfat),
+	// copy the file up completely as without -o lazy_copyup.
+	if (res == -EPERM || res == -EOPNOTSUPP || res == -EXDEV || res == -EMLINK) {
+		DBG("%s: no hard links on branch %d: %s\n", path, branch_rw, strerror(-res));
+		RETURN(find_rw_branch_cutlast(path));
+	}
+
+	if (res) {
+		errno = -res;
+		RETURN(-1);
+	}
+
+	// remove a file that might hide the copied file
+	remove_hidden(path, branch_rw);
+
+	RETURN(branch_rw);
+}
+
+/**
+ * fd was opened, check if it is a file being copied lazily. Returns 1 if
+ * so, 0 if not or a negative errno, the open must fail then.
+ */
+int lazy_open(int fd) {
+	if (__atomic_load_n(&nfiles, __ATOMIC_ACQUIRE) == 0) return 0;
+
+	struct stat st;
+	if (fstat(fd, &st) == -1) return -errno;
+
+	pthread_mutex_lock(&lock);
+
+	lazy_file_t *lf = find_file(st.st_dev, st.st_ino);
+	if (lf == NULL) {
+		pthread_mutex_unlock(&lock);
+		return 0;
+	}
+
+	if (fd >= nfds) {
+		int n = fd + 1024;
+		lazy_file_t **f = realloc(fds, n * sizeof(lazy_file_t *));
+		if (f == NULL) {
+			pthread_mutex_unlock(&lock);
+			return -ENOMEM;
+		}
+		memset(f + nfds, 0, (n - nfds) * sizeof(lazy_file_t *));
+		fds = f;
+		nfds = n;
+	}
+
+	fds[fd] = lf;
+	lf->refs++;
+
+	pthread_mutex_unlock(&lock);
+	return 1;
+}
+
+/**
+ * fd is about to be closed, needs to be called before close().
+ */
+void lazy_release(int fd) {
+	if (__atomic_load_n(&nfiles, __ATOMIC_ACQUIRE) == 0) return;
+
+	pthread_mutex_lock(&lock);
+
+	lazy_file_t *lf = fd < nfds ? fds[fd] : NULL;
+	if (lf) {
+		fds[fd] = NULL;
+		put_file(lf);
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Split a read into the parts from the read-only and the rw branch. Returns
+ * the number of parts in *segs, which is either stack (with room for
+ * nstack parts) or has to be freed, NULL if out of memory.
+ */
+static size_t get_segments(lazy_file_t *lf, off_t off, size_t size, lazy_seg_t *stack, size_t nstack, lazy_seg_t **segs) {
+	size_t max = size / LAZY_CHUNK + 3;
+	*segs = max <= nstack ? stack : malloc(max * sizeof(lazy_seg_t));
+	if (*segs == NULL) return 0;
+
+	size_t n = 0;
+	off_t end = off + size;
+
+	pthread_mutex_lock(&lf->lock);
+	while (off < end) {
+		int fd = lf->upper_fd;
+		off_t seg_end = end;
+
+		if (off < lf->lower_size) {
+			size_t chunk = off / LAZY_CHUNK;
+			seg_end = (off_t)(chunk + 1) * LAZY_CHUNK;
+			if (!chunk_copied(lf, chunk)) {
+				fd = lf->lower_fd;
+				if (seg_end > lf->lower_size) seg_end = lf->lower_size;
+			}
+			if (seg_end > end) seg_end = end;
+		}
+
+		if (n > 0 && (*segs)[n - 1].fd == fd) {
+			(*segs)[n - 1].size += seg_end - off;
+		} else {
+			(*segs)[n].fd = fd;
+			(*segs)[n].off = off;
+			(*segs)[n].size = seg_end - off;
+			n++;
+		}
+		off = seg_end;
+	}
+	pthread_mutex_unlock(&lf->lock);
+
+	return n;
+}
+
+/**
+ * pread() of fd, for a file being copied lazily from the branch where the
+ * data is.
+ */
+ssize_t lazy_pread(int fd, void *buf, size_t size, off_t off) {
+	lazy_file_t *lf = get_file(fd);
+	if (lf == NULL) return pread(fd, buf, size, off);
+
+	lazy_seg_t stack[8], *segs;
+	size_t n = get_segments(lf, off, size, stack, 8, &segs);
+	if (segs == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	ssize_t done = 0;
+	size_t i;
+	for (i = 0; i < n; i++) {
+		ssize_t res = pread(segs[i].fd, (char *)buf + done, segs[i].size, segs[i].off);
+		if (res == -1) {
+			if (done == 0) done = -1;
+			break;
+		}
+
+		done += res;
+		if ((size_t)res < segs[i].size) break; // end of file
+	}
+
+	if (segs != stack) {
+		int err = errno;
+		free(segs);
+		errno = err;
+	}
+
+	return done;
+}
+
+/**
+ * Set up *bufp for a read of fd, if it is a file being copied lazily.
+ * Returns 1 if so, 0 if not and a negative errno on error.
+ */
+int lazy_read_buf(int fd, size_t size, off_t off, struct fuse_bufvec **bufp) {
+	lazy_file_t *lf = get_file(fd);
+	if (lf == NULL) return 0;
+
+	lazy_seg_t stack[8], *segs;
+	size_t n = get_segments(lf, off, size, stack, 8, &segs);
+	if (segs == NULL) return -ENOMEM;
+
+	struct fuse_bufvec *src = malloc(sizeof(struct fuse_bufvec) + n * sizeof(struct fuse_buf));
+	if (src == NULL) {
+		if (segs != stack) free(segs);
+		return -ENOMEM;
+	}
+
+	*src = FUSE_BUFVEC_INIT(0);
+	src->count = n;
+
+	size_t i;
+	for (i = 0; i < n; i++) {
+		src->buf[i] = src->buf[0];
+		src->buf[i].size = segs[i].size;
+		src->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		src->buf[i].fd = segs[i].fd;
+		src->buf[i].pos = segs[i].off;
+	}
+
+	if (segs != stack) free(segs);
+
+	*bufp = src; // freed by libfuse
+	return 1;
+}
+
+/**
+ * Copy the chunks a write to fd touches, before it is written.
+ * Returns 0 or a negative errno.
+ */
+int lazy_prepare_write(int fd, off_t off, size_t size) {
+	lazy_file_t *lf = get_file(fd);
+	if (lf == NULL) return 0;
+
+	int res = 0;
+
+	pthread_mutex_lock(&lf->lock);
+
+	size_t chunk;
+	for (chunk = off / LAZY_CHUNK; (off_t)chunk * LAZY_CHUNK < off + (off_t)size; chunk++) {
+		if ((off_t)chunk * LAZY_CHUNK >= lf->lower_size) break;
+		if (chunk_copied(lf, chunk)) continue;
+
+		res = copy_chunk(lf, chunk);
+		if (res) break;
+		__atomic_add_fetch(&nwrite_chunks, 1, __ATOMIC_RELAXED);
+	}
+
+	// a resumed copy must not overwrite what is written now
+	if (res == 0 && (lf->unsaved || !lf->written)) {
+		lf->written = true;
+		res = save_state(lf, true);
+	}
+
+	pthread_mutex_unlock(&lf->lock);
+
+	return res;
+}
+
+/**
+ * Copy fd completely, for operations which need the whole file.
+ * Returns 0 or a negative errno.
+ */
+int lazy_finish(int fd) {
+	lazy_file_t *lf = get_file(fd);
+	if (lf == NULL) return 0;
+
+	pthread_mutex_lock(&lock);
+	int res = lf->complete ? 0 : complete_file(lf);
+	pthread_mutex_unlock(&lock);
+
+	return res;
+}
+
+/**
+ * fd is about to be truncated to size
+ */
+void lazy_truncate(int fd, off_t size) {
+	lazy_file_t *lf = get_file(fd);
+	if (lf) truncate_file(lf, size);
+}
+
+/**
+ * path on branch is about to be truncated to size
+ */
+void lazy_truncate_path(int branch, const char *path, off_t size) {
+	if (__atomic_load_n(&nfiles, __ATOMIC_ACQUIRE) == 0) return;
+
+	struct stat st;
+	if (branch_lstat(branch, path, &st) == -1) return;
+
+	truncate_inode(st.st_dev, st.st_ino, size);
+}
+
+/**
+ * Bytes of lf still to be copied
+ */
+static uint64_t bytes_left(lazy_file_t *lf) {
+	uint64_t left = 0;
+
+	pthread_mutex_lock(&lf->lock);
+	size_t chunk;
+	for (chunk = lf->next_chunk; (off_t)chunk * LAZY_CHUNK < lf->lower_size; chunk++) {
+		if (chunk_copied(lf, chunk)) continue;
+
+		off_t end = (off_t)(chunk + 1) * LAZY_CHUNK;
+		if (end > lf->lower_size) end = lf->lower_size;
+		left += end - (off_t)chunk * LAZY_CHUNK;
+	}
+	pthread_mutex_unlock(&lf->lock);
+
+	return left;
+}
+
+int lazy_print_stats(char *buf, size_t size) {
+	if (!enabled) return snprintf(buf, size, "lazy copy-up: disabled\n");
+
+	pthread_mutex_lock(&lock);
+	unsigned int pending = 0, busy = 0;
+	uint64_t left = 0;
+	lazy_file_t *lf;
+	for (lf = files; lf; lf = lf->next) {
+		pending++;
+		if (lf->busy) busy++;
+		left += bytes_left(lf);
+	}
+
+	int len = snprintf(buf, size, "lazy copy-up: %" PRIu64 " files (%" PRIu64 " resumed), %u pending (%u in progress, "
+		"%u threads), %" PRIu64 " KiB to copy, %" PRIu64 " chunks copied for writes, %" PRIu64
+		" in the background, completed in %" PRIu64 " ms on average, %" PRIu64 " ms max\n",
+		nlazy, nresumed, pending, busy, nthreads, left / 1024,
+		__atomic_load_n(&nwrite_chunks, __ATOMIC_RELAXED),
+		__atomic_load_n(&nbackground_chunks, __ATOMIC_RELAXED),
+		ncompleted ? latency_sum / ncompleted : 0, latency_max);
+	pthread_mutex_unlock(&lock);
+
+	return len;
+}
@@ -0,0 +1,30 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef LAZY_COPY_H
+#define LAZY_COPY_H
+
+#include <fuse.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define LAZY_DEFAULT_THREADS 2
+
+void lazy_init(void);
+void lazy_destroy(void);
+int lazy_cow(const char *path, int flags);
+int lazy_open(int fd);
+void lazy_release(int fd);
+ssize_t lazy_pread(int fd, void *buf, size_t size, off_t off);
+int lazy_read_buf(int fd, size_t size, off_t off, struct fuse_bufvec **bufp);
+int lazy_prepare_write(int fd, off_t off, size_t size);
+int lazy_finish(int fd);
+void lazy_truncate(int fd, off_t size);
+void lazy_truncate_path(int branch, const char *path, off_t size);
+int lazy_print_stats(char *buf, size_t size);
+
+#endif
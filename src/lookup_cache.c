@@ -0,0 +1,300 @@
+/*
+*  C Implementation: lookup_cache
+*
+* Description: cache the result of find_branch() for union paths
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+*
+* Details:
+*	Resolving a path means an lstat() of that path on every branch until
+*	it is found, plus whiteout checks. We remember the resolved branch
+*	(or the fact that the path does not exist at all) for a short time,
+*	so repeated lookups of the same path are served from memory.
+*
+*	The cache is a set-associative table of LCACHE_WAYS entries per set.
+*	Within a set entries are kept in LRU order, so a new entry simply
+*	replaces the least recently used one and the memory usage is fixed
+*	by the lookup_cache=<entries> mount option. Sets are protected by a
+*	fixed number of striped mutexes.
+*
+*	For directories the entry can also hold a bitmap of the branches the
+*	directory exists on (dirmask), up to the branch it is hidden on.
+*	Anything within the directory can only be on one of these branches,
+*	so find_branch(), readdir() and dir_not_empty() skip the others.
+*	With "/usr/lib" only on two of eight branches, this saves six lstat()
+*	calls on every lookup within it.
+*
+*	Every operation which changes where a path resolves to must call
+*	lcache_invalidate(). Operations affecting whole sub-trees (directory
+*	renames, whiteout directories) call lcache_invalidate_all(), which
+*	only bumps a generation counter. Changes done directly in the
+*	branches, bypassing unionfs, are only noticed after the TTL expired.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "unionfs.h"
+#include "opts.h"
+#include "string.h"
+#include "lookup_cache.h"
+#include "debug.h"
+#include "usyslog.h"
+
+#define LCACHE_WAYS 4
+#define LCACHE_LOCKS 64
+
+typedef struct {
+	char *path;		// NULL if the slot is unused
+	unsigned int hash;	// string_hash(path)
+	unsigned int gen;	// cache generation this entry belongs to
+	long long expires;	// CLOCK_MONOTONIC in ms, 0 if it never expires
+	int branch;		// -1 for negative entries
+	filetype_t type;
+	bool has_dirmask;	// dirmask is known
+	uint64_t dirmask;	// branches the directory is on, see lcache_set_dirmask()
+} lcache_entry_t;
+
+static lcache_entry_t *entries;	// nsets * LCACHE_WAYS entries
+static unsigned int nsets;	// always a power of 2
+static pthread_mutex_t locks[LCACHE_LOCKS];
+
+static unsigned int generation;	// bumped by lcache_invalidate_all()
+static unsigned int inval_seq;	// bumped by any invalidation
+
+static long long now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Allocate the cache, size and ttl are taken from the mount options.
+ * If lookup_cache was not given, the cache stays disabled.
+ */
+void lcache_init(void) {
+	if (uopt.lcache_size == 0) return;
+
+	nsets = 1;
+	while (nsets * LCACHE_WAYS < uopt.lcache_size) nsets <<= 1;
+
+	entries = calloc(nsets * LCACHE_WAYS, sizeof(lcache_entry_t));
+	if (entries == NULL) {
+		USYSLOG(LOG_ERR, "%s: Failed to allocate %u entries, lookup cache disabled\n",
+			__func__, nsets * LCACHE_WAYS);
+		return;
+	}
+
+	int i;
+	for (i = 0; i < LCACHE_LOCKS; i++) pthread_mutex_init(&locks[i], NULL);
+}
+
+/**
+ * Remove entry i from a set and close the gap, so used entries are
+ * always at the beginning of the set. Needs the lock of the set.
+ */
+static void drop_entry(lcache_entry_t *set, int i) {
+	free(set[i].path);
+	memmove(&set[i], &set[i + 1], (LCACHE_WAYS - i - 1) * sizeof(lcache_entry_t));
+	memset(&set[LCACHE_WAYS - 1], 0, sizeof(lcache_entry_t));
+}
+
+/**
+ * Find path in its set. Returns the index within the set or -1.
+ * Needs the lock of the set.
+ */
+static int find_entry(lcache_entry_t *set, unsigned int hash, const char *path) {
+	int i;
+	for (i = 0; i < LCACHE_WAYS && set[i].path; i++) {
+		if (set[i].hash == hash && strcmp(set[i].path, path) == 0) return i;
+	}
+
+	return -1;
+}
+
+bool lcache_enabled(void) {
+	return entries != NULL;
+}
+
+/**
+ * Return the current invalidation sequence number. It has to be taken
+ * *before* the branches are examined and passed to lcache_insert(), so that
+ * a result which raced with an invalidation is not cached.
+ */
+unsigned int lcache_seq(void) {
+	return __atomic_load_n(&inval_seq, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Look up path in the cache. On a hit, branch is set to the branch
+ * the path was found in or to -1, if the path is known not to exist.
+ */
+bool lcache_lookup(const char *path, int *branch, filetype_t *type) {
+	if (!entries) return false;
+
+	unsigned int hash = string_hash((void *)path);
+	unsigned int setno = hash & (nsets - 1);
+	lcache_entry_t *set = &entries[setno * LCACHE_WAYS];
+	unsigned int gen = __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+	bool found = false;
+
+	pthread_mutex_lock(&locks[setno % LCACHE_LOCKS]);
+
+	int i = find_entry(set, hash, path);
+	if (i >= 0) {
+		if (set[i].gen != gen || (set[i].expires && set[i].expires <= now_ms())) {
+			drop_entry(set, i); // stale
+		} else {
+			*branch = set[i].branch;
+			*type = set[i].type;
+			found = true;
+
+			// move to the front, the least recently used entry is the last one
+			lcache_entry_t tmp = set[i];
+			memmove(&set[1], &set[0], i * sizeof(lcache_entry_t));
+			set[0] = tmp;
+		}
+	}
+
+	pthread_mutex_unlock(&locks[setno % LCACHE_LOCKS]);
+
+	DBG("%s: %s\n", path, found ? "hit" : "miss");
+	return found;
+}
+
+/**
+ * Remember that path resolves to branch (-1 if it does not exist).
+ * seq is the value lcache_seq() returned before the lookup was done.
+ */
+void lcache_insert(const char *path, int branch, filetype_t type, unsigned int seq) {
+	if (!entries) return;
+
+	unsigned int hash = string_hash((void *)path);
+	unsigned int setno = hash & (nsets - 1);
+	lcache_entry_t *set = &entries[setno * LCACHE_WAYS];
+
+	char *key = strdup(path);
+	if (!key) return;
+
+	// load the generation before checking seq, lcache_invalidate_all()
+	// bumps them in the opposite order
+	unsigned int gen = __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+
+	pthread_mutex_lock(&locks[setno % LCACHE_LOCKS]);
+
+	// something changed while the branches were searched, the result
+	// might be outdated already
+	if (seq != lcache_seq()) {
+		pthread_mutex_unlock(&locks[setno % LCACHE_LOCKS]);
+		free(key);
+		return;
+	}
+
+	int i = find_entry(set, hash, path);
+	if (i < 0) i = LCACHE_WAYS - 1; // evict the least recently used
+	if (set[i].path) drop_entry(set, i);
+
+	memmove(&set[1], &set[0], (LCACHE_WAYS - 1) * sizeof(lcache_entry_t));
+	set[0].path = key;
+	set[0].hash = hash;
+	set[0].gen = gen;
+	set[0].expires = uopt.lcache_ttl ? now_ms() + uopt.lcache_ttl * 1000LL : 0;
+	set[0].branch = branch;
+	set[0].type = type;
+	set[0].has_dirmask = false;
+	set[0].dirmask = 0;
+
+	pthread_mutex_unlock(&locks[setno % LCACHE_LOCKS]);
+}
+
+/**
+ * Get the dirmask of path, if the cache has a valid one.
+ */
+bool lcache_lookup_dirmask(const char *path, uint64_t *dirmask) {
+	if (!entries) return false;
+
+	unsigned int hash = string_hash((void *)path);
+	unsigned int setno = hash & (nsets - 1);
+	lcache_entry_t *set = &entries[setno * LCACHE_WAYS];
+	unsigned int gen = __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+	bool found = false;
+
+	pthread_mutex_lock(&locks[setno % LCACHE_LOCKS]);
+
+	int i = find_entry(set, hash, path);
+	if (i >= 0 && set[i].has_dirmask && set[i].gen == gen
+	&& (set[i].expires == 0 || set[i].expires > now_ms())) {
+		*dirmask = set[i].dirmask;
+		found = true;
+	}
+
+	pthread_mutex_unlock(&locks[setno % LCACHE_LOCKS]);
+
+	return found;
+}
+
+/**
+ * Remember for directory path the branches it exists on as directory,
+ * up to and including the first branch it is hidden on. Only updates an
+ * existing entry, inserted with lcache_insert() and the same seq.
+ */
+void lcache_set_dirmask(const char *path, uint64_t dirmask, unsigned int seq) {
+	if (!entries || uopt.nbranches > LCACHE_MAX_BRANCHES) return;
+
+	unsigned int hash = string_hash((void *)path);
+	unsigned int setno = hash & (nsets - 1);
+	lcache_entry_t *set = &entries[setno * LCACHE_WAYS];
+	unsigned int gen = __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+
+	pthread_mutex_lock(&locks[setno % LCACHE_LOCKS]);
+
+	int i = find_entry(set, hash, path);
+	if (i >= 0 && set[i].gen == gen && seq == lcache_seq()) {
+		set[i].dirmask = dirmask;
+		set[i].has_dirmask = true;
+	}
+
+	pthread_mutex_unlock(&locks[setno % LCACHE_LOCKS]);
+}
+
+/**
+ * Forget what we know about path.
+ */
+void lcache_invalidate(const char *path) {
+	if (!entries) return;
+
+	DBG("%s\n", path);
+
+	unsigned int hash = string_hash((void *)path);
+	unsigned int setno = hash & (nsets - 1);
+	lcache_entry_t *set = &entries[setno * LCACHE_WAYS];
+
+	pthread_mutex_lock(&locks[setno % LCACHE_LOCKS]);
+
+	__atomic_add_fetch(&inval_seq, 1, __ATOMIC_ACQ_REL);
+
+	int i = find_entry(set, hash, path);
+	if (i >= 0) drop_entry(set, i);
+
+	pthread_mutex_unlock(&locks[setno % LCACHE_LOCKS]);
+}
+
+/**
+ * Forget everything, used if a whole sub-tree changed. Old entries are not
+ * freed here, but replaced lazily.
+ */
+void lcache_invalidate_all(void) {
+	if (!entries) return;
+
+	DBG_IN();
+
+	__atomic_add_fetch(&inval_seq, 1, __ATOMIC_ACQ_REL);
+	__atomic_add_fetch(&generation, 1, __ATOMIC_ACQ_REL);
+}
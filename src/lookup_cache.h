@@ -0,0 +1,31 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef LOOKUP_CACHE_H
+#define LOOKUP_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "general.h"
+
+#define LCACHE_DEFAULT_TTL 1 // seconds
+
+// dirmasks are only used with up to 64 branches
+#define LCACHE_MAX_BRANCHES 64
+#define BRANCH_BIT(branch) ((uint64_t)1 << (branch))
+
+void lcache_init(void);
+bool lcache_enabled(void);
+unsigned int lcache_seq(void);
+bool lcache_lookup(const char *path, int *branch, filetype_t *type);
+void lcache_insert(const char *path, int branch, filetype_t type, unsigned int seq);
+bool lcache_lookup_dirmask(const char *path, uint64_t *dirmask);
+void lcache_set_dirmask(const char *path, uint64_t dirmask, unsigned int seq);
+void lcache_invalidate(const char *path);
+void lcache_invalidate_all(void);
+
+#endif
@@ -0,0 +1,184 @@
+/*
+*  C Implementation: name_set
+*
+* Description: set of the entry names of a directory
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+*
+* Details:
+*	Merging directories needs a set of the names seen so far and of the
+*	whiteouts, which lives only as long as one listing is read. The
+*	generic hashtable allocates an entry and a key for each name, which
+*	dominates the time to list directories with hundreds of thousands of
+*	entries. Here the names are copied into chunks of a bump allocator
+*	and the slots are a flat array probed linearly, so adding a name
+*	costs no malloc at all most of the time, and the whole set is freed
+*	with a handful of free() calls.
+*	Names are hashed with a 64-bit multiply-mix hash after wyhash, which
+*	reads 8 bytes at a time.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "name_set.h"
+
+#define NAME_SET_MIN_SLOTS 64
+#define NAME_CHUNK_MIN 4096
+#define NAME_CHUNK_MAX (256 * 1024)
+
+struct name_chunk {
+	struct name_chunk *next;
+	size_t used, size;
+	char data[];
+};
+
+static const uint64_t P0 = 0xa0761d6478bd642fULL;
+static const uint64_t P1 = 0xe7037ed1a0b428dbULL;
+
+/**
+ * Multiply to 128 bits and fold the halves
+ */
+static inline uint64_t mix(uint64_t a, uint64_t b) {
+#ifdef __SIZEOF_INT128__
+	__uint128_t r = (__uint128_t)a * b;
+	return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+	uint64_t ha = a >> 32, la = (uint32_t)a, hb = b >> 32, lb = (uint32_t)b;
+	uint64_t hh = ha * hb, hl = ha * lb, lh = la * hb, ll = la * lb;
+	uint64_t mid = (ll >> 32) + (uint32_t)hl + (uint32_t)lh;
+	uint64_t lo = (mid << 32) | (uint32_t)ll;
+	uint64_t hi = hh + (hl >> 32) + (lh >> 32) + (mid >> 32);
+	return lo ^ hi;
+#endif
+}
+
+static inline uint64_t read8(const unsigned char *p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint64_t name_hash(const char *name, size_t len) {
+	const unsigned char *p = (const unsigned char *)name;
+	uint64_t seed = mix(len ^ P0, P1);
+	size_t left = len;
+
+	while (left > 16) {
+		seed = mix(read8(p) ^ P1, read8(p + 8) ^ seed);
+		p += 16;
+		left -= 16;
+	}
+
+	uint64_t a = 0, b = 0;
+	if (left > 8) {
+		a = read8(p);
+		memcpy(&b, p + 8, left - 8);
+	} else {
+		memcpy(&a, p, left);
+	}
+
+	return mix(P1 ^ len, mix(a ^ P1, b ^ seed));
+}
+
+void name_set_init(name_set_t *set) {
+	memset(set, 0, sizeof(*set));
+}
+
+/**
+ * The slot of name, or the free slot where it belongs
+ */
+static name_slot_t *find_slot(const name_set_t *set, uint64_t hash, const char *name) {
+	size_t i = hash & set->mask;
+	while (set->slots[i].name) {
+		if (set->slots[i].hash == hash && strcmp(set->slots[i].name, name) == 0) break;
+		i = (i + 1) & set->mask;
+	}
+	return &set->slots[i];
+}
+
+bool name_set_contains(const name_set_t *set, const char *name) {
+	if (set->count == 0) return false;
+
+	uint64_t hash = name_hash(name, strlen(name));
+	return find_slot(set, hash, name)->name != NULL;
+}
+
+static int grow(name_set_t *set) {
+	size_t nslots = set->slots ? 2 * (set->mask + 1) : NAME_SET_MIN_SLOTS;
+	name_slot_t *slots = calloc(nslots, sizeof(name_slot_t));
+	if (slots == NULL) return -1;
+
+	name_set_t new = *set;
+	new.slots = slots;
+	new.mask = nslots - 1;
+
+	size_t i;
+	for (i = 0; set->slots && i <= set->mask; i++) {
+		if (set->slots[i].name) *find_slot(&new, set->slots[i].hash, set->slots[i].name) = set->slots[i];
+	}
+
+	free(set->slots);
+	set->slots = slots;
+	set->mask = nslots - 1;
+	return 0;
+}
+
+static char *copy_name(name_set_t *set, const char *name, size_t len) {
+	struct name_chunk *c = set->chunks;
+
+	if (c == NULL || c->used + len > c->size) {
+		size_t size = c ? 2 * c->size : NAME_CHUNK_MIN;
+		if (size > NAME_CHUNK_MAX) size = NAME_CHUNK_MAX;
+		if (size < len) size = len;
+
+		c = malloc(sizeof(struct name_chunk) + size);
+		if (c == NULL) return NULL;
+		c->next = set->chunks;
+		c->used = 0;
+		c->size = size;
+		set->chunks = c;
+	}
+
+	char *copy = c->data + c->used;
+	memcpy(copy, name, len);
+	c->used += len;
+	return copy;
+}
+
+/**
+ * Add name to the set. Returns 1 if it was added, 0 if it was there
+ * already and -1 if we ran out of memory.
+ */
+int name_set_add(name_set_t *set, const char *name) {
+	// keep at least a quarter of the slots free
+	if (set->slots == NULL || set->count + 1 > (set->mask + 1) / 4 * 3) {
+		if (grow(set)) return -1;
+	}
+
+	size_t len = strlen(name);
+	uint64_t hash = name_hash(name, len);
+	name_slot_t *slot = find_slot(set, hash, name);
+	if (slot->name) return 0;
+
+	char *copy = copy_name(set, name, len + 1);
+	if (copy == NULL) return -1;
+
+	slot->hash = hash;
+	slot->name = copy;
+	set->count++;
+	return 1;
+}
+
+void name_set_free(name_set_t *set) {
+	while (set->chunks) {
+		struct name_chunk *c = set->chunks;
+		set->chunks = c->next;
+		free(c);
+	}
+	free(set->slots);
+	name_set_init(set);
+}
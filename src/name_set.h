@@ -0,0 +1,37 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef NAME_SET_H
+#define NAME_SET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct name_chunk;
+
+typedef struct {
+	uint64_t hash;
+	const char *name;	// NULL for a free slot
+} name_slot_t;
+
+/**
+ * A set of directory entry names, see name_set.c. Initialize it with
+ * name_set_init(), it needs no memory until the first name is added.
+ */
+typedef struct {
+	name_slot_t *slots;
+	size_t mask;		// number of slots - 1
+	size_t count;
+	struct name_chunk *chunks;	// the names, newest chunk first
+} name_set_t;
+
+void name_set_init(name_set_t *set);
+bool name_set_contains(const name_set_t *set, const char *name);
+int name_set_add(name_set_t *set, const char *name);
+void name_set_free(name_set_t *set);
+
+#endif
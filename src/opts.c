@@ -13,6 +13,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <pthread.h>
@@ -21,7 +22,19 @@
 #include "opts.h"
 #include "version.h"
 #include "string.h"
+#include "lookup_cache.h"
+#include "lazy_copy.h"
+#include "branch_index.h"
+#include "readdir.h"
 
+// -o branch_index=, the indexes are opened with the branches
+typedef struct {
+	unsigned int branch;
+	char *file;
+} branch_index_opt_t;
+
+static branch_index_opt_t *branch_index_opts;
+static int nbranch_index_opts;
 
 /**
  * Set debug path
@@ -100,6 +113,9 @@ void uopt_init() {
 	memset(&uopt, 0, sizeof(uopt_t)); // initialize options with zeros first
 
 	pthread_rwlock_init(&uopt.dbgpath_lock, NULL);
+
+	uopt.lcache_ttl = LCACHE_DEFAULT_TTL;
+	uopt.copyup_threads = LAZY_DEFAULT_THREADS;
 }
 
 /**
@@ -261,6 +277,84 @@ static char * get_opt_str(const char *arg, char *opt_name) {
 	return str;
 }
 
+/**
+  * get_opt_uint - get the numeric parameter of an option
+  * @arg	- option argument, e.g. "lookup_cache=1000"
+  * @opt_name	- option name, used for error messages
+  */
+static unsigned int get_opt_uint(const char *arg, char *opt_name) {
+	char *str = index(arg, '=');
+
+	if (!str || str[1] == '\0') {
+		fprintf(stderr, "-o %s parameter not properly specified, aborting!\n",
+		        opt_name);
+		exit(1); // still early phase, we can abort
+	}
+
+	char *end;
+	errno = 0;
+	unsigned long val = strtoul(str + 1, &end, 10);
+	if (errno || *end != '\0' || val > UINT_MAX) {
+		fprintf(stderr, "-o %s: Converting %s to number failed, aborting!\n",
+		        opt_name, str + 1);
+		exit(1);
+	}
+
+	return val;
+}
+
+/**
+  * add_branch_index - remember -o branch_index=<branch>:<file>
+  */
+static void add_branch_index(const char *arg) {
+	char *str = get_opt_str(arg, "branch_index");
+
+	char *sep = index(str, ':');
+	char *end = NULL;
+	errno = 0;
+	unsigned long branch = sep ? strtoul(str, &end, 10) : 0;
+	if (!sep || end != sep || errno || branch > UINT_MAX || sep[1] == '\0') {
+		fprintf(stderr, "-o branch_index=%s: expected <branch number>:<index file>, aborting!\n", str);
+		exit(1);
+	}
+
+	branch_index_opts = realloc(branch_index_opts, (nbranch_index_opts + 1) * sizeof(branch_index_opt_t));
+	if (branch_index_opts == NULL) {
+		fprintf(stderr, "%s: realloc failed: %s Aborting!\n", __func__, strerror(errno));
+		exit(1);
+	}
+
+	branch_index_opt_t *opt = &branch_index_opts[nbranch_index_opts++];
+	opt->branch = branch;
+	// it's opened before we chroot, so relative to the working directory
+	opt->file = make_absolute(sep + 1);
+	if (opt->file == NULL) exit(1);
+}
+
+/**
+  * Attach the indexes to their branches, which have to be opened already.
+  */
+static void open_branch_indexes(void) {
+	int i;
+	for (i = 0; i < nbranch_index_opts; i++) {
+		branch_index_opt_t *opt = &branch_index_opts[i];
+
+		if (opt->branch >= (unsigned int)uopt.nbranches) {
+			fprintf(stderr, "-o branch_index: there is no branch %u, aborting!\n", opt->branch);
+			exit(1);
+		}
+
+		branch_entry_t *branch = &uopt.branches[opt->branch];
+		if (branch->rw) {
+			fprintf(stderr, "-o branch_index: branch %u is writable, only read-only branches can have an index. Aborting!\n", opt->branch);
+			exit(1);
+		}
+
+		branch->index = bindex_open(opt->file, branch->fd, uopt.branch_index_verify);
+		if (branch->index == NULL) exit(1);
+	}
+}
+
 static void print_help(const char *progname) {
 	printf(
 	"unionfs-fuse version "VERSION"\n"
@@ -293,6 +387,30 @@ static void print_help(const char *progname) {
 	"                           running neither as UID=0 or GID=0\n"
 	"    -o statfs_omit_ro      do not count blocks of ro-branches\n"
 	"    -o direct_io           Enable direct-io flag for fuse subsystem\n"
+	"    -o lookup_cache=number Cache the branch of up to number paths\n"
+	"    -o lookup_cache_ttl=s  Seconds a lookup cache entry is valid (default: 1,\n"
+	"                           0 for unlimited)\n"
+	"    -o readdir_cache=MiB   Cache merged directory listings up to MiB\n"
+	"    -o kernel_dir_cache    Let the kernel cache the listings of directories\n"
+	"                           which are only on read-only branches\n"
+	"    -o whiteout_index      Read all whiteouts into memory on mount\n"
+	"    -o io_uring            Look up paths on all branches in parallel\n"
+	"                           with io_uring\n"
+	"    -o branch_index=n:file Read the metadata of read-only branch n (counting\n"
+	"                           from 0) from an index built by unionfs-index\n"
+	"    -o branch_index_verify Check on mount that no directory of an indexed\n"
+	"                           branch was modified since the index was built\n"
+	"    -o bloom_filter        Remember all paths of the branches in bloom\n"
+	"                           filters to skip branches on lookups\n"
+	"    -o watch_branches      Notice changes made directly to the branches\n"
+	"                           and update the caches\n"
+	"    -o passthrough         Let the kernel read and write open files\n"
+	"                           directly (FUSE passthrough)\n"
+	"    -o splice              Move file data with splice() instead of\n"
+	"                           copying it\n"
+	"    -o lazy_copyup=MiB     Copy up files of at least MiB in the background\n"
+	"                           instead of before they are opened\n"
+	"    -o copyup_threads=n    Threads copying up in the background (default: 2)\n"
 	"\n",
 	progname);
 }
@@ -333,7 +451,7 @@ void unionfs_post_opts(void) {
 			BUILD_PATH(path, uopt.chroot, uopt.branches[i].path);
 		}
 
-		int fd = open(path, O_RDONLY);
+		int fd = open(path, O_RDONLY | O_DIRECTORY);
 		if (fd == -1) {
 			fprintf(stderr, "\nFailed to open %s: %s. Aborting!\n\n",
 				path, strerror(errno));
@@ -342,6 +460,11 @@ void unionfs_post_opts(void) {
 		uopt.branches[i].fd = fd;
 		uopt.branches[i].path_len = strlen(path);
 	}
+
+	open_branch_indexes();
+
+	lcache_init();
+	readdir_cache_init();
 }
 
 int unionfs_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs) {
@@ -398,10 +521,59 @@ int unionfs_opt_proc(void *data, const char *arg, int key, struct fuse_args *out
 		case KEY_DIRECT_IO:
 			uopt.direct_io = true;
 			return 0;
+		case KEY_LOOKUP_CACHE:
+			uopt.lcache_size = get_opt_uint(arg, "lookup_cache");
+			return 0;
+		case KEY_LOOKUP_CACHE_TTL:
+			uopt.lcache_ttl = get_opt_uint(arg, "lookup_cache_ttl");
+			return 0;
+		case KEY_WHITEOUT_INDEX:
+			uopt.whiteout_index = true;
+			return 0;
+		case KEY_IO_URING:
+#ifdef HAVE_IO_URING
+			uopt.io_uring = true;
+#else
+			fprintf(stderr, "Compiled without io_uring support, ignoring -o io_uring\n");
+#endif
+			return 0;
+		case KEY_BRANCH_INDEX:
+			add_branch_index(arg);
+			return 0;
+		case KEY_BRANCH_INDEX_VERIFY:
+			uopt.branch_index_verify = true;
+			return 0;
+		case KEY_BLOOM_FILTER:
+			uopt.bloom_filter = true;
+			return 0;
+		case KEY_WATCH_BRANCHES:
+			uopt.watch_branches = true;
+			return 0;
+		case KEY_PASSTHROUGH:
+			uopt.passthrough = true;
+			return 0;
+		case KEY_SPLICE:
+			uopt.splice = true;
+			return 0;
+		case KEY_READDIR_CACHE:
+			uopt.rdcache_size = get_opt_uint(arg, "readdir_cache");
+			return 0;
+		case KEY_KERNEL_DIR_CACHE:
+			uopt.kernel_dir_cache = true;
+			return 0;
+		case KEY_LAZY_COPYUP:
+			uopt.lazy_copyup = get_opt_uint(arg, "lazy_copyup");
+			return 0;
+		case KEY_COPYUP_THREADS:
+			uopt.copyup_threads = get_opt_uint(arg, "copyup_threads");
+			return 0;
 		case KEY_VERSION:
 			printf("unionfs-fuse version: "VERSION"\n");
 #ifdef HAVE_XATTR
 			printf("(compiled with xattr support)\n");
+#endif
+#ifdef HAVE_IO_URING
+			printf("(compiled with io_uring support)\n");
 #endif
 			uopt.doexit = 1;
 			return 1;
@@ -32,6 +32,19 @@ typedef struct {
 	bool hide_meta_files;
 	bool relaxed_permissions;
 	bool direct_io;
+	unsigned int lcache_size;	// max. entries of the lookup cache, 0 disables it
+	unsigned int lcache_ttl;	// seconds a lookup cache entry is valid
+	unsigned int rdcache_size;	// MiB of merged directory listings to cache, 0 disables it
+	bool kernel_dir_cache;	// let the kernel cache listings of directories only on ro branches
+	bool whiteout_index;	// keep whiteouts in memory
+	bool branch_index_verify;	// compare all directories of indexed branches with the index on mount
+	bool io_uring;		// look up paths on all branches in one io_uring batch
+	bool bloom_filter;	// skip branches which don't have a path according to their bloom filter
+	bool watch_branches;	// notice changes made directly to the branches
+	bool passthrough;	// let the kernel access open files directly
+	bool splice;		// move file data between the branches and /dev/fuse with splice()
+	unsigned int lazy_copyup;	// copy up files of at least this many MiB lazily, 0 disables it
+	unsigned int copyup_threads;	// background threads of the lazy copy-up
 
 } uopt_t;
 
@@ -49,6 +62,20 @@ enum {
 	KEY_RELAXED_PERMISSIONS,
 	KEY_STATFS_OMIT_RO,
 	KEY_DIRECT_IO,
+	KEY_LOOKUP_CACHE,
+	KEY_LOOKUP_CACHE_TTL,
+	KEY_WHITEOUT_INDEX,
+	KEY_IO_URING,
+	KEY_BRANCH_INDEX,
+	KEY_BRANCH_INDEX_VERIFY,
+	KEY_BLOOM_FILTER,
+	KEY_WATCH_BRANCHES,
+	KEY_PASSTHROUGH,
+	KEY_SPLICE,
+	KEY_READDIR_CACHE,
+	KEY_KERNEL_DIR_CACHE,
+	KEY_LAZY_COPYUP,
+	KEY_COPYUP_THREADS,
 	KEY_VERSION,
 };
 
@@ -0,0 +1,389 @@
+/*
+*  C Implementation: passthrough
+*
+* Description: let the kernel read and write open files directly
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+*
+* Details:
+*	With -o passthrough and a kernel supporting FUSE passthrough (linux
+*	6.9 and libfuse 3.16 or later) the branch file opened by open() and
+*	create() is registered with the kernel as backing file, the kernel
+*	then reads, writes and maps it without calling us.
+*	The kernel allows only one backing file per inode and refuses to mix
+*	passthrough and normal opens of an inode, so the backing file of each
+*	open path is shared by all its opens. If registering fails (e.g.
+*	without CAP_SYS_ADMIN or for branches on stacked file systems), the
+*	path is opened normally until it is closed by everyone.
+*	A file open read-only from a read-only branch and then opened for
+*	writing is copied up to another backing file, which the kernel can't
+*	switch to. Like opens which can't be tracked for lack of memory, such
+*	an open uses direct I/O, which the kernel allows next to passthrough
+*	opens of the same inode.
+*/
+
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+
+#include "unionfs.h"
+#include "opts.h"
+#include "string.h"
+#include "passthrough.h"
+#include "debug.h"
+#include "usyslog.h"
+
+#if FUSE_USE_VERSION >= 30 && defined FUSE_CAP_PASSTHROUGH
+
+#include <fuse_lowlevel.h>
+
+#include "hashtable.h"
+
+// from <linux/fuse.h>, which conflicts with the libfuse headers
+struct backing_map {
+	int32_t fd;
+	uint32_t flags;
+	uint64_t padding;
+};
+#define DEV_IOC_BACKING_OPEN _IOW(229, 1, struct backing_map)
+#define DEV_IOC_BACKING_CLOSE _IOW(229, 2, uint32_t)
+
+typedef struct open_file {
+	struct open_file *next, *prev; // in open_files
+	char *path;		// union path, the key in files, NULL if lost or unlinked
+	dev_t dev;		// the backing file
+	ino_t ino;
+	int backing_id;		// 0 if the path is not opened in passthrough mode
+	unsigned int refs;	// number of opens
+} open_file_t;
+
+static bool enabled;
+static bool backing_ok;		// registering backing files works
+static int dev_fd;		// /dev/fuse of our session
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct hashtable *files;	// union path -> open_file_t
+static open_file_t *open_files;	// all of them, for renames
+static open_file_t **fds;	// our fd -> open_file_t, to find it on release
+static int nfds;
+
+static uint64_t npassthrough;	// opens in passthrough mode
+static uint64_t nfallback;	// opens in normal mode
+static uint64_t ndirect;	// opens with direct I/O next to passthrough ones
+
+/**
+ * Ask for passthrough while the connection is initialized, called from
+ * the init method.
+ */
+void passthrough_init(struct fuse_conn_info *conn) {
+	if (!uopt.passthrough) return;
+
+	if (!(conn->capable & FUSE_CAP_PASSTHROUGH)) {
+		USYSLOG(LOG_WARNING, "The kernel does not support FUSE passthrough, -o passthrough ignored\n");
+		return;
+	}
+	if (uopt.direct_io) {
+		USYSLOG(LOG_WARNING, "-o passthrough can't be used with -o direct_io, ignored\n");
+		return;
+	}
+
+	files = create_hashtable(64, string_hash, string_equal);
+	if (files == NULL) {
+		USYSLOG(LOG_ERR, "%s: out of memory, -o passthrough ignored\n", __func__);
+		return;
+	}
+
+	conn->want |= FUSE_CAP_PASSTHROUGH;
+	// the branches must not be on stacked file systems themselves
+	conn->max_backing_stack_depth = 1;
+
+	dev_fd = fuse_session_fd(fuse_get_session(fuse_get_context()->fuse));
+	enabled = true;
+	backing_ok = true;
+}
+
+/**
+ * Register fd as backing file, return its id or 0 on failure.
+ */
+static int backing_open(int fd) {
+	if (!backing_ok) return 0;
+
+	struct backing_map map = { fd, 0, 0 };
+	int id = ioctl(dev_fd, DEV_IOC_BACKING_OPEN, &map);
+	if (id > 0) return id;
+
+	if (errno == EPERM || errno == ENOTTY || errno == EINVAL) {
+		// won't work for other files either
+		USYSLOG(LOG_WARNING, "FUSE passthrough not possible, disabled: %s\n", strerror(errno));
+		backing_ok = false;
+	} else {
+		DBG("registering the backing file failed: %s\n", strerror(errno));
+	}
+
+	return 0;
+}
+
+static void backing_close(int id) {
+	uint32_t backing_id = id;
+	if (ioctl(dev_fd, DEV_IOC_BACKING_CLOSE, &backing_id) == -1) {
+		USYSLOG(LOG_WARNING, "%s: closing backing file %d failed: %s\n", __func__, id, strerror(errno));
+	}
+}
+
+static open_file_t *add_file(const char *path, const struct stat *st, int fd) {
+	open_file_t *of = calloc(1, sizeof(open_file_t));
+	char *key = strdup(path);
+	if (of == NULL || key == NULL || !hashtable_insert(files, key, of)) {
+		free(of);
+		free(key);
+		return NULL;
+	}
+
+	of->path = key;
+	of->dev = st->st_dev;
+	of->ino = st->st_ino;
+	of->backing_id = backing_open(fd);
+
+	of->next = open_files;
+	if (open_files) open_files->prev = of;
+	open_files = of;
+
+	return of;
+}
+
+static void remove_file(open_file_t *of) {
+	if (of->path) hashtable_remove(files, of->path); // frees of->path
+	if (of->backing_id) backing_close(of->backing_id);
+
+	if (of->prev) {
+		of->prev->next = of->next;
+	} else {
+		open_files = of->next;
+	}
+	if (of->next) of->next->prev = of->prev;
+
+	free(of);
+}
+
+static int set_fd(int fd, open_file_t *of) {
+	if (fd >= nfds) {
+		int n = fd + 1024;
+		open_file_t **f = realloc(fds, n * sizeof(open_file_t *));
+		if (f == NULL) return -1;
+		memset(f + nfds, 0, (n - nfds) * sizeof(open_file_t *));
+		fds = f;
+		nfds = n;
+	}
+
+	fds[fd] = of;
+	return 0;
+}
+
+/**
+ * Open fd without keeping track of it. It might be the same inode as a
+ * passthrough open, next to which the kernel only allows direct I/O.
+ * Called with lock held.
+ */
+static void direct_open(struct fuse_file_info *fi) {
+	fi->backing_id = 0;
+	fi->direct_io = 1;
+	ndirect++;
+}
+
+/**
+ * path was opened as fd, set up fi to let the kernel access fd directly
+ * if possible. Never fails, at worst fd is opened with direct I/O.
+ */
+void passthrough_open(const char *path, int fd, struct fuse_file_info *fi) {
+	if (!enabled) return;
+
+	pthread_mutex_lock(&lock);
+
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		DBG("fstat of %s failed: %s\n", path, strerror(errno));
+		direct_open(fi);
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+
+	open_file_t *of = hashtable_search(files, (void *)path);
+	if (of == NULL) {
+		of = add_file(path, &st, fd);
+		if (of == NULL) {
+			USYSLOG(LOG_WARNING, "%s: out of memory, %s opened without passthrough\n", __func__, path);
+			direct_open(fi);
+			pthread_mutex_unlock(&lock);
+			return;
+		}
+	} else if (of->backing_id && (of->dev != st.st_dev || of->ino != st.st_ino)) {
+		// copied up while open, the kernel can't switch the backing file
+		DBG("%s is open with another backing file\n", path);
+		direct_open(fi);
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+
+	if (set_fd(fd, of)) {
+		if (of->refs == 0) remove_file(of);
+		USYSLOG(LOG_WARNING, "%s: out of memory, %s opened without passthrough\n", __func__, path);
+		direct_open(fi);
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	of->refs++;
+
+	fi->backing_id = of->backing_id;
+	if (of->backing_id) {
+		npassthrough++;
+	} else {
+		nfallback++;
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * fd is about to be closed, needs to be called before close().
+ */
+void passthrough_release(int fd) {
+	if (!enabled) return;
+
+	pthread_mutex_lock(&lock);
+
+	open_file_t *of = fd < nfds ? fds[fd] : NULL;
+	if (of) {
+		fds[fd] = NULL;
+		if (--of->refs == 0) remove_file(of);
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Return true if path is dir or below it, len is strlen(dir).
+ */
+static bool is_below(const char *path, const char *dir, size_t len) {
+	if (strncmp(path, dir, len) != 0) return false;
+	return path[len] == '\0' || path[len] == '/';
+}
+
+/**
+ * The files at path and below it are not reachable by their path any more,
+ * they stay open until released. Called with lock held.
+ */
+static void detach(const char *path) {
+	size_t len = strlen(path);
+	open_file_t *of;
+	for (of = open_files; of; of = of->next) {
+		if (of->path == NULL || !is_below(of->path, path, len)) continue;
+
+		hashtable_remove(files, of->path); // frees of->path
+		of->path = NULL;
+	}
+}
+
+/**
+ * path was unlinked, a new file at path gets its own backing file.
+ */
+void passthrough_unlink(const char *path) {
+	if (!enabled) return;
+
+	pthread_mutex_lock(&lock);
+	detach(path);
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * from was renamed to to. The kernel inodes of open files below from
+ * follow the rename, so do we.
+ */
+void passthrough_rename(const char *from, const char *to) {
+	if (!enabled || strcmp(from, to) == 0) return;
+
+	pthread_mutex_lock(&lock);
+
+	// replaced by the rename, the paths must stay unique in files
+	detach(to);
+
+	size_t len = strlen(from);
+	open_file_t *of;
+	for (of = open_files; of; of = of->next) {
+		if (of->path == NULL || !is_below(of->path, from, len)) continue;
+
+		char p[PATHLEN_MAX];
+		char *path;
+		if (BUILD_PATH(p, to, of->path + len) || (path = strdup(p)) == NULL) {
+			USYSLOG(LOG_ERR, "%s: lost track of %s\n", __func__, of->path);
+			continue;
+		}
+
+		hashtable_remove(files, of->path); // frees of->path
+		of->path = path;
+		if (!hashtable_insert(files, path, of)) {
+			// out of memory, the file can't be found by its path any more
+			USYSLOG(LOG_ERR, "%s: lost track of %s\n", __func__, path);
+			of->path = NULL;
+			free(path);
+		}
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+int passthrough_print_stats(char *buf, size_t size) {
+	if (!enabled) return snprintf(buf, size, "passthrough: disabled\n");
+
+	pthread_mutex_lock(&lock);
+	int len = snprintf(buf, size, "passthrough: %s, %u paths open, %" PRIu64 " passthrough opens, "
+		"%" PRIu64 " normal opens, %" PRIu64 " direct I/O opens\n", backing_ok ? "enabled" : "failed",
+		hashtable_count(files), npassthrough, nfallback, ndirect);
+	pthread_mutex_unlock(&lock);
+
+	return len;
+}
+
+#else // FUSE_CAP_PASSTHROUGH
+
+void passthrough_init(struct fuse_conn_info *conn) {
+	(void)conn;
+
+	if (uopt.passthrough) {
+		USYSLOG(LOG_WARNING, "Compiled without FUSE passthrough support, -o passthrough ignored\n");
+	}
+}
+
+void passthrough_open(const char *path, int fd, struct fuse_file_info *fi) {
+	(void)path;
+	(void)fd;
+	(void)fi;
+}
+
+void passthrough_release(int fd) {
+	(void)fd;
+}
+
+void passthrough_unlink(const char *path) {
+	(void)path;
+}
+
+void passthrough_rename(const char *from, const char *to) {
+	(void)from;
+	(void)to;
+}
+
+int passthrough_print_stats(char *buf, size_t size) {
+	return snprintf(buf, size, "passthrough: not supported\n");
+}
+
+#endif // FUSE_CAP_PASSTHROUGH
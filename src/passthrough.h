@@ -0,0 +1,20 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef PASSTHROUGH_H
+#define PASSTHROUGH_H
+
+#include <fuse.h>
+#include <stddef.h>
+
+void passthrough_init(struct fuse_conn_info *conn);
+void passthrough_open(const char *path, int fd, struct fuse_file_info *fi);
+void passthrough_release(int fd);
+void passthrough_unlink(const char *path);
+void passthrough_rename(const char *from, const char *to);
+int passthrough_print_stats(char *buf, size_t size);
+
+#endif
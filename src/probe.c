@@ -0,0 +1,303 @@
+/*
+*  C Implementation: probe
+*
+* Description: look up a path on all branches at once with io_uring
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+*
+* Details:
+*	find_branch() lstat()s path on one branch after the other and checks
+*	for whiteouts in between, so looking up a path which is only on the
+*	last branch (or nowhere) costs the sum of all round trips. This hurts
+*	if branches are on a network file system.
+*	With -o io_uring the statx() calls for path and its whiteouts on all
+*	branches are submitted as one io_uring batch, which the kernel runs
+*	in parallel, so we only wait for the slowest branch. find_branch()
+*	then applies its usual priority and whiteout rules to the results.
+*	Every thread has its own ring. If io_uring is not compiled in or does
+*	not work (old kernel, seccomp, ...), probe_branches() returns -1 and
+*	the caller does the sequential lookup instead.
+*/
+
+#if defined __linux__
+	// for struct statx
+	#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_IO_URING
+	#include <liburing.h>
+#endif
+
+#include "unionfs.h"
+#include "opts.h"
+#include "branch.h"
+#include "whiteout_index.h"
+#include "branch_index.h"
+#include "probe.h"
+#include "debug.h"
+#include "usyslog.h"
+
+#ifdef HAVE_IO_URING
+
+#define PROBE_RING_SIZE 256 // max. number of statx() calls in one batch
+#define PROBE_MAX_DEPTH 32 // max. number of path components we check whiteouts for
+
+typedef struct {
+	struct io_uring ring;
+	struct statx stx[PROBE_RING_SIZE];
+} probe_ring_t;
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+static volatile bool disabled; // io_uring does not work, do not try again
+static uint64_t nbatched;	// lookups done with one io_uring batch
+static uint64_t nsequential;	// lookups left to find_branch() with -o io_uring
+
+static void ring_free(void *arg) {
+	probe_ring_t *pr = arg;
+
+	io_uring_queue_exit(&pr->ring);
+	free(pr);
+}
+
+static void ring_key_init(void) {
+	if (pthread_key_create(&ring_key, ring_free)) disabled = true;
+}
+
+static void disable(const char *reason) {
+	if (!disabled) {
+		USYSLOG(LOG_WARNING, "io_uring lookups disabled, %s\n", reason);
+	}
+	disabled = true;
+}
+
+/**
+ * Get the ring of this thread, set it up on first use.
+ */
+static probe_ring_t *get_ring(void) {
+	pthread_once(&ring_once, ring_key_init);
+	if (disabled) return NULL;
+
+	probe_ring_t *pr = pthread_getspecific(ring_key);
+	if (pr) return pr;
+
+	pr = malloc(sizeof(probe_ring_t));
+	if (pr == NULL) return NULL;
+
+	int res = io_uring_queue_init(PROBE_RING_SIZE, &pr->ring, 0);
+	if (res < 0) {
+		free(pr);
+		disable(strerror(-res));
+		return NULL;
+	}
+
+	// IORING_OP_STATX is there since linux-5.6
+	struct io_uring_probe *probe = io_uring_get_probe_ring(&pr->ring);
+	bool supported = probe && io_uring_opcode_supported(probe, IORING_OP_STATX);
+	if (probe) io_uring_free_probe(probe);
+
+	if (!supported) {
+		ring_free(pr);
+		disable("statx not supported");
+		return NULL;
+	}
+
+	pthread_setspecific(ring_key, pr);
+
+	return pr;
+}
+
+/**
+ * Something went wrong with the ring of this thread, so throw it away.
+ * The next lookup sets up a new one.
+ */
+static void drop_ring(probe_ring_t *pr) {
+	pthread_setspecific(ring_key, NULL);
+	ring_free(pr);
+}
+
+/**
+ * Fill whiteouts with the whiteout paths (relative to the branch) of path
+ * and all its parent directories, as path_hidden() checks them. They are
+ * stored in buf. Return their number, -1 if they don't fit.
+ */
+static int build_whiteouts(const char *path, char *buf, size_t size, const char **whiteouts) {
+	int n = 0;
+
+	const char *start = path;
+	while (*start == '/') start++;
+
+	const char *walk = start;
+	while (*walk != '\0') {
+		// walk over the directory name
+		while (*walk != '\0' && *walk != '/') walk++;
+
+		if (n == PROBE_MAX_DEPTH) return -1;
+
+		int len = snprintf(buf, size, "%s%.*s%s", METADIR, (int)(walk - start), start, HIDETAG);
+		if (len < 0 || (size_t)len >= size) return -1;
+
+		whiteouts[n++] = buf;
+		buf += len + 1;
+		size -= len + 1;
+
+		while (*walk == '/') walk++;
+	}
+
+	return n;
+}
+
+/**
+ * Look up path on all branches in one batch. On success modes[i] is the
+ * file type of path on branch i (0 if it does not exist there) and
+ * hidden[i] what path_hidden(path, i) would return.
+ * Return 0 on success, -1 if the caller needs to do sequential lookups.
+ */
+static int probe(const char *path, mode_t *modes, int *hidden) {
+	// the sequential lookups report ENAMETOOLONG
+	if (strlen(path) >= PATHLEN_MAX) return -1;
+
+	probe_ring_t *pr = get_ring();
+	if (pr == NULL) return -1;
+
+	char buf[4 * PATHLEN_MAX];
+	const char *whiteouts[PROBE_MAX_DEPTH];
+	int nwhiteouts = 0;
+
+	// with the index we don't need any system call for whiteouts
+	bool check_whiteouts = uopt.cow_enabled && !windex_enabled();
+	if (check_whiteouts) {
+		nwhiteouts = build_whiteouts(path, buf, sizeof(buf), whiteouts);
+		if (nwhiteouts < 0) return -1;
+	}
+
+	// per branch: path itself and its whiteouts
+	int per_branch = 1 + nwhiteouts;
+	int n = uopt.nbranches * per_branch;
+	if (n > PROBE_RING_SIZE) return -1;
+
+	const char *rel = branch_relpath(path);
+
+	int i;
+	for (i = 0; i < uopt.nbranches; i++) {
+		modes[i] = 0;
+		hidden[i] = 0;
+	}
+
+	// branches with an index are answered right away
+	int nsubmit = 0;
+	for (i = 0; i < n; i++) {
+		int branch = i / per_branch;
+		int slot = i % per_branch;
+
+		// paths through symlinks are left to the file system
+		const bindex_t *index = uopt.branches[branch].index;
+		const struct bindex_entry *e = index ? bindex_lookup(index, slot == 0 ? path : whiteouts[slot - 1]) : NULL;
+		if (index && (e || errno != BINDEX_ESYMLINK)) {
+			if (e && slot == 0) {
+				modes[branch] = e->mode & S_IFMT;
+			} else if (e) {
+				hidden[branch] = 1;
+			}
+			continue;
+		}
+
+		struct io_uring_sqe *sqe = io_uring_get_sqe(&pr->ring);
+		if (sqe == NULL) {
+			// must not happen, the ring is empty
+			drop_ring(pr);
+			return -1;
+		}
+
+		io_uring_prep_statx(sqe, uopt.branches[branch].fd,
+			slot == 0 ? rel : whiteouts[slot - 1],
+			AT_SYMLINK_NOFOLLOW, STATX_TYPE, &pr->stx[i]);
+		io_uring_sqe_set_data64(sqe, i);
+		nsubmit++;
+	}
+
+	int submitted = nsubmit ? io_uring_submit_and_wait(&pr->ring, nsubmit) : 0;
+	if (submitted < 0) {
+		DBG("io_uring_submit_and_wait failed: %s\n", strerror(-submitted));
+		drop_ring(pr);
+		return -1;
+	}
+
+	for (i = 0; i < submitted; i++) {
+		struct io_uring_cqe *cqe;
+		int res = io_uring_wait_cqe(&pr->ring, &cqe);
+		if (res < 0) {
+			drop_ring(pr);
+			return -1;
+		}
+
+		int idx = io_uring_cqe_get_data64(cqe);
+		int branch = idx / per_branch;
+		int slot = idx % per_branch;
+
+		// any error means, as for lstat() in find_branch(), not there
+		if (cqe->res == 0) {
+			if (slot == 0) {
+				modes[branch] = pr->stx[idx].stx_mode & S_IFMT;
+			} else {
+				hidden[branch] = 1;
+			}
+		}
+
+		io_uring_cqe_seen(&pr->ring, cqe);
+	}
+
+	if (submitted != nsubmit) {
+		// not everything got submitted, the ring is in an unknown state
+		drop_ring(pr);
+		return -1;
+	}
+
+	if (uopt.cow_enabled && !check_whiteouts) {
+		for (i = 0; i < uopt.nbranches; i++) hidden[i] = windex_hidden(path, i);
+	}
+
+	return 0;
+}
+
+int probe_branches(const char *path, mode_t *modes, int *hidden) {
+	if (!uopt.io_uring || uopt.nbranches < 2) return -1;
+
+	int res = probe(path, modes, hidden);
+	__atomic_add_fetch(res == 0 ? &nbatched : &nsequential, 1, __ATOMIC_RELAXED);
+
+	return res;
+}
+
+int probe_print_stats(char *buf, size_t size) {
+	return snprintf(buf, size, "io_uring lookups: %s, %" PRIu64 " batched, %" PRIu64 " sequential\n",
+		!uopt.io_uring ? "off" : disabled ? "failed" : "on",
+		__atomic_load_n(&nbatched, __ATOMIC_RELAXED), __atomic_load_n(&nsequential, __ATOMIC_RELAXED));
+}
+
+#else // HAVE_IO_URING
+
+int probe_branches(const char *path, mode_t *modes, int *hidden) {
+	(void)path;
+	(void)modes;
+	(void)hidden;
+
+	return -1;
+}
+
+int probe_print_stats(char *buf, size_t size) {
+	return snprintf(buf, size, "io_uring lookups: not compiled in\n");
+}
+
+#endif // HAVE_IO_URING
@@ -0,0 +1,15 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef PROBE_H
+#define PROBE_H
+
+#include <sys/types.h>
+
+int probe_branches(const char *path, mode_t *modes, int *hidden);
+int probe_print_stats(char *buf, size_t size);
+
+#endif
@@ -22,31 +22,39 @@
 #include <errno.h>
 #include <sys/statvfs.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "unionfs.h"
 #include "opts.h"
 #include "debug.h"
 #include "hashtable.h"
+#include "name_set.h"
 #include "general.h"
+#include "lookup_cache.h"
+#include "bloom.h"
+#include "branch.h"
 #include "string.h"
+#include "usyslog.h"
 
 
 /**
   * Hide metadata. As is causes a slight slowndown this is optional
   *
   */
-static bool hide_meta_files(int branch, const char *path, struct dirent *de)
+static bool hide_meta_files(const char *path, struct dirent *de)
 {
 
 	if (uopt.hide_meta_files == false) RETURN(false);
 
-	fprintf(stderr, "uopt.branches[branch].path = %s path = %s\n", uopt.branches[branch].path, path);
-	fprintf(stderr, "METANAME = %s, de->d_name = %s\n", METANAME, de->d_name);
+	DBG("path = %s de->d_name = %s\n", path, de->d_name);
 
 	// TODO Would it be faster to add hash comparison?
 
-	// HIDE out .unionfs directory
-	if (strcmp(uopt.branches[branch].path, path) == 0
+	// HIDE out .unionfs directory, it only exists in the branch root
+	if (strcmp(branch_relpath(path), ".") == 0
 	&& strcmp(METANAME, de->d_name) == 0) {
 		RETURN(true);
 	}
@@ -61,10 +69,10 @@ static bool hide_meta_files(int branch, const char *path, struct dirent *de)
 
 /**
  * Check if fname has a hiding tag and return its status.
- * Also, add this file and to the hiding hash table.
+ * Also, add this file and to the set of hidden names.
  * Warning: If fname has the tag, fname gets modified.
  */
-static bool is_hiding(struct hashtable *hides, char *fname) {
+static bool is_hiding(name_set_t *hides, char *fname) {
 	DBG("%s\n", fname);
 
 	char *tag;
@@ -76,9 +84,8 @@ static bool is_hiding(struct hashtable *hides, char *fname) {
 		*tag = '\0'; // this modifies fname!
 
 		// add to hides (only if not there already)
-		if (!hashtable_search(hides, fname)) {
-			char *key = strdup(fname);
-			hashtable_insert(hides, key, key);
+		if (name_set_add(hides, fname) < 0) {
+			USYSLOG(LOG_ERR, "%s: out of memory\n", __func__);
 		}
 
 		RETURN(true);
@@ -90,58 +97,397 @@ static bool is_hiding(struct hashtable *hides, char *fname) {
 /**
  * Read whiteout files
  */
-static void read_whiteouts(const char *path, struct hashtable *whiteouts, int branch) {
+void read_whiteouts(const char *path, name_set_t *whiteouts, int branch) {
 	DBG("%s\n", path);
 
 	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[branch].path, METADIR, path)) return;
+	if (BUILD_PATH(p, METADIR, path)) return;
 
-	DIR *dp = opendir(p);
+	branch_dir_t *dp = branch_opendir(branch, p);
 	if (dp == NULL) return;
 
 	struct dirent *de;
-	while ((de = readdir(dp)) != NULL) {
+	while ((de = branch_readdir(dp)) != NULL) {
 		is_hiding(whiteouts, de->d_name);
 	}
 
-	closedir(dp);
+	branch_closedir(dp);
 }
 
 /**
- * unionfs-fuse readdir function
+ * Keeps track on which branches a directory exists while we go through
+ * the branches, see lcache_set_dirmask()
  */
-#if FUSE_USE_VERSION < 30
-int unionfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+typedef struct {
+	bool cached;		// dirmask came from the cache
+	bool complete;		// we know for every branch if the directory is there
+	uint64_t dirmask;
+	unsigned int seq;
+} dirmask_t;
+
+static void dirmask_init(dirmask_t *dm, const char *path) {
+	dm->seq = lcache_seq();
+	dm->cached = uopt.nbranches <= LCACHE_MAX_BRANCHES && lcache_lookup_dirmask(path, &dm->dirmask);
+	if (!dm->cached) dm->dirmask = 0;
+	dm->complete = uopt.nbranches <= LCACHE_MAX_BRANCHES;
+}
+
+/**
+ * Open path on branch, unless we know it's not there anyway.
+ */
+static branch_dir_t *dirmask_opendir(dirmask_t *dm, int branch, const char *path) {
+	if (dm->cached) {
+		if (!(dm->dirmask & BRANCH_BIT(branch))) return NULL;
+		return branch_opendir(branch, path);
+	}
+
+	if (!bloom_maybe(branch, path)) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	branch_dir_t *dp = branch_opendir(branch, path);
+	if (dp != NULL) {
+		if (dm->complete) dm->dirmask |= BRANCH_BIT(branch);
+	} else if (errno != ENOENT && errno != ENOTDIR) {
+		// e.g. EACCES, the directory might still be there
+		dm->complete = false;
+	}
+
+	return dp;
+}
+
+/**
+ * We went through all branches, remember the result
+ */
+static void dirmask_done(dirmask_t *dm, const char *path) {
+	if (!dm->cached && dm->complete) lcache_set_dirmask(path, dm->dirmask, dm->seq);
+}
+
+#ifdef __APPLE__
+	#define STAMP_MTIME(st) ((int64_t)(st)->st_mtimespec.tv_sec * 1000000000 + (st)->st_mtimespec.tv_nsec)
+	#define STAMP_CTIME(st) ((int64_t)(st)->st_ctimespec.tv_sec * 1000000000 + (st)->st_ctimespec.tv_nsec)
 #else
-int unionfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
-	(void) flags;  // just to prevent the compiler complaining about unused variables
+	#define STAMP_MTIME(st) ((int64_t)(st)->st_mtim.tv_sec * 1000000000 + (st)->st_mtim.tv_nsec)
+	#define STAMP_CTIME(st) ((int64_t)(st)->st_ctim.tv_sec * 1000000000 + (st)->st_ctim.tv_nsec)
 #endif
-	(void) offset;  // just to prevent the compiler complaining about unused variables
-	(void) fi;  // just to prevent the compiler complaining about unused variables
 
+// a directory changed within this time might change again without a new mtime
+#define RACY_NS 2000000000LL
+
+/**
+ * An entry of a merged directory listing
+ */
+typedef struct {
+	size_t name;		// offset of the name in dir_listing_t.names
+	int branch;		// the entry was found there
+	ino_t ino;
+	unsigned char type;	// d_type
+} dir_entry_t;
+
+/**
+ * The merged listing of a directory, taken on opendir(). Whiteouts and
+ * entries hidden by upper branches are not in it.
+ */
+typedef struct {
+	dir_entry_t *entries;
+	size_t n, size;
+	char *names;
+	size_t names_len, names_size;
+	unsigned int refs;	// open handles and the readdir cache
+	bool on_rw;		// the directory is on a rw branch, so it might change
+} dir_listing_t;
+
+typedef struct {
+	char *path;
+	dir_listing_t *listing;
+} dir_handle_t;
+
+static void put_listing(dir_listing_t *l) {
+	if (l == NULL) return;
+	if (__atomic_sub_fetch(&l->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+
+	free(l->entries);
+	free(l->names);
+	free(l);
+}
+
+static size_t listing_memory(const dir_listing_t *l) {
+	return sizeof(dir_listing_t) + l->size * sizeof(dir_entry_t) + l->names_size;
+}
+
+/*
+ * The readdir cache keeps merged listings of directories, so listing them
+ * again does not need to read all branches. An entry is valid as long as
+ * the directory and its whiteout directory look the same on all branches,
+ * which costs two lstat() per branch instead of reading them. Entries are
+ * evicted in LRU order to keep the memory below -o readdir_cache=MiB.
+ */
+
+/**
+ * What a directory on a branch looked like when it was listed
+ */
+typedef struct {
+	ino_t ino;		// 0 if it did not exist
+	int64_t mtime, ctime;	// ns
+} dir_stamp_t;
+
+typedef struct rdcache_entry {
+	struct rdcache_entry *prev, *next; // in LRU order, most recently used first
+	char *path;		// the key in rdcache
+	dir_listing_t *listing;
+	size_t memory;		// what we account for it
+	dir_stamp_t stamps[];	// the directory and its whiteout directory on every branch
+} rdcache_entry_t;
+
+static pthread_mutex_t rdcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct hashtable *rdcache;	// NULL if disabled
+static rdcache_entry_t *lru_first, *lru_last;
+static size_t rdcache_memory, rdcache_max_memory;
+static uint64_t rdcache_hits, rdcache_misses, rdcache_stale;
+static uint64_t readdir_plus;	// entries returned with their attributes
+
+void readdir_cache_init(void) {
+	if (uopt.rdcache_size == 0) return;
+
+	rdcache = create_hashtable(64, string_hash, string_equal);
+	if (rdcache == NULL) {
+		USYSLOG(LOG_ERR, "%s: out of memory, readdir cache disabled\n", __func__);
+		return;
+	}
+	rdcache_max_memory = (size_t)uopt.rdcache_size * 1024 * 1024;
+}
+
+/**
+ * Take the stamps of path on all branches, return false if the directory
+ * changed so recently that it might change again unnoticed.
+ */
+static bool take_stamps(const char *path, dir_stamp_t *stamps) {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	int64_t racy = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec - RACY_NS;
+	bool ok = true;
+
+	char meta[PATHLEN_MAX];
+	bool cow = uopt.cow_enabled && BUILD_PATH(meta, METADIR, path) == 0;
+
+	int i;
+	for (i = 0; i < uopt.nbranches; i++) {
+		int j;
+		for (j = 0; j < 2; j++) {
+			dir_stamp_t *s = &stamps[2 * i + j];
+			struct stat st;
+
+			memset(s, 0, sizeof(*s));
+			if (j == 1 && !cow) continue;
+			if (branch_lstat(i, j == 0 ? path : meta, &st) == -1) continue;
+
+			s->ino = st.st_ino;
+			s->mtime = STAMP_MTIME(&st);
+			s->ctime = STAMP_CTIME(&st);
+			// the listing only depends on the mtime
+			if (s->mtime > racy) ok = false;
+		}
+	}
+
+	return ok;
+}
+
+static void lru_unlink(rdcache_entry_t *e) {
+	if (e->prev) {
+		e->prev->next = e->next;
+	} else {
+		lru_first = e->next;
+	}
+	if (e->next) {
+		e->next->prev = e->prev;
+	} else {
+		lru_last = e->prev;
+	}
+}
+
+static void lru_push(rdcache_entry_t *e) {
+	e->prev = NULL;
+	e->next = lru_first;
+	if (lru_first) lru_first->prev = e;
+	lru_first = e;
+	if (lru_last == NULL) lru_last = e;
+}
+
+/**
+ * Remove e from the cache, needs rdcache_lock
+ */
+static void rdcache_drop(rdcache_entry_t *e) {
+	lru_unlink(e);
+	hashtable_remove(rdcache, e->path); // frees e->path
+	rdcache_memory -= e->memory;
+	put_listing(e->listing);
+	free(e);
+}
+
+/**
+ * Return the cached listing of path with a reference, if it is still valid.
+ */
+static dir_listing_t *rdcache_get(const char *path) {
+	if (rdcache == NULL) return NULL;
+
+	pthread_mutex_lock(&rdcache_lock);
+	rdcache_entry_t *e = hashtable_search(rdcache, (void *)path);
+	if (e == NULL) {
+		rdcache_misses++;
+		pthread_mutex_unlock(&rdcache_lock);
+		return NULL;
+	}
+	dir_listing_t *l = e->listing;
+	__atomic_add_fetch(&l->refs, 1, __ATOMIC_RELAXED);
+	size_t nstamps = 2 * uopt.nbranches;
+	dir_stamp_t old[nstamps];
+	memcpy(old, e->stamps, sizeof(old));
+	pthread_mutex_unlock(&rdcache_lock);
+
+	// no need to hold the lock while going to the branches
+	dir_stamp_t now[nstamps];
+	if (take_stamps(path, now) && memcmp(old, now, sizeof(old)) == 0) {
+		pthread_mutex_lock(&rdcache_lock);
+		rdcache_hits++;
+		e = hashtable_search(rdcache, (void *)path);
+		if (e && e->listing == l) {
+			lru_unlink(e);
+			lru_push(e);
+		}
+		pthread_mutex_unlock(&rdcache_lock);
+		return l;
+	}
+
+	pthread_mutex_lock(&rdcache_lock);
+	rdcache_stale++;
+	e = hashtable_search(rdcache, (void *)path);
+	if (e && e->listing == l) rdcache_drop(e);
+	pthread_mutex_unlock(&rdcache_lock);
+
+	put_listing(l);
+	return NULL;
+}
+
+/**
+ * Remember listing l of path, which was read after the stamps were taken
+ */
+static void rdcache_put(const char *path, dir_listing_t *l, const dir_stamp_t *stamps) {
+	size_t nstamps = 2 * uopt.nbranches;
+	size_t memory = sizeof(rdcache_entry_t) + nstamps * sizeof(dir_stamp_t) + strlen(path) + 1
+		+ listing_memory(l);
+
+	// large listings would throw out everything else
+	if (memory > rdcache_max_memory / 4) return;
+
+	rdcache_entry_t *e = malloc(sizeof(rdcache_entry_t) + nstamps * sizeof(dir_stamp_t));
+	char *key = strdup(path);
+	if (e == NULL || key == NULL) {
+		free(e);
+		free(key);
+		return;
+	}
+	e->path = key;
+	e->listing = l;
+	e->memory = memory;
+	memcpy(e->stamps, stamps, nstamps * sizeof(dir_stamp_t));
+
+	pthread_mutex_lock(&rdcache_lock);
+
+	rdcache_entry_t *old = hashtable_search(rdcache, key);
+	if (old) rdcache_drop(old);
+
+	while (lru_last && rdcache_memory + memory > rdcache_max_memory) rdcache_drop(lru_last);
+
+	if (!hashtable_insert(rdcache, key, e)) {
+		pthread_mutex_unlock(&rdcache_lock);
+		free(key);
+		free(e);
+		return;
+	}
+	__atomic_add_fetch(&l->refs, 1, __ATOMIC_RELAXED);
+	lru_push(e);
+	rdcache_memory += memory;
+
+	pthread_mutex_unlock(&rdcache_lock);
+}
+
+int readdir_print_stats(char *buf, size_t size) {
+	int len = snprintf(buf, size, "readdirplus: %" PRIu64 " entries with attributes\n",
+		__atomic_load_n(&readdir_plus, __ATOMIC_RELAXED));
+	size_t left = (size_t)len < size ? size - len : 0;
+	buf = left ? buf + len : NULL;
+
+	if (rdcache == NULL) return len + snprintf(buf, left, "readdir cache: disabled\n");
+
+	pthread_mutex_lock(&rdcache_lock);
+	len += snprintf(buf, left, "readdir cache: %u directories, %zu of %zu KiB, %" PRIu64 " hits, "
+		"%" PRIu64 " misses, %" PRIu64 " stale\n", hashtable_count(rdcache),
+		rdcache_memory / 1024, rdcache_max_memory / 1024, rdcache_hits, rdcache_misses, rdcache_stale);
+	pthread_mutex_unlock(&rdcache_lock);
+
+	return len;
+}
+
+static int listing_add(dir_listing_t *l, const struct dirent *de, int branch) {
+	if (l->n == l->size) {
+		size_t size = l->size ? 2 * l->size : 64;
+		dir_entry_t *e = realloc(l->entries, size * sizeof(dir_entry_t));
+		if (e == NULL) return -1;
+		l->entries = e;
+		l->size = size;
+	}
+
+	size_t len = strlen(de->d_name) + 1;
+	if (l->names_len + len > l->names_size) {
+		size_t size = l->names_size ? 2 * l->names_size : 1024;
+		while (size < l->names_len + len) size *= 2;
+		char *names = realloc(l->names, size);
+		if (names == NULL) return -1;
+		l->names = names;
+		l->names_size = size;
+	}
+
+	dir_entry_t *e = &l->entries[l->n++];
+	e->name = l->names_len;
+	e->branch = branch;
+	e->ino = de->d_ino;
+	e->type = de->d_type;
+
+	memcpy(l->names + l->names_len, de->d_name, len);
+	l->names_len += len;
+
+	return 0;
+}
+
+/**
+ * Merge the directory path of all branches into a listing
+ */
+static int read_listing(const char *path, dir_listing_t **listing) {
 	DBG("%s\n", path);
 
 	int i = 0;
 	int rc = 0;
 
+	dir_listing_t *l = calloc(1, sizeof(dir_listing_t));
+	if (l == NULL) RETURN(-ENOMEM);
+	l->refs = 1;
+
 	// we will store already added files here to handle same file names across different branches
-	struct hashtable *files = create_hashtable(16, string_hash, string_equal);
+	name_set_t files;
+	name_set_init(&files);
 
-	struct hashtable *whiteouts = NULL;
+	name_set_t whiteouts;
+	name_set_init(&whiteouts);
 
-	if (uopt.cow_enabled) whiteouts = create_hashtable(16, string_hash, string_equal);
+	dirmask_t dm;
+	dirmask_init(&dm, path);
 
 	bool subdir_hidden = false;
 
 	for (i = 0; i < uopt.nbranches; i++) {
 		if (subdir_hidden) break;
 
-		char p[PATHLEN_MAX];
-		if (BUILD_PATH(p, uopt.branches[i].path, path)) {
-			rc = -ENAMETOOLONG;
-			goto out;
-		}
-
 		// check if branches below this branch are hidden
 		int res = path_hidden(path, i);
 		if (res < 0) {
@@ -151,53 +497,169 @@ int unionfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t o
 
 		if (res > 0) subdir_hidden = true;
 
-		DIR *dp = opendir(p);
+		branch_dir_t *dp = dirmask_opendir(&dm, i, path);
 		if (dp == NULL) {
-			if (uopt.cow_enabled) read_whiteouts(path, whiteouts, i);
+			if (uopt.cow_enabled) read_whiteouts(path, &whiteouts, i);
 			continue;
 		}
+		if (uopt.branches[i].rw) l->on_rw = true;
 
 		struct dirent *de;
-		while ((de = readdir(dp)) != NULL) {
-			// already added in some other branch
-			if (hashtable_search(files, de->d_name) != NULL) continue;
-
+		while ((de = branch_readdir(dp)) != NULL) {
 			// check if we need file hiding
 			if (uopt.cow_enabled) {
 				// file should be hidden from the user
-				if (hashtable_search(whiteouts, de->d_name) != NULL) continue;
+				if (name_set_contains(&whiteouts, de->d_name)) continue;
 			}
 
-			if (hide_meta_files(i, p, de) == true) continue;
+			if (hide_meta_files(path, de) == true) continue;
 
-			// fill with something dummy, we're interested in key existence only
-			char *key = strdup(de->d_name);
-			hashtable_insert(files, key, key);
-
-			struct stat st;
-			memset(&st, 0, sizeof(st));
-			st.st_ino = de->d_ino;
-			st.st_mode = de->d_type << 12;
+			// already added in some other branch
+			int added = name_set_add(&files, de->d_name);
+			if (added == 0) continue;
 
-#if FUSE_USE_VERSION < 30
-			if (filler(buf, de->d_name, &st, 0)) break;
-#else
-			if (filler(buf, de->d_name, &st, 0, 0)) break;
-#endif
+			if (added < 0 || listing_add(l, de, i)) {
+				rc = -ENOMEM;
+				break;
+			}
 		}
 
-		closedir(dp);
-		if (uopt.cow_enabled) read_whiteouts(path, whiteouts, i);
+		branch_closedir(dp);
+		if (rc) goto out;
+		if (uopt.cow_enabled) read_whiteouts(path, &whiteouts, i);
 	}
 
+	dirmask_done(&dm, path);
+
 out:
-	hashtable_destroy(files, 0);
+	name_set_free(&files);
+	name_set_free(&whiteouts);
 
-	if (uopt.cow_enabled) hashtable_destroy(whiteouts, 0);
+	if (rc) {
+		put_listing(l);
+	} else {
+		*listing = l;
+	}
 
 	RETURN(rc);
 }
 
+/**
+ * Fill st for entry e of directory path. With plus all of it, so that
+ * the kernel doesn't need to ask for the attributes of every entry of the
+ * listing, otherwise only the type. Returns false if only the type is set.
+ */
+static bool fill_stat(struct stat *st, const char *path, const char *name, const dir_entry_t *e, bool plus) {
+	if (plus && strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+		char p[PATHLEN_MAX];
+		// the entry comes from the branch which lookups find first, too
+		if (BUILD_PATH(p, path, "/", name) == 0 && branch_lstat(e->branch, p, st) == 0) {
+			// like unionfs_getattr()
+			if (S_ISDIR(st->st_mode)) st->st_nlink = 1;
+			__atomic_add_fetch(&readdir_plus, 1, __ATOMIC_RELAXED);
+			return true;
+		}
+	}
+
+	memset(st, 0, sizeof(*st));
+	st->st_ino = e->ino;
+	st->st_mode = e->type << 12;
+
+	return false;
+}
+
+/**
+ * Take the listing of the directory, readdir() returns it piecewise.
+ */
+int unionfs_opendir(const char *path, struct fuse_file_info *fi) {
+	DBG("%s\n", path);
+
+	dir_handle_t *dh = calloc(1, sizeof(dir_handle_t));
+	if (dh == NULL) RETURN(-ENOMEM);
+
+	// fill_stat() looks the entries up below it
+	dh->path = strdup(path);
+	if (dh->path == NULL) {
+		free(dh);
+		RETURN(-ENOMEM);
+	}
+
+	dh->listing = rdcache_get(path);
+	if (dh->listing == NULL) {
+		dir_stamp_t stamps[2 * uopt.nbranches];
+		bool cacheable = rdcache && take_stamps(path, stamps);
+
+		int res = read_listing(path, &dh->listing);
+		if (res) {
+			free(dh->path);
+			free(dh);
+			RETURN(res);
+		}
+
+		if (cacheable) rdcache_put(path, dh->listing, stamps);
+	}
+
+#if FUSE_USE_VERSION >= 30 && FUSE_VERSION >= FUSE_MAKE_VERSION(3, 5)
+	// Only read-only branches contribute, so the listing only changes
+	// through us, and the kernel notices that itself. Changes of the
+	// branches behind our back are passed on by -o watch_branches.
+	if (uopt.kernel_dir_cache && !dh->listing->on_rw) {
+		fi->cache_readdir = 1;
+		fi->keep_cache = 1;
+	}
+#endif
+
+	fi->fh = (uintptr_t)dh;
+
+	RETURN(0);
+}
+
+int unionfs_releasedir(const char *path, struct fuse_file_info *fi) {
+	(void) path;  // just to prevent the compiler complaining about unused variables
+
+	dir_handle_t *dh = (dir_handle_t *)(uintptr_t)fi->fh;
+
+	put_listing(dh->listing);
+	free(dh->path);
+	free(dh);
+
+	RETURN(0);
+}
+
+/**
+ * unionfs-fuse readdir function, returns the listing taken by opendir()
+ * from offset on. The offset of an entry is its index + 1.
+ */
+#if FUSE_USE_VERSION < 30
+int unionfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+#else
+int unionfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
+#endif
+	(void) path;  // just to prevent the compiler complaining about unused variables
+
+	dir_handle_t *dh = (dir_handle_t *)(uintptr_t)fi->fh;
+	const dir_listing_t *l = dh->listing;
+
+	DBG("%s offset %jd\n", dh->path, (intmax_t)offset);
+
+	size_t i;
+	for (i = offset; i < l->n; i++) {
+		const dir_entry_t *e = &l->entries[i];
+		const char *name = l->names + e->name;
+
+		struct stat st;
+#if FUSE_USE_VERSION < 30
+		fill_stat(&st, dh->path, name, e, false);
+		if (filler(buf, name, &st, i + 1)) break;
+#else
+		bool plus = fill_stat(&st, dh->path, name, e, flags & FUSE_READDIR_PLUS);
+		if (filler(buf, name, &st, i + 1, plus ? FUSE_FILL_DIR_PLUS : 0)) break;
+#endif
+	}
+
+	RETURN(0);
+}
+
 /**
  * check if a directory on all paths is empty
  * return 0 if empty, 1 if not and negative value on error
@@ -213,21 +675,17 @@ int dir_not_empty(const char *path) {
 	int rc = 0;
 	int not_empty = 0;
 
-	struct hashtable *whiteouts = NULL;
+	name_set_t whiteouts;
+	name_set_init(&whiteouts);
 
-	if (uopt.cow_enabled) whiteouts = create_hashtable(16, string_hash, string_equal);
+	dirmask_t dm;
+	dirmask_init(&dm, path);
 
 	bool subdir_hidden = false;
 
 	for (i = 0; i < uopt.nbranches; i++) {
 		if (subdir_hidden) break;
 
-		char p[PATHLEN_MAX];
-		if (BUILD_PATH(p, uopt.branches[i].path, path)) {
-			rc = -ENAMETOOLONG;
-			goto out;
-		}
-
 		// check if branches below this branch are hidden
 		int res = path_hidden(path, i);
 		if (res < 0) {
@@ -237,14 +695,14 @@ int dir_not_empty(const char *path) {
 
 		if (res > 0) subdir_hidden = true;
 
-		DIR *dp = opendir(p);
+		branch_dir_t *dp = dirmask_opendir(&dm, i, path);
 		if (dp == NULL) {
-			if (uopt.cow_enabled) read_whiteouts(path, whiteouts, i);
+			if (uopt.cow_enabled) read_whiteouts(path, &whiteouts, i);
 			continue;
 		}
 
 		struct dirent *de;
-		while ((de = readdir(dp)) != NULL) {
+		while ((de = branch_readdir(dp)) != NULL) {
 			// Ignore . and ..
 			if ((strcmp(de->d_name, ".") == 0) ||  (strcmp(de->d_name, "..") == 0)) {
 				continue;
@@ -253,23 +711,25 @@ int dir_not_empty(const char *path) {
 			// check if we need file hiding
 			if (uopt.cow_enabled) {
 				// file should be hidden from the user
-				if (hashtable_search(whiteouts, de->d_name) != NULL) continue;
+				if (name_set_contains(&whiteouts, de->d_name)) continue;
 			}
 
-			if (hide_meta_files(i, p, de) == true) continue;
+			if (hide_meta_files(path, de) == true) continue;
 
 			// When we arrive here, a valid entry was found
 			not_empty = 1;
-			closedir(dp);
+			branch_closedir(dp);
 			goto out;
 		}
 
-		closedir(dp);
-		if (uopt.cow_enabled) read_whiteouts(path, whiteouts, i);
+		branch_closedir(dp);
+		if (uopt.cow_enabled) read_whiteouts(path, &whiteouts, i);
 	}
 
+	dirmask_done(&dm, path);
+
 out:
-	if (uopt.cow_enabled) hashtable_destroy(whiteouts, 0);
+	name_set_free(&whiteouts);
 
 	if (rc) RETURN(rc);
 
@@ -3,6 +3,11 @@
 
 #include <fuse.h>
 
+#include "name_set.h"
+
+int unionfs_opendir(const char *path, struct fuse_file_info *fi);
+int unionfs_releasedir(const char *path, struct fuse_file_info *fi);
+
 #if FUSE_USE_VERSION < 30
 int unionfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t off, struct fuse_file_info *fi);
 #else
@@ -10,5 +15,8 @@ int unionfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t o
 #endif
 
 int dir_not_empty(const char *path);
+void read_whiteouts(const char *path, name_set_t *whiteouts, int branch);
+void readdir_cache_init(void);
+int readdir_print_stats(char *buf, size_t size);
 
 #endif
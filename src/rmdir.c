@@ -29,7 +29,9 @@
 #include "debug.h"
 #include "cow.h"
 #include "general.h"
+#include "branch.h"
 #include "findbranch.h"
+#include "lookup_cache.h"
 #include "string.h"
 #include "readdir.h"
 #include "usyslog.h"
@@ -41,10 +43,7 @@
 static int rmdir_rw(const char *path, int branch_rw) {
 	DBG("%s\n", path);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[branch_rw].path, path)) return ENAMETOOLONG;
-
-	int res = rmdir(p);
+	int res = branch_rmdir(branch_rw, path);
 	if (res == -1) return errno;
 
 	return 0;
@@ -87,11 +86,15 @@ static int rmdir_ro(const char *path, int branch_ro) {
 int unionfs_rmdir(const char *path) {
 	DBG("%s\n", path);
 
-	if (dir_not_empty(path)) return -ENOTEMPTY;
-
-	int i = find_rorw_branch(path);
+	struct stat st;
+	int i = find_rorw_branch_stat(path, &st);
 	if (i == -1) return -errno;
 
+	// don't create a directory whiteout for a file
+	if (!S_ISDIR(st.st_mode)) return -ENOTDIR;
+
+	if (dir_not_empty(path)) return -ENOTEMPTY;
+
 	int res;
 	if (!uopt.branches[i].rw) {
 		// read-only branch
@@ -104,6 +107,7 @@ int unionfs_rmdir(const char *path) {
 		// read-write branch
 		res = rmdir_rw(path, i);
 		if (res == 0) {
+			lcache_invalidate(path);
 			// No need to be root, whiteouts are created as root!
 			maybe_whiteout(path, i, WHITEOUT_DIR);
 		}
@@ -0,0 +1,47 @@
+/*
+*  C Implementation: stats
+*
+* Description: runtime statistics, read with unionfsctl -s
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#include <stdio.h>
+
+#include "probe.h"
+#include "bloom.h"
+#include "watch.h"
+#include "passthrough.h"
+#include "readdir.h"
+#include "cow.h"
+#include "cow_utils.h"
+#include "lazy_copy.h"
+#include "stats.h"
+
+/**
+ * Write the statistics of all subsystems as text into buf, which is
+ * truncated if it is too small. Return the length like snprintf().
+ */
+int stats_print(char *buf, size_t size) {
+	int (*const print[])(char *, size_t) = {
+		probe_print_stats,
+		bloom_print_stats,
+		watch_print_stats,
+		passthrough_print_stats,
+		readdir_print_stats,
+		cow_print_stats,
+		cow_inflight_print_stats,
+		lazy_print_stats,
+	};
+	size_t len = 0;
+
+	size_t i;
+	for (i = 0; i < sizeof(print) / sizeof(print[0]); i++) {
+		size_t left = len < size ? size - len : 0;
+		len += print[i](left ? buf + len : NULL, left);
+	}
+
+	return len;
+}
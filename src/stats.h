@@ -0,0 +1,14 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+
+int stats_print(char *buf, size_t size);
+
+#endif
@@ -11,12 +11,15 @@
 
 #include "unionfs.h"
 
+#define UNIONFS_STATS_SIZE 4096
+
 
 enum unionfs_ioctls {
 	UNIONFS_ONOFF_DEBUG         = _IOW('E', 0, int),
 	UNIONFS_SET_DEBUG_FILE      = _IOW('E', 1, char[PATHLEN_MAX]),
 	UNIONFS_STATS_BYTES_READ    = _IOW('E', 2, void),
 	UNIONFS_STATS_BYTES_WRITTEN = _IOW('E', 3, void),
+	UNIONFS_GET_STATS           = _IOR('E', 4, char[UNIONFS_STATS_SIZE]),
 } unionfs_ioctls_t;
 
 #endif // UIOCTL_H_
@@ -36,6 +36,20 @@ static struct fuse_opt unionfs_opts[] = {
 	FUSE_OPT_KEY("relaxed_permissions", KEY_RELAXED_PERMISSIONS),
 	FUSE_OPT_KEY("statfs_omit_ro", KEY_STATFS_OMIT_RO),
 	FUSE_OPT_KEY("direct_io", KEY_DIRECT_IO),
+	FUSE_OPT_KEY("lookup_cache=%s", KEY_LOOKUP_CACHE),
+	FUSE_OPT_KEY("lookup_cache_ttl=%s", KEY_LOOKUP_CACHE_TTL),
+	FUSE_OPT_KEY("readdir_cache=%s", KEY_READDIR_CACHE),
+	FUSE_OPT_KEY("kernel_dir_cache", KEY_KERNEL_DIR_CACHE),
+	FUSE_OPT_KEY("whiteout_index", KEY_WHITEOUT_INDEX),
+	FUSE_OPT_KEY("io_uring", KEY_IO_URING),
+	FUSE_OPT_KEY("branch_index=%s", KEY_BRANCH_INDEX),
+	FUSE_OPT_KEY("branch_index_verify", KEY_BRANCH_INDEX_VERIFY),
+	FUSE_OPT_KEY("bloom_filter", KEY_BLOOM_FILTER),
+	FUSE_OPT_KEY("watch_branches", KEY_WATCH_BRANCHES),
+	FUSE_OPT_KEY("passthrough", KEY_PASSTHROUGH),
+	FUSE_OPT_KEY("splice", KEY_SPLICE),
+	FUSE_OPT_KEY("lazy_copyup=%s", KEY_LAZY_COPYUP),
+	FUSE_OPT_KEY("copyup_threads=%s", KEY_COPYUP_THREADS),
 	FUSE_OPT_KEY("--version", KEY_VERSION),
 	FUSE_OPT_KEY("-V", KEY_VERSION),
 	FUSE_OPT_END
@@ -35,11 +35,14 @@
 // file access protection mask
 #define S_PROT_MASK (S_ISUID| S_ISGID | S_ISVTX | S_IRWXU | S_IRWXG | S_IRWXO)
 
+struct bindex;
+
 typedef struct {
 	char *path;
 	int path_len;		// strlen(path)
 	int fd;			 // used to prevent accidental umounts of path
 	unsigned char rw;	 // the writable flag
+	struct bindex *index;	// metadata index of a ro branch, NULL if none
 } branch_entry_t;
 
 extern struct fuse_operations unionfs_oper;
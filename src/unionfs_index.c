@@ -0,0 +1,365 @@
+/*
+*  C Implementation: unionfs_index
+*
+* Description: build the metadata index of a read-only branch
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+*
+* Details:
+*	unionfs-index <branch> <index file> walks the branch (without
+*	following symlinks or crossing into other file systems) and writes
+*	the index which unionfs mmaps with -o branch_index=<n>:<index file>.
+*	See branch_index.h for the file format.
+*/
+
+#if defined __linux__
+	// For *at() functions
+	#define _XOPEN_SOURCE 700
+
+	#define _DEFAULT_SOURCE 1
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <sys/stat.h>
+
+#include "unionfs.h"
+#include "branch_index.h"
+
+typedef struct {
+	char *path;		// relative to the branch root, "" for the root
+	size_t name;		// offset of the last path element in path
+	struct stat st;
+	uint32_t children;	// first child in the children array
+	uint32_t nchildren;
+	bool whiteout;
+} node_t;
+
+static node_t *nodes;
+static uint32_t nnodes;
+static uint32_t nodes_size;
+static uint32_t *children;
+static uint64_t nchildren;
+
+static dev_t branch_dev;
+static uint32_t nwhiteouts;
+
+static void *xrealloc(void *ptr, size_t size) {
+	ptr = realloc(ptr, size);
+	if (ptr == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	return ptr;
+}
+
+static uint32_t add_node(const char *dir, const char *name, const struct stat *st) {
+	if (nnodes == UINT32_MAX) {
+		fprintf(stderr, "Too many files for an index\n");
+		exit(1);
+	}
+
+	if (nnodes == nodes_size) {
+		nodes_size = nodes_size ? 2 * nodes_size : 1024;
+		nodes = xrealloc(nodes, (size_t)nodes_size * sizeof(node_t));
+	}
+
+	node_t *n = &nodes[nnodes];
+	memset(n, 0, sizeof(*n));
+
+	size_t dirlen = strlen(dir);
+	n->path = xrealloc(NULL, dirlen + strlen(name) + 2);
+	if (dirlen) {
+		sprintf(n->path, "%s/%s", dir, name);
+		n->name = dirlen + 1;
+	} else {
+		strcpy(n->path, name);
+	}
+	n->st = *st;
+
+	// whiteouts are .unionfs/<path>_HIDDEN~
+	size_t len = strlen(n->path);
+	if (strncmp(n->path, METADIR, strlen(METADIR)) == 0 && len > strlen(HIDETAG)
+	&& strcmp(n->path + len - strlen(HIDETAG), HIDETAG) == 0) {
+		n->whiteout = true;
+		nwhiteouts++;
+	}
+
+	return nnodes++;
+}
+
+static int cmp_name(const void *a, const void *b) {
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/**
+ * Add all entries of directory node (open as dirfd) and recurse into the
+ * sub directories. Consumes dirfd.
+ */
+static void walk(int dirfd, uint32_t node) {
+	DIR *dp = fdopendir(dirfd);
+	if (dp == NULL) {
+		fprintf(stderr, "Failed to read /%s: %s\n", nodes[node].path, strerror(errno));
+		exit(1);
+	}
+
+	char **names = NULL;
+	size_t nnames = 0;
+	struct dirent *de;
+	while ((de = readdir(dp)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+
+		names = xrealloc(names, (nnames + 1) * sizeof(char *));
+		names[nnames] = strdup(de->d_name);
+		if (names[nnames] == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		nnames++;
+	}
+
+	// bindex_child() returns them sorted by name
+	qsort(names, nnames, sizeof(char *), cmp_name);
+
+	if (nchildren + nnames > UINT32_MAX) {
+		fprintf(stderr, "Too many files for an index\n");
+		exit(1);
+	}
+
+	nodes[node].children = nchildren;
+	nodes[node].nchildren = nnames;
+	children = xrealloc(children, (nchildren + nnames) * sizeof(uint32_t));
+
+	size_t i;
+	for (i = 0; i < nnames; i++) {
+		struct stat st;
+		if (fstatat(dirfd, names[i], &st, AT_SYMLINK_NOFOLLOW) == -1) {
+			fprintf(stderr, "Failed to stat /%s/%s: %s\n", nodes[node].path, names[i], strerror(errno));
+			exit(1);
+		}
+
+		// nodes may be moved by realloc, so don't keep a pointer
+		children[nchildren++] = add_node(nodes[node].path, names[i], &st);
+	}
+
+	uint32_t first = nodes[node].children;
+	for (i = 0; i < nnames; i++) {
+		uint32_t child = children[first + i];
+		if (!S_ISDIR(nodes[child].st.st_mode)) continue;
+
+		if (nodes[child].st.st_dev != branch_dev) {
+			// a mount point, we can't know whether it will be mounted later
+			fprintf(stderr, "/%s is on another file system, not supported\n", nodes[child].path);
+			exit(1);
+		}
+
+		int fd = openat(dirfd, names[i], O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		if (fd == -1) {
+			fprintf(stderr, "Failed to open /%s: %s\n", nodes[child].path, strerror(errno));
+			exit(1);
+		}
+		walk(fd, child);
+	}
+
+	for (i = 0; i < nnames; i++) free(names[i]);
+	free(names);
+	closedir(dp);
+}
+
+static uint64_t *hashes;
+
+static int cmp_hash(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	if (hashes[x] != hashes[y]) return hashes[x] < hashes[y] ? -1 : 1;
+	return strcmp(nodes[x].path, nodes[y].path);
+}
+
+static void write_all(FILE *f, const void *buf, size_t size, const char *file) {
+	if (size && fwrite(buf, size, 1, f) != 1) {
+		fprintf(stderr, "Failed to write %s: %s\n", file, strerror(errno));
+		exit(1);
+	}
+}
+
+static void to_entry(const node_t *n, struct bindex_entry *e) {
+	memset(e, 0, sizeof(*e));
+
+	e->ino = n->st.st_ino;
+	e->size = n->st.st_size;
+	e->blocks = n->st.st_blocks;
+	e->rdev = n->st.st_rdev;
+#ifdef __APPLE__
+	e->atime_sec = n->st.st_atimespec.tv_sec;
+	e->atime_nsec = n->st.st_atimespec.tv_nsec;
+	e->mtime_sec = n->st.st_mtimespec.tv_sec;
+	e->mtime_nsec = n->st.st_mtimespec.tv_nsec;
+	e->ctime_sec = n->st.st_ctimespec.tv_sec;
+	e->ctime_nsec = n->st.st_ctimespec.tv_nsec;
+#else
+	e->atime_sec = n->st.st_atim.tv_sec;
+	e->atime_nsec = n->st.st_atim.tv_nsec;
+	e->mtime_sec = n->st.st_mtim.tv_sec;
+	e->mtime_nsec = n->st.st_mtim.tv_nsec;
+	e->ctime_sec = n->st.st_ctim.tv_sec;
+	e->ctime_nsec = n->st.st_ctim.tv_nsec;
+#endif
+	e->mode = n->st.st_mode;
+	e->nlink = n->st.st_nlink;
+	e->uid = n->st.st_uid;
+	e->gid = n->st.st_gid;
+	e->children = n->children;
+	e->nchildren = n->nchildren;
+	if (n->whiteout) e->flags |= BINDEX_WHITEOUT;
+}
+
+/**
+ * Write the index, entries sorted by (hash, path) for bindex_lookup().
+ * It's written to a temporary file first, so that a running unionfs
+ * never sees a partial index.
+ */
+static void write_index(const char *file, const struct stat *root) {
+	uint32_t i;
+
+	hashes = xrealloc(NULL, nnodes * sizeof(uint64_t));
+	uint32_t *order = xrealloc(NULL, nnodes * sizeof(uint32_t));
+	for (i = 0; i < nnodes; i++) {
+		hashes[i] = bindex_hash(nodes[i].path);
+		order[i] = i;
+	}
+	qsort(order, nnodes, sizeof(uint32_t), cmp_hash);
+
+	// the walk numbered the nodes in walk order, the index by their position
+	uint32_t *pos = xrealloc(NULL, nnodes * sizeof(uint32_t));
+	for (i = 0; i < nnodes; i++) pos[order[i]] = i;
+	uint64_t c;
+	for (c = 0; c < nchildren; c++) children[c] = pos[children[c]];
+
+	uint64_t names_size = 0;
+	for (i = 0; i < nnodes; i++) names_size += strlen(nodes[i].path) + 1;
+	if (names_size > UINT32_MAX) {
+		fprintf(stderr, "Paths too long for an index\n");
+		exit(1);
+	}
+
+	struct bindex_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, BINDEX_MAGIC, sizeof(hdr.magic));
+	hdr.version = BINDEX_VERSION;
+	hdr.nentries = nnodes;
+	hdr.entries_off = sizeof(hdr);
+	hdr.children_off = hdr.entries_off + (uint64_t)nnodes * sizeof(struct bindex_entry);
+	hdr.nchildren = nchildren;
+	hdr.names_off = hdr.children_off + nchildren * sizeof(uint32_t);
+	hdr.names_size = names_size;
+	hdr.root_ino = root->st_ino;
+	hdr.root_mtime = BINDEX_MTIME(root);
+
+	char tmp[PATHLEN_MAX];
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", file) >= (int)sizeof(tmp)) {
+		fprintf(stderr, "Index path too long\n");
+		exit(1);
+	}
+
+	FILE *f = fopen(tmp, "w");
+	if (f == NULL) {
+		fprintf(stderr, "Failed to create %s: %s\n", tmp, strerror(errno));
+		exit(1);
+	}
+
+	write_all(f, &hdr, sizeof(hdr), tmp);
+
+	uint32_t off = 0;
+	for (i = 0; i < nnodes; i++) {
+		const node_t *n = &nodes[order[i]];
+		struct bindex_entry e;
+		to_entry(n, &e);
+		e.hash = hashes[order[i]];
+		e.path_off = off;
+		e.name_off = off + n->name;
+		off += strlen(n->path) + 1;
+
+		write_all(f, &e, sizeof(e), tmp);
+	}
+
+	write_all(f, children, nchildren * sizeof(uint32_t), tmp);
+
+	for (i = 0; i < nnodes; i++) {
+		const char *path = nodes[order[i]].path;
+		write_all(f, path, strlen(path) + 1, tmp);
+	}
+
+	if (fclose(f) == EOF) {
+		fprintf(stderr, "Failed to write %s: %s\n", tmp, strerror(errno));
+		exit(1);
+	}
+
+	if (rename(tmp, file) == -1) {
+		fprintf(stderr, "Failed to rename %s to %s: %s\n", tmp, file, strerror(errno));
+		exit(1);
+	}
+
+	free(pos);
+	free(order);
+	free(hashes);
+}
+
+static void print_help(char *progname) {
+	fprintf(stderr, "Usage:\n");
+	fprintf(stderr, "     %s <branch> <index file>\n", progname);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "     Write the metadata of the read-only branch into the index file,\n");
+	fprintf(stderr, "     to be used with unionfs -o branch_index=<branch number>:<index file>\n");
+	fprintf(stderr, "     The index has to be rebuilt whenever the branch is modified.\n");
+	fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv) {
+	char *progname = basename(argv[0]);
+
+	if (argc != 3) {
+		print_help(progname);
+		exit(1);
+	}
+
+	const char *branch = argv[1];
+	const char *file = argv[2];
+
+	int fd = open(branch, O_RDONLY | O_DIRECTORY);
+	if (fd == -1) {
+		fprintf(stderr, "Failed to open %s: %s\n", branch, strerror(errno));
+		exit(1);
+	}
+
+	struct stat root;
+	if (fstat(fd, &root) == -1) {
+		fprintf(stderr, "Failed to stat %s: %s\n", branch, strerror(errno));
+		exit(1);
+	}
+	branch_dev = root.st_dev;
+
+	walk(fd, add_node("", "", &root));
+
+	// the walk itself must not have changed the branch
+	struct stat now;
+	if (stat(branch, &now) == -1 || now.st_ino != root.st_ino || BINDEX_MTIME(&now) != BINDEX_MTIME(&root)) {
+		fprintf(stderr, "%s was modified while building the index\n", branch);
+		exit(1);
+	}
+
+	write_index(file, &root);
+
+	printf("%s: %u entries, %u whiteouts\n", file, nnodes, nwhiteouts);
+
+	return 0;
+}
@@ -17,6 +17,8 @@ static void print_help(char* progname) {
 	fprintf(stderr, "       -p </path/to/debug/file>\n");
 	fprintf(stderr, "       -d <on/off>\n");
 	fprintf(stderr, "          Enable or disable debugging.\n");
+	fprintf(stderr, "       -s\n");
+	fprintf(stderr, "          Print statistics.\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Example: ");
 	fprintf(stderr, " %s -p /tmp/unionfs-fuse.log -d on /mnt/unionfs/union\n", progname);
@@ -46,7 +48,8 @@ int main(int argc, char **argv) {
 	const char* argument_param;
 	int debug_on_off;
 	int ioctl_res;
-	while ((opt = getopt(argc, argv, "d:p:")) != -1) {
+	char stats[UNIONFS_STATS_SIZE];
+	while ((opt = getopt(argc, argv, "d:p:s")) != -1) {
 		switch (opt) {
 		case 'p':
 			argument_param = optarg;
@@ -96,6 +99,16 @@ int main(int argc, char **argv) {
 				exit(1);
 			}
 			break;
+		case 's':
+			ioctl_res = ioctl(fd, UNIONFS_GET_STATS, stats);
+			if (ioctl_res == -1) {
+				fprintf(stderr, "stats ioctl failed: %s\n",
+					strerror(errno) );
+				exit(1);
+			}
+			stats[sizeof(stats) - 1] = '\0';
+			printf("%s", stats);
+			break;
 		default:
 			fprintf(stderr, "Unhandled option %c given.\n", opt);
 			break;
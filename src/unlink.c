@@ -27,7 +27,10 @@
 #include "debug.h"
 #include "cow.h"
 #include "general.h"
+#include "branch.h"
 #include "findbranch.h"
+#include "lookup_cache.h"
+#include "passthrough.h"
 #include "string.h"
 
 /**
@@ -60,10 +63,7 @@ static int unlink_ro(const char *path, int branch_ro) {
 static int unlink_rw(const char *path, int branch_rw) {
 	DBG("%s\n", path);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[branch_rw].path, path)) RETURN(ENAMETOOLONG);
-
-	int res = unlink(p);
+	int res = branch_unlink(branch_rw, path);
 	if (res == -1) RETURN(errno);
 
 	RETURN(0);
@@ -75,8 +75,12 @@ static int unlink_rw(const char *path, int branch_rw) {
 int unionfs_unlink(const char *path) {
 	DBG("%s\n", path);
 
-	int i = find_rorw_branch(path);
-	if (i == -1) RETURN(errno);
+	struct stat st;
+	int i = find_rorw_branch_stat(path, &st);
+	if (i == -1) RETURN(-errno);
+
+	// don't create a file whiteout for a directory
+	if (S_ISDIR(st.st_mode)) RETURN(-EISDIR);
 
 	int res;
 	if (!uopt.branches[i].rw) {
@@ -90,10 +94,13 @@ int unionfs_unlink(const char *path) {
 		// read-write branch
 		res = unlink_rw(path, i);
 		if (res == 0) {
+			lcache_invalidate(path);
 			// No need to be root, whiteouts are created as root!
 			maybe_whiteout(path, i, WHITEOUT_FILE);
 		}
 	}
 
+	if (res == 0) passthrough_unlink(path);
+
 	RETURN(-res);
 }
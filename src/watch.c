@@ -0,0 +1,649 @@
+/*
+*  C Implementation: watch
+*
+* Description: notice changes made directly to the branches
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+*
+* Details:
+*	The lookup cache, the whiteout index and the bloom filters only see
+*	the changes made through unionfs. With -o watch_branches a thread
+*	watches the branches for changes made behind our back (e.g. by tools
+*	writing into the rw branch directly) and updates the caches. It also
+*	tells the kernel to forget what it cached about the changed paths.
+*	fanotify is used if possible, our own changes are filtered out by pid.
+*	It needs CAP_SYS_ADMIN, linux-5.9 and /proc. A branch which is the
+*	root of its file system gets one mark for the whole file system, all
+*	others one mark per directory, so that changes elsewhere on the same
+*	file system (often /) don't cost us anything. Otherwise inotify is
+*	used, which needs one watch per directory (see
+*	/proc/sys/fs/inotify/max_user_watches) and reports our own changes, too.
+*	If events were lost, everything is invalidated, except for the bloom
+*	filters, which can't be rebuilt while we are running.
+*/
+
+#if defined __linux__
+	// for open_by_handle_at()
+	#define _GNU_SOURCE
+#endif
+
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+	#include <sys/inotify.h>
+	#include <sys/fanotify.h>
+	#include <sys/vfs.h>
+#endif
+
+#include "unionfs.h"
+#include "opts.h"
+#include "string.h"
+#include "branch.h"
+#include "lookup_cache.h"
+#include "whiteout_index.h"
+#include "bloom.h"
+#include "watch.h"
+#include "debug.h"
+#include "usyslog.h"
+
+#ifdef __linux__
+
+// what happened to a path
+#define CHANGE_CREATED	0x1
+#define CHANGE_REMOVED	0x2
+#define CHANGE_MODIFIED	0x4	// attributes or data
+#define CHANGE_DIR	0x8
+
+#define WATCH_BUFSIZE (64 * 1024)
+
+#if FUSE_USE_VERSION >= 30
+static struct fuse *fuse; // to invalidate the kernel cache
+#endif
+
+static const char *method = "disabled";
+static uint64_t nevents;
+static uint64_t noverflows;
+
+/**
+ * Tell the kernel to drop what it has cached about path
+ */
+static void invalidate_kernel(const char *path) {
+#if FUSE_USE_VERSION >= 30
+	if (fuse) fuse_invalidate_path(fuse, path);
+#else
+	(void)path;
+#endif
+}
+
+/**
+ * Events were lost, we don't know what changed
+ */
+static void changed_everything(void) {
+	USYSLOG(LOG_WARNING, "%s: events lost, dropping all caches\n", method);
+
+	__atomic_fetch_add(&noverflows, 1, __ATOMIC_RELAXED);
+	lcache_invalidate_all();
+	invalidate_kernel("/");
+}
+
+/**
+ * Return the union path hidden by the whiteout path, NULL if path
+ * is not a whiteout.
+ */
+static char *whiteout_target(const char *path, char *buf) {
+	const char *meta = "/" METANAME "/";
+	size_t len = strlen(path);
+
+	if (strncmp(path, meta, strlen(meta)) != 0) return NULL;
+	if (len <= strlen(meta) + strlen(HIDETAG)) return NULL;
+	if (strcmp(path + len - strlen(HIDETAG), HIDETAG) != 0) return NULL;
+
+	// keep the slash of the meta dir
+	len -= strlen(meta) - 1 + strlen(HIDETAG);
+	memcpy(buf, path + strlen(meta) - 1, len);
+	buf[len] = '\0';
+
+	return buf;
+}
+
+/**
+ * path on branch was changed by someone else, update our caches
+ */
+static void changed(int branch, const char *path, int what) {
+	DBG("branch %d: %s %x\n", branch, path, what);
+
+	__atomic_fetch_add(&nevents, 1, __ATOMIC_RELAXED);
+
+	char hidden[PATHLEN_MAX];
+	if (what & (CHANGE_CREATED | CHANGE_REMOVED) && whiteout_target(path, hidden)) {
+		if (what & CHANGE_CREATED) {
+			windex_add(hidden, branch);
+		} else {
+			windex_remove(hidden, branch);
+		}
+
+		if (what & CHANGE_DIR) {
+			lcache_invalidate_all();
+		} else {
+			lcache_invalidate(hidden);
+		}
+		invalidate_kernel(hidden);
+	}
+
+	if (what & CHANGE_CREATED) bloom_add_tree(branch, path);
+
+	if (what & (CHANGE_CREATED | CHANGE_REMOVED)) {
+		// a directory might come or go with a whole sub-tree
+		if (what & CHANGE_DIR) {
+			lcache_invalidate_all();
+		} else {
+			lcache_invalidate(path);
+		}
+
+		// the kernel might have cached the listing of the parent
+		char parent[PATHLEN_MAX];
+		const char *slash = strrchr(path, '/');
+		size_t len = slash ? (size_t)(slash - path) : 0;
+		memcpy(parent, path, len);
+		strcpy(parent + len, len ? "" : "/");
+		invalidate_kernel(parent);
+	}
+
+	invalidate_kernel(path);
+}
+
+static bool watches_exhausted;
+
+/**
+ * Watch directory path on branch, real is its path in the file system.
+ * Return false if that failed.
+ */
+typedef bool (*watch_dir_t)(int fd, int branch, const char *path, const char *real);
+
+/**
+ * Watch directory path on branch and all directories below it. path is a
+ * PATHLEN_MAX buffer of length len, which is restored on return.
+ */
+static void watch_tree(int fd, watch_dir_t watch_dir, int branch, char *path, size_t len) {
+	char p[PATHLEN_MAX];
+	if (BUILD_PATH(p, uopt.branches[branch].path, path)) return;
+
+	if (!watch_dir(fd, branch, len ? path : "/", p)) {
+		if (errno == ENOSPC && !watches_exhausted) {
+			USYSLOG(LOG_WARNING, "%s: out of watches, changes below %s are not noticed\n", __func__, p);
+			watches_exhausted = true;
+		}
+		return;
+	}
+
+	branch_dir_t *dp = branch_opendir(branch, len ? path : "/");
+	if (dp == NULL) return;
+
+	struct dirent *de;
+	while ((de = branch_readdir(dp)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+		if (de->d_type != DT_DIR && de->d_type != DT_UNKNOWN) continue;
+
+		size_t namelen = strlen(de->d_name);
+		if (len + 1 + namelen >= PATHLEN_MAX) continue;
+		path[len] = '/';
+		memcpy(path + len + 1, de->d_name, namelen + 1);
+
+		struct stat st;
+		if (de->d_type == DT_DIR || (branch_lstat(branch, path, &st) == 0 && S_ISDIR(st.st_mode))) {
+			watch_tree(fd, watch_dir, branch, path, len + 1 + namelen);
+		}
+	}
+	path[len] = '\0';
+
+	branch_closedir(dp);
+}
+
+/*
+ * fanotify
+ */
+
+#ifdef FAN_REPORT_DFID_NAME
+
+typedef struct {
+	char *root;		// the real path of the branch
+	size_t root_len;
+	fsid_t fsid;
+	bool fs_mark;		// the whole file system is marked, not each directory
+} fan_branch_t;
+
+static fan_branch_t *fan_branches;
+static int proc_fd = -1; // /proc/self/fd
+
+/**
+ * Get the real path of the open file fd
+ */
+static int fd_path(int fd, char *buf, size_t size) {
+	char name[32];
+	snprintf(name, sizeof(name), "%d", fd);
+
+	ssize_t len = readlinkat(proc_fd, name, buf, size - 1);
+	if (len < 0 || (size_t)len >= size - 1) return -1;
+	buf[len] = '\0';
+
+	return 0;
+}
+
+#define FANOTIFY_MASK (FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO \
+	| FAN_ATTRIB | FAN_CLOSE_WRITE | FAN_ONDIR)
+
+/**
+ * Check if the branch open as fd is the root of its file system, i.e.
+ * a mount point and not a bind mount of a sub-directory.
+ */
+static bool is_fs_root(int fd) {
+	struct stat st, parent;
+	if (fstat(fd, &st) == -1 || fstatat(fd, "..", &parent, AT_SYMLINK_NOFOLLOW) == -1) return false;
+	if (st.st_dev == parent.st_dev && st.st_ino != parent.st_ino) return false;
+
+	union {
+		struct file_handle fh;
+		char buf[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+	} h;
+	h.fh.handle_bytes = MAX_HANDLE_SZ;
+	int mount_id;
+	if (name_to_handle_at(fd, "", &h.fh, &mount_id, AT_EMPTY_PATH) == -1) return false;
+
+	FILE *f = fopen("/proc/self/mountinfo", "r");
+	if (f == NULL) return false;
+
+	bool res = false;
+	char *line = NULL;
+	size_t size = 0;
+	while (getline(&line, &size, f) != -1) {
+		// the 4th field is the directory of the file system which is mounted
+		int id, n = 0;
+		if (sscanf(line, "%d %*d %*u:%*u %n", &id, &n) == 1 && n && id == mount_id) {
+			res = strncmp(line + n, "/ ", 2) == 0;
+			break;
+		}
+	}
+	free(line);
+	fclose(f);
+
+	return res;
+}
+
+static bool fan_watch_dir(int fd, int branch, const char *path, const char *real) {
+	(void)branch;
+	(void)path;
+
+	return fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_ONLYDIR | FAN_MARK_DONT_FOLLOW,
+		FANOTIFY_MASK | FAN_EVENT_ON_CHILD, AT_FDCWD, real) == 0;
+}
+
+static int fan_setup(void) {
+	proc_fd = open("/proc/self/fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (proc_fd == -1) return -1;
+
+	// we need CAP_SYS_ADMIN anyway, the marks per directory may be many
+	int fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_UNLIMITED_MARKS | FAN_CLOEXEC, O_RDONLY);
+	if (fd == -1) goto err;
+
+	fan_branches = calloc(uopt.nbranches, sizeof(fan_branch_t));
+	if (fan_branches == NULL) goto err;
+
+	int i;
+	for (i = 0; i < uopt.nbranches; i++) {
+		fan_branch_t *fb = &fan_branches[i];
+		char root[PATHLEN_MAX];
+		struct statfs sfs;
+
+		if (fd_path(uopt.branches[i].fd, root, sizeof(root))) goto err;
+		if (fstatfs(uopt.branches[i].fd, &sfs) == -1) goto err;
+
+		// "/" would make the prefix check below fail
+		fb->root = strdup(strcmp(root, "/") == 0 ? "" : root);
+		if (fb->root == NULL) goto err;
+		fb->root_len = strlen(fb->root);
+		fb->fsid = sfs.f_fsid;
+		fb->fs_mark = is_fs_root(uopt.branches[i].fd);
+
+		if (fb->fs_mark) {
+			if (fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FANOTIFY_MASK, uopt.branches[i].fd, NULL) == -1) {
+				goto err;
+			}
+		} else {
+			// fails with the same errors as the file system mark would
+			if (fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_ONLYDIR, FANOTIFY_MASK | FAN_EVENT_ON_CHILD,
+			uopt.branches[i].fd, NULL) == -1) {
+				goto err;
+			}
+			char path[PATHLEN_MAX] = "";
+			watch_tree(fd, fan_watch_dir, i, path, 0);
+		}
+	}
+
+	return fd;
+
+err:
+	DBG("fanotify not usable: %s\n", strerror(errno));
+	if (fan_branches) {
+		for (i = 0; i < uopt.nbranches; i++) free(fan_branches[i].root);
+		free(fan_branches);
+		fan_branches = NULL;
+	}
+	if (fd != -1) close(fd);
+	close(proc_fd);
+	return -1;
+}
+
+/**
+ * Map the directory file handle to its real path.
+ */
+static int fan_dir_path(const fsid_t *fsid, struct file_handle *fh, char *buf, size_t size) {
+	int i;
+	for (i = 0; i < uopt.nbranches; i++) {
+		if (memcmp(&fan_branches[i].fsid, fsid, sizeof(fsid_t)) == 0) break;
+	}
+	if (i == uopt.nbranches) return -1; // can't be, we only marked our file systems
+
+	int fd = open_by_handle_at(uopt.branches[i].fd, fh, O_PATH);
+	if (fd == -1) return -1;
+
+	int res = fd_path(fd, buf, size);
+	close(fd);
+
+	return res;
+}
+
+static void fan_event(int fd, const struct fanotify_event_metadata *meta) {
+	if (meta->mask & FAN_Q_OVERFLOW) {
+		changed_everything();
+		return;
+	}
+
+	// we took care of our own changes already
+	if (meta->pid == getpid()) return;
+
+	const struct fanotify_event_info_fid *fid = (const struct fanotify_event_info_fid *)(meta + 1);
+	if ((const char *)(fid + 1) > (const char *)meta + meta->event_len) return;
+	if (fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME) return;
+
+	struct file_handle *fh = (struct file_handle *)fid->handle;
+	const char *name = (const char *)fh->f_handle + fh->handle_bytes;
+
+	char dir[PATHLEN_MAX];
+	if (fan_dir_path((const fsid_t *)&fid->fsid, fh, dir, sizeof(dir))) {
+		// The directory was removed in the mean time (ESTALE), which with
+		// a file system mark happens all the time outside of the branches.
+		// If it was within a branch, the event for its removal from its
+		// parent directory drops it from the caches.
+		DBG("can't resolve directory handle: %s\n", strerror(errno));
+		return;
+	}
+
+	int what = 0;
+	if (meta->mask & (FAN_CREATE | FAN_MOVED_TO)) what |= CHANGE_CREATED;
+	if (meta->mask & (FAN_DELETE | FAN_MOVED_FROM)) what |= CHANGE_REMOVED;
+	if (meta->mask & (FAN_ATTRIB | FAN_CLOSE_WRITE)) what |= CHANGE_MODIFIED;
+	if (meta->mask & FAN_ONDIR) what |= CHANGE_DIR;
+
+	// several branches might be within each other
+	int i;
+	for (i = 0; i < uopt.nbranches; i++) {
+		fan_branch_t *fb = &fan_branches[i];
+		if (memcmp(&fb->fsid, &fid->fsid, sizeof(fsid_t)) != 0) continue;
+		if (strncmp(dir, fb->root, fb->root_len) != 0) continue;
+		if (dir[fb->root_len] != '/' && dir[fb->root_len] != '\0') continue;
+
+		char path[PATHLEN_MAX];
+		int res;
+		if (strcmp(name, ".") == 0) {
+			// an event on the directory itself
+			res = BUILD_PATH(path, "/", dir + fb->root_len);
+		} else {
+			res = BUILD_PATH(path, "/", dir + fb->root_len, "/", name);
+		}
+		if (res) continue;
+
+		// watch new directories, those moved in from outside have no marks yet
+		if ((what & CHANGE_CREATED) && (what & CHANGE_DIR) && !fb->fs_mark) {
+			watch_tree(fd, fan_watch_dir, i, path, strlen(path));
+		}
+
+		changed(i, path, what);
+	}
+}
+
+static void fan_loop(int fd) {
+	char buf[WATCH_BUFSIZE] __attribute__((aligned(__alignof__(struct fanotify_event_metadata))));
+
+	while (true) {
+		ssize_t len = read(fd, buf, sizeof(buf));
+		if (len == -1) {
+			if (errno == EINTR) continue;
+			USYSLOG(LOG_ERR, "%s: reading fanotify events failed: %s\n", __func__, strerror(errno));
+			return;
+		}
+
+		struct fanotify_event_metadata *meta = (struct fanotify_event_metadata *)buf;
+		for (; FAN_EVENT_OK(meta, len); meta = FAN_EVENT_NEXT(meta, len)) {
+			if (meta->vers != FANOTIFY_METADATA_VERSION) {
+				USYSLOG(LOG_ERR, "%s: unknown fanotify version %d\n", __func__, meta->vers);
+				return;
+			}
+			fan_event(fd, meta);
+		}
+	}
+}
+
+#endif // FAN_REPORT_DFID_NAME
+
+/*
+ * inotify
+ */
+
+typedef struct {
+	int branch;
+	char *path;	// union path of the watched directory, NULL if unused
+} watch_t;
+
+static watch_t *watches; // indexed by the watch descriptor
+static int nwatches;
+
+#define INOTIFY_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+	| IN_ATTRIB | IN_CLOSE_WRITE | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+static int set_watch(int wd, int branch, const char *path) {
+	if (wd >= nwatches) {
+		int n = wd + 1024;
+		watch_t *w = realloc(watches, n * sizeof(watch_t));
+		if (w == NULL) return -1;
+		memset(w + nwatches, 0, (n - nwatches) * sizeof(watch_t));
+		watches = w;
+		nwatches = n;
+	}
+
+	// a moved directory keeps its watch descriptor, but gets a new path
+	char *p = strdup(path);
+	if (p == NULL) return -1;
+	free(watches[wd].path);
+	watches[wd].branch = branch;
+	watches[wd].path = p;
+
+	return 0;
+}
+
+static bool ino_watch_dir(int fd, int branch, const char *path, const char *real) {
+	int wd = inotify_add_watch(fd, real, INOTIFY_MASK);
+	return wd != -1 && set_watch(wd, branch, path) == 0;
+}
+
+static int ino_setup(void) {
+	int fd = inotify_init1(IN_CLOEXEC);
+	if (fd == -1) return -1;
+
+	int i;
+	for (i = 0; i < uopt.nbranches; i++) {
+		char path[PATHLEN_MAX] = "";
+		watch_tree(fd, ino_watch_dir, i, path, 0);
+	}
+
+	return fd;
+}
+
+static void ino_event(int fd, const struct inotify_event *ev) {
+	if (ev->mask & IN_Q_OVERFLOW) {
+		changed_everything();
+		return;
+	}
+
+	if (ev->wd < 0 || ev->wd >= nwatches || watches[ev->wd].path == NULL) return;
+	watch_t *w = &watches[ev->wd];
+
+	if (ev->mask & IN_IGNORED) {
+		// the directory is gone
+		free(w->path);
+		w->path = NULL;
+		return;
+	}
+
+	if (ev->len == 0) return; // events on the directory itself are reported by its parent
+
+	char path[PATHLEN_MAX];
+	if (BUILD_PATH(path, w->path, "/", ev->name)) return;
+
+	int what = 0;
+	if (ev->mask & (IN_CREATE | IN_MOVED_TO)) what |= CHANGE_CREATED;
+	if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) what |= CHANGE_REMOVED;
+	if (ev->mask & (IN_ATTRIB | IN_CLOSE_WRITE)) what |= CHANGE_MODIFIED;
+	if (ev->mask & IN_ISDIR) what |= CHANGE_DIR;
+
+	// watch_tree() may move watches, w is invalid afterwards
+	int branch = w->branch;
+
+	// watch new directories, this also updates the paths of moved ones
+	if ((what & CHANGE_CREATED) && (what & CHANGE_DIR)) {
+		watch_tree(fd, ino_watch_dir, branch, path, strlen(path));
+	}
+
+	changed(branch, path, what);
+}
+
+static void ino_loop(int fd) {
+	char buf[WATCH_BUFSIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+	while (true) {
+		ssize_t len = read(fd, buf, sizeof(buf));
+		if (len == -1) {
+			if (errno == EINTR) continue;
+			USYSLOG(LOG_ERR, "%s: reading inotify events failed: %s\n", __func__, strerror(errno));
+			return;
+		}
+
+		char *p = buf;
+		while (p < buf + len) {
+			const struct inotify_event *ev = (const struct inotify_event *)p;
+			ino_event(fd, ev);
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+	}
+}
+
+typedef struct {
+	int fd;
+	bool fanotify;
+} watch_arg_t;
+
+static void *watch_thread(void *arg) {
+	watch_arg_t wa = *(watch_arg_t *)arg;
+	free(arg);
+
+#ifdef FAN_REPORT_DFID_NAME
+	if (wa.fanotify) fan_loop(wa.fd);
+#endif
+	if (!wa.fanotify) ino_loop(wa.fd);
+
+	// not fatal, but from now on we don't notice changes
+	USYSLOG(LOG_ERR, "Watching the branches stopped, caches may be stale\n");
+	method = "failed";
+
+	return NULL;
+}
+
+/**
+ * Start watching the branches. Needs to be called after the chroot from
+ * the init method, so that the branch paths are valid and we know the
+ * fuse handle.
+ */
+void watch_init(void) {
+	if (!uopt.watch_branches) return;
+
+#if FUSE_USE_VERSION >= 30
+	fuse = fuse_get_context()->fuse;
+#endif
+
+	watch_arg_t *wa = malloc(sizeof(watch_arg_t));
+	if (wa == NULL) {
+		USYSLOG(LOG_ERR, "%s: out of memory, not watching the branches\n", __func__);
+		return;
+	}
+
+	wa->fd = -1;
+	wa->fanotify = false;
+#ifdef FAN_REPORT_DFID_NAME
+	wa->fd = fan_setup();
+	wa->fanotify = wa->fd != -1;
+#endif
+	if (wa->fd == -1) wa->fd = ino_setup();
+	if (wa->fd == -1) {
+		USYSLOG(LOG_ERR, "%s: neither fanotify nor inotify work, not watching the branches: %s\n",
+			__func__, strerror(errno));
+		free(wa);
+		return;
+	}
+	method = wa->fanotify ? "fanotify" : "inotify";
+
+	pthread_t thread;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	int res = pthread_create(&thread, &attr, watch_thread, wa);
+	pthread_attr_destroy(&attr);
+	if (res != 0) {
+		USYSLOG(LOG_ERR, "%s: failed to start the watch thread: %s\n", __func__, strerror(res));
+		close(wa->fd);
+		free(wa);
+		method = "failed";
+	}
+}
+
+int watch_print_stats(char *buf, size_t size) {
+	return snprintf(buf, size, "watch: %s, %" PRIu64 " changes, %" PRIu64 " overflows\n",
+		method, __atomic_load_n(&nevents, __ATOMIC_RELAXED),
+		__atomic_load_n(&noverflows, __ATOMIC_RELAXED));
+}
+
+#else // __linux__
+
+void watch_init(void) {
+	if (uopt.watch_branches) {
+		USYSLOG(LOG_WARNING, "-o watch_branches is only supported on linux\n");
+	}
+}
+
+int watch_print_stats(char *buf, size_t size) {
+	return snprintf(buf, size, "watch: not supported\n");
+}
+
+#endif // __linux__
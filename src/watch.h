@@ -0,0 +1,15 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stddef.h>
+
+void watch_init(void);
+int watch_print_stats(char *buf, size_t size);
+
+#endif
@@ -0,0 +1,212 @@
+/*
+*  C Implementation: whiteout_index
+*
+* Description: in-memory index of the whiteouts of all branches
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+*
+* Details:
+*	path_hidden() has to check every component of a path for a whiteout,
+*	which costs one lstat() per component and branch, even if there is not
+*	a single whiteout. With -o whiteout_index the .unionfs meta directories
+*	of all branches are read once on mount and the hidden paths are kept
+*	in one hash table per branch, so the check is a few hash lookups.
+*	hide_file(), hide_dir() and remove_hidden() keep the index up to date.
+*	Whiteouts created directly in a branch while we are mounted are not
+*	noticed.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "unionfs.h"
+#include "opts.h"
+#include "hashtable.h"
+#include "string.h"
+#include "branch.h"
+#include "whiteout_index.h"
+#include "debug.h"
+#include "usyslog.h"
+
+typedef struct {
+	struct hashtable *hidden;	// hidden paths, without the HIDETAG
+	pthread_rwlock_t lock;
+} windex_t;
+
+static windex_t *windex; // one per branch, NULL if the index is disabled
+
+/**
+ * Copy path to dest with duplicate and trailing slashes removed, so that
+ * "/dir1//dir2/" and "/dir1/dir2" give the same key.
+ */
+static int normalize(char *dest, const char *path) {
+	if (strlen(path) >= PATHLEN_MAX) return -ENAMETOOLONG;
+
+	char *w = dest;
+	while (*path) {
+		while (*path == '/') path++;
+		if (*path == '\0') break;
+
+		*w++ = '/';
+		while (*path && *path != '/') *w++ = *path++;
+	}
+	*w = '\0';
+
+	return 0;
+}
+
+static void add_key(windex_t *wi, const char *key) {
+	if (hashtable_search(wi->hidden, (void *)key)) return;
+
+	char *k = strdup(key);
+	if (k == NULL || !hashtable_insert(wi->hidden, k, k)) {
+		USYSLOG(LOG_ERR, "%s: out of memory\n", __func__);
+		free(k);
+	}
+}
+
+/**
+ * Recursively read a meta directory. dir is the path of the directory
+ * relative to the branch, rel the union path it corresponds to.
+ */
+static void read_metadir(windex_t *wi, int branch, const char *dir, const char *rel) {
+	DBG("%s\n", dir);
+
+	branch_dir_t *dp = branch_opendir(branch, dir);
+	if (dp == NULL) return;
+
+	struct dirent *de;
+	while ((de = branch_readdir(dp)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+
+		char member[PATHLEN_MAX];
+		if (BUILD_PATH(member, rel, "/", de->d_name)) continue;
+
+		char *tag = whiteout_tag(de->d_name);
+		if (tag) {
+			// the whiteout hides member without the tag, no need
+			// to look into a whiteout directory
+			member[strlen(member) - strlen(HIDETAG)] = '\0';
+			add_key(wi, member);
+			continue;
+		}
+
+		char p[PATHLEN_MAX];
+		if (BUILD_PATH(p, dir, "/", de->d_name)) continue;
+
+		struct stat st;
+		if (branch_lstat(branch, p, &st) == 0 && S_ISDIR(st.st_mode)) {
+			read_metadir(wi, branch, p, member);
+		}
+	}
+
+	branch_closedir(dp);
+}
+
+/**
+ * Build the index of all branches. Needs to be called after we went into
+ * the chroot, so that the branch paths are valid.
+ */
+void windex_init(void) {
+	if (!uopt.whiteout_index || !uopt.cow_enabled) return;
+
+	windex = calloc(uopt.nbranches, sizeof(windex_t));
+	if (windex == NULL) {
+		USYSLOG(LOG_ERR, "%s: out of memory, whiteout index disabled\n", __func__);
+		return;
+	}
+
+	int i;
+	for (i = 0; i < uopt.nbranches; i++) {
+		windex_t *wi = &windex[i];
+
+		pthread_rwlock_init(&wi->lock, NULL);
+		wi->hidden = create_hashtable(16, string_hash, string_equal);
+		if (wi->hidden == NULL) {
+			// we must not continue with a partial index
+			USYSLOG(LOG_ERR, "%s: out of memory, aborting\n", __func__);
+			exit(1);
+		}
+
+		read_metadir(wi, i, METANAME, "");
+
+		DBG("branch %d: %u whiteouts\n", i, hashtable_count(wi->hidden));
+	}
+}
+
+bool windex_enabled(void) {
+	return windex != NULL;
+}
+
+/**
+ * Check if path or any of its parent directories is hidden on branch.
+ */
+int windex_hidden(const char *path, int branch) {
+	windex_t *wi = &windex[branch];
+
+	char p[PATHLEN_MAX];
+	if (normalize(p, path)) RETURN(-ENAMETOOLONG);
+
+	int res = 0;
+
+	pthread_rwlock_rdlock(&wi->lock);
+
+	if (hashtable_count(wi->hidden) > 0) {
+		// check "/dir1", then "/dir1/dir2", ...
+		char *walk = p;
+		while (*walk != '\0') {
+			walk++; // jump over the slash
+			while (*walk != '\0' && *walk != '/') walk++;
+
+			char c = *walk;
+			*walk = '\0';
+			bool found = hashtable_search(wi->hidden, p) != NULL;
+			*walk = c;
+
+			if (found) {
+				res = 1;
+				break;
+			}
+		}
+	}
+
+	pthread_rwlock_unlock(&wi->lock);
+
+	RETURN(res);
+}
+
+/**
+ * A whiteout for path was created on branch
+ */
+void windex_add(const char *path, int branch) {
+	if (!windex) return;
+
+	char p[PATHLEN_MAX];
+	if (normalize(p, path)) return;
+
+	pthread_rwlock_wrlock(&windex[branch].lock);
+	add_key(&windex[branch], p);
+	pthread_rwlock_unlock(&windex[branch].lock);
+}
+
+/**
+ * The whiteout for path on branch was removed
+ */
+void windex_remove(const char *path, int branch) {
+	if (!windex) return;
+
+	char p[PATHLEN_MAX];
+	if (normalize(p, path)) return;
+
+	pthread_rwlock_wrlock(&windex[branch].lock);
+	hashtable_remove(windex[branch].hidden, p); // frees the key, which is also the value
+	pthread_rwlock_unlock(&windex[branch].lock);
+}
@@ -0,0 +1,18 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef WHITEOUT_INDEX_H
+#define WHITEOUT_INDEX_H
+
+#include <stdbool.h>
+
+void windex_init(void);
+bool windex_enabled(void);
+int windex_hidden(const char *path, int branch);
+void windex_add(const char *path, int branch);
+void windex_remove(const char *path, int branch);
+
+#endif
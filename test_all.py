@@ -7,12 +7,16 @@
 import unittest
 import subprocess
 import os
+import re
 import shutil
 import time
 import tempfile
 import stat
 import platform
 import errno
+import mmap
+import threading
+import struct
 
 
 def call(cmd):
@@ -206,6 +210,22 @@ class UnionFS_RW_RO_TestCase(Common, unittest.TestCase):
 	def test_copystat(self):
 		shutil.copystat('union/ro1_file', 'union/rw1_file')
 
+	def test_open_file(self):
+		with open('union/rw1_file', 'r+') as f:
+			os.ftruncate(f.fileno(), 1)
+			os.fchmod(f.fileno(), 0o600)
+			os.rename('union/rw1_file', 'union/rw1_file_renamed')
+			self.assertEqual(os.fstat(f.fileno()).st_size, 1)
+			self.assertEqual(stat.S_IMODE(os.fstat(f.fileno()).st_mode), 0o600)
+		self.assertEqual(read_from_file('rw1/rw1_file_renamed'), 'r')
+
+	def test_listing_open_dir(self):
+		fd = os.open('union/rw1_dir', os.O_RDONLY)
+		try:
+			self.assertEqual(os.listdir(fd), ['rw1_file'])
+		finally:
+			os.close(fd)
+
 	def test_mkdir(self):
 		os.mkdir('union/dir')
 		self.assertTrue(os.path.isdir('union/dir'))
@@ -256,6 +276,84 @@ class UnionFS_RW_RO_RO_COW_TestCase(Common, unittest.TestCase):
 		self.assertEqual(read_from_file('ro1/ro1_file'), 'ro1')
 		self.assertEqual(read_from_file('rw1/ro1_file'), 'something')
 
+	def test_cow_large_file(self):
+		data = os.urandom(5 * 1024 * 1024)
+		with open('ro1/large_file', 'wb') as f:
+			f.write(data)
+
+		with open('union/large_file', 'r+b') as f:
+			f.write(b'x')
+
+		with open('ro1/large_file', 'rb') as f:
+			self.assertEqual(f.read(), data)
+		with open('rw1/large_file', 'rb') as f:
+			self.assertEqual(f.read(), b'x' + data[1:])
+
+	def test_cow_concurrent(self):
+		data = os.urandom(8 * 1024 * 1024)
+		with open('ro1/large_file', 'wb') as f:
+			f.write(data)
+
+		def write(i):
+			with open('union/large_file', 'r+b') as f:
+				f.seek(i * 1024 * 1024)
+				f.write(b'x')
+
+		threads = [threading.Thread(target=write, args=(i,)) for i in range(8)]
+		for t in threads:
+			t.start()
+		for t in threads:
+			t.join()
+
+		expected = bytearray(data)
+		for i in range(8):
+			expected[i * 1024 * 1024] = ord('x')
+		with open('rw1/large_file', 'rb') as f:
+			self.assertEqual(f.read(), bytes(expected))
+		self.assertIn('copy-up in flight:', call('%s -s union' % self.unionfsctl_path).decode())
+
+	def test_cow_sparse_file(self):
+		with open('ro1/sparse_file', 'wb') as f:
+			f.truncate(64 * 1024 * 1024)
+			f.seek(32 * 1024 * 1024)
+			f.write(b'data')
+		ro_blocks = os.stat('ro1/sparse_file').st_blocks
+
+		os.chmod('union/sparse_file', 0o600)
+
+		st = os.stat('rw1/sparse_file')
+		self.assertEqual(st.st_size, 64 * 1024 * 1024)
+		self.assertLessEqual(st.st_blocks, ro_blocks)
+		with open('union/sparse_file', 'rb') as f:
+			f.seek(32 * 1024 * 1024)
+			self.assertEqual(f.read(4), b'data')
+
+	@unittest.skipIf(os.environ.get('RUNNING_ON_TRAVIS_CI'), 'Not supported on Travis')
+	@unittest.skipIf(platform.system() == 'Darwin', 'Not supported on macOS')
+	def test_cow_stats(self):
+		write_to_file('union/ro1_file', 'something')
+		res = call('%s -s union' % self.unionfsctl_path).decode()
+		self.assertIn('copy-up:', res)
+
+	def test_getattr_after_cow(self):
+		fd = os.open('union/ro1_file', os.O_RDONLY)
+		try:
+			with open('union/ro1_file', 'a') as f:
+				f.write('xyz')
+			self.assertEqual(os.lseek(fd, 0, os.SEEK_END), 6)
+		finally:
+			os.close(fd)
+
+	def test_getattr_after_cow_and_rename(self):
+		fd = os.open('union/ro1_file', os.O_RDONLY)
+		try:
+			os.rename('union/ro1_file', 'union/renamed')
+			with open('union/renamed', 'a') as f:
+				f.write('xyz')
+			self.assertEqual(os.lseek(fd, 0, os.SEEK_END), 6)
+		finally:
+			os.close(fd)
+
 	def test_cow_and_whiteout(self):
 		write_to_file('union/ro1_file', 'something')
 		os.remove('union/ro1_file')
@@ -439,6 +537,69 @@ class UnionFS_RW_RO_RO_COW_TestCase(Common, unittest.TestCase):
 		os.rmdir('union/common_dir')
 		self.assertFalse(os.path.exists('union/common_dir'))
 
+	def test_wrong_type(self):
+		with self.assertRaises(IsADirectoryError):
+			os.remove('union/ro1_dir')
+		with self.assertRaises(NotADirectoryError):
+			os.rmdir('union/ro1_file')
+		self.assertTrue(os.path.isdir('union/ro1_dir'))
+		self.assertTrue(os.path.isfile('union/ro1_file'))
+		self.assertFalse(os.path.exists('rw1/.unionfs'))
+
+	def test_large_listing(self):
+		os.mkdir('ro1/large_dir')
+		os.mkdir('rw1/large_dir')
+		for i in range(3000):
+			write_to_file('ro1/large_dir/file_with_a_long_name_%d' % i, '')
+		for i in range(0, 3000, 2):
+			write_to_file('rw1/large_dir/file_with_a_long_name_%d' % i, '')
+		os.remove('union/large_dir/file_with_a_long_name_7')
+		lst = os.listdir('union/large_dir')
+		self.assertEqual(len(lst), 2999)
+		self.assertEqual(len(set(lst)), 2999)
+		self.assertNotIn('file_with_a_long_name_7', lst)
+
+	@unittest.skipIf(os.environ.get('RUNNING_ON_TRAVIS_CI'), 'Not supported on Travis')
+	@unittest.skipIf(platform.system() == 'Darwin', 'Not supported on macOS')
+	def test_listing_attributes(self):
+		def readdir_plus():
+			res = call('%s -s union' % self.unionfsctl_path).decode()
+			return int(re.search(r'readdirplus: (\d+) entries', res).group(1))
+
+		write_to_file('ro2/ro2_dir/longer_file', 'longer')
+		os.symlink('ro2_file', 'ro2/ro2_dir/link')
+		before = readdir_plus()
+		entries = list(os.scandir('union/ro2_dir'))
+		# the attributes come with the listing instead of a lookup per entry
+		self.assertGreaterEqual(readdir_plus() - before, len(entries))
+		for entry in entries:
+			st = entry.stat(follow_symlinks=False)
+			self.assertEqual(st.st_size, os.lstat('ro2/ro2_dir/%s' % entry.name).st_size)
+			self.assertEqual(stat.S_IFMT(st.st_mode), stat.S_IFMT(os.lstat('ro2/ro2_dir/%s' % entry.name).st_mode))
+		self.assertEqual(os.stat('union/ro2_dir/longer_file').st_size, 6)
+
+	@unittest.skipIf(not hasattr(os, 'copy_file_range'), 'copy_file_range() not available')
+	def test_copy_file_range(self):
+		with open('union/ro1_dir/ro1_file', 'rb') as src, open('union/copy', 'wb') as dst:
+			self.assertEqual(os.copy_file_range(src.fileno(), dst.fileno(), 100, 1, 0), 2)
+		self.assertEqual(read_from_file('union/copy'), 'o1')
+		self.assertEqual(read_from_file('rw1/copy'), 'o1')
+
+	@unittest.skipIf(platform.system() == 'Darwin', 'Not supported on macOS')
+	def test_sparse_file(self):
+		with open('union/sparse', 'wb') as f:
+			os.posix_fallocate(f.fileno(), 0, 4096)
+			f.seek(16 * 1024 * 1024)
+			f.write(b'x')
+		self.assertGreaterEqual(os.stat('rw1/sparse').st_blocks * 512, 4096)
+		with open('union/sparse', 'rb') as f:
+			try:
+				hole = os.lseek(f.fileno(), 0, os.SEEK_HOLE)
+			except OSError as e:
+				self.skipTest('SEEK_HOLE not supported: %s' % e)
+			self.assertLess(hole, 16 * 1024 * 1024)
+			self.assertLessEqual(os.lseek(f.fileno(), hole, os.SEEK_DATA), 16 * 1024 * 1024)
+
 
 class UnionFS_RO_RW_TestCase(Common, unittest.TestCase):
 	def setUp(self):
@@ -541,6 +702,509 @@ class UnionFS_RO_RW_COW_TestCase(Common, unittest.TestCase):
 		#self.assertFalse(os.path.exists('union/common_dir'))
 
 
+class UnionFS_RW_RO_COW_WhiteoutIndex_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		# whiteouts existing before mount need to be picked up
+		os.makedirs('rw1/.unionfs/common_dir')
+		write_to_file('rw1/.unionfs/ro1_file_HIDDEN~', '')
+		os.mkdir('rw1/.unionfs/ro1_dir_HIDDEN~')
+		write_to_file('rw1/.unionfs/common_dir/ro_common_file_HIDDEN~', '')
+		self.mount('-o cow,whiteout_index rw1=rw:ro1=ro union')
+
+	def test_existing_whiteouts(self):
+		self.assertNotIn('ro1_file', os.listdir('union'))
+		self.assertFalse(os.path.exists('union/ro1_file'))
+		self.assertFalse(os.path.exists('union/ro1_dir'))
+		self.assertFalse(os.path.exists('union/ro1_dir/ro1_file'))
+		self.assertFalse(os.path.exists('union/common_dir/ro_common_file'))
+		self.assertTrue(os.path.isfile('union/common_dir/common_file'))
+
+	def test_whiteout_and_recreate(self):
+		os.remove('union/ro_common_file')
+		self.assertFalse(os.path.exists('union/ro_common_file'))
+		self.assertTrue(os.path.isfile('rw1/.unionfs/ro_common_file_HIDDEN~'))
+
+		write_to_file('union/ro_common_file', 'something')
+		self.assertEqual(read_from_file('union/ro_common_file'), 'something')
+		self.assertFalse(os.path.exists('rw1/.unionfs/ro_common_file_HIDDEN~'))
+
+
+class UnionFS_RW_RO_RO_COW_LookupCache_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		self.mount('-o cow,lookup_cache=1000,lookup_cache_ttl=0 rw1=rw:ro1=ro:ro2=ro union')
+
+	def test_lookup(self):
+		self.assertEqual(read_from_file('union/common_file'), 'rw1')
+		self.assertEqual(read_from_file('union/ro2_dir/ro2_file'), 'ro2')
+		self.assertEqual(read_from_file('union/common_dir/ro_common_file'), 'ro1')
+		self.assertFalse(os.path.exists('union/ro2_dir/not_existing'))
+
+	def test_create_in_lower_dir(self):
+		# ro2_dir is only known to be on ro2, until it gets copied up
+		self.assertEqual(os.listdir('union/ro2_dir'), ['ro2_file'])
+		self.assertFalse(os.path.exists('union/ro2_dir/new_file'))
+		write_to_file('union/ro2_dir/new_file', 'new')
+		self.assertEqual(read_from_file('union/ro2_dir/new_file'), 'new')
+		self.assertEqual(sorted(os.listdir('union/ro2_dir')), ['new_file', 'ro2_file'])
+
+	def test_mkdir_rmdir(self):
+		self.assertFalse(os.path.exists('union/new_dir/file'))
+		os.mkdir('union/new_dir')
+		write_to_file('union/new_dir/file', 'something')
+		self.assertEqual(read_from_file('union/new_dir/file'), 'something')
+		os.remove('union/new_dir/file')
+		os.rmdir('union/new_dir')
+		self.assertFalse(os.path.exists('union/new_dir'))
+
+	def test_remove_dir(self):
+		shutil.rmtree('union/ro1_dir')
+		self.assertFalse(os.path.exists('union/ro1_dir/ro1_file'))
+		os.mkdir('union/ro1_dir')
+		self.assertEqual(os.listdir('union/ro1_dir'), [])
+
+
+# entries never expire, so every change must invalidate them
+class UnionFS_RW_RO_COW_LookupCacheInvalidation_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		self.mount('-o cow,lookup_cache=1000,lookup_cache_ttl=0 rw1=rw:ro1=ro union')
+
+	def test_unlink(self):
+		self.assertEqual(read_from_file('union/rw1_file'), 'rw1')
+		os.remove('union/rw1_file')
+		self.assertFalse(os.path.exists('union/rw1_file'))
+		write_to_file('union/rw1_file', 'new')
+		self.assertEqual(read_from_file('union/rw1_file'), 'new')
+
+	def test_whiteout(self):
+		self.assertEqual(read_from_file('union/common_file'), 'rw1')
+		os.remove('union/common_file')
+		self.assertFalse(os.path.exists('union/common_file'))
+		self.assertEqual(read_from_file('union/ro1_file'), 'ro1')
+		os.remove('union/ro1_file')
+		self.assertFalse(os.path.exists('union/ro1_file'))
+		write_to_file('union/ro1_file', 'new')
+		self.assertEqual(read_from_file('union/ro1_file'), 'new')
+
+	def test_rename(self):
+		self.assertEqual(read_from_file('union/ro1_file'), 'ro1')
+		self.assertFalse(os.path.exists('union/renamed'))
+		os.rename('union/ro1_file', 'union/renamed')
+		self.assertFalse(os.path.exists('union/ro1_file'))
+		self.assertEqual(read_from_file('union/renamed'), 'ro1')
+
+	def test_copyup(self):
+		self.assertEqual(read_from_file('union/ro1_dir/ro1_file'), 'ro1')
+		write_to_file('union/ro1_dir/ro1_file', 'new')
+		self.assertEqual(read_from_file('union/ro1_dir/ro1_file'), 'new')
+		self.assertEqual(read_from_file('rw1/ro1_dir/ro1_file'), 'new')
+		os.chmod('union/ro1_file', 0o600)
+		self.assertEqual(stat.S_IMODE(os.stat('union/ro1_file').st_mode), 0o600)
+
+
+# falls back to sequential lookups if compiled without io_uring support
+class UnionFS_RW_RO_RO_COW_IOUring_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		self.mount('-o cow,io_uring rw1=rw:ro1=ro:ro2=ro union')
+
+	def test_branch_priority(self):
+		self.assertEqual(read_from_file('union/common_file'), 'rw1')
+		self.assertEqual(read_from_file('union/ro_common_file'), 'ro1')
+		self.assertEqual(read_from_file('union/ro2_dir/ro2_file'), 'ro2')
+		self.assertFalse(os.path.exists('union/not_existing'))
+
+	def test_whiteout(self):
+		os.remove('union/ro_common_file')
+		self.assertFalse(os.path.exists('union/ro_common_file'))
+
+		shutil.rmtree('union/ro1_dir')
+		self.assertFalse(os.path.exists('union/ro1_dir/ro1_file'))
+
+	@unittest.skipIf(os.environ.get('RUNNING_ON_TRAVIS_CI'), 'Not supported on Travis')
+	@unittest.skipIf(platform.system() == 'Darwin', 'Not supported on macOS')
+	def test_stats(self):
+		def batched():
+			res = call('%s -s union' % self.unionfsctl_path).decode()
+			if 'io_uring lookups: not compiled in' in res:
+				self.skipTest('compiled without io_uring')
+			return int(re.search(r'io_uring lookups: on, (\d+) batched', res).group(1))
+
+		before = batched()
+		self.assertFalse(os.path.exists('union/not_existing'))
+		self.assertEqual(read_from_file('union/ro2_dir/ro2_file'), 'ro2')
+		self.assertGreater(batched(), before)
+
+
+class UnionFS_RW_RO_RO_COW_BranchIndex_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		self.unionfs_index_path = os.path.abspath('%s/src/unionfs-index' % self.original_cwd)
+		# hides ro2_file of the lower branch
+		os.mkdir('ro1/.unionfs')
+		write_to_file('ro1/.unionfs/ro2_file_HIDDEN~', '')
+		# like /lib -> usr/lib, not followed by unionfs-index
+		os.symlink('ro1_dir', 'ro1/ro1_link')
+		call('%s ro1 ro1.index' % self.unionfs_index_path)
+		call('%s ro2 ro2.index' % self.unionfs_index_path)
+		self.mount('-o cow,branch_index=1:ro1.index,branch_index=2:ro2.index rw1=rw:ro1=ro:ro2=ro union')
+
+	def test_lookup(self):
+		self.assertEqual(read_from_file('union/common_file'), 'rw1')
+		self.assertEqual(read_from_file('union/ro_common_file'), 'ro1')
+		self.assertEqual(read_from_file('union/ro2_dir/ro2_file'), 'ro2')
+		self.assertEqual(os.stat('union/ro1_file').st_size, 3)
+		self.assertFalse(os.path.exists('union/not_existing'))
+
+	def test_whiteout_in_index(self):
+		self.assertFalse(os.path.exists('union/ro2_file'))
+
+	def test_long_path(self):
+		# longer than unionfs paths may be, but not than the kernel's
+		path = 'union' + ('/' + 'x' * 200) * 6
+		with self.assertRaises(OSError) as cm:
+			os.stat(path)
+		self.assertIn(cm.exception.errno, (errno.ENAMETOOLONG, errno.ENOENT))
+		with self.assertRaises(OSError):
+			os.listdir(path)
+		self.assertEqual(read_from_file('union/ro1_file'), 'ro1')
+
+	def test_listing(self):
+		self.assertEqual(sorted(os.listdir('union/common_dir')),
+			['common_file', 'ro1_file', 'ro2_file', 'ro_common_file', 'rw1_file', 'rw_common_file'])
+		self.assertEqual(os.listdir('union/ro1_dir'), ['ro1_file'])
+
+	def test_symlinked_dir(self):
+		self.assertTrue(os.path.islink('union/ro1_link'))
+		self.assertEqual(os.listdir('union/ro1_link'), ['ro1_file'])
+		self.assertEqual(os.stat('union/ro1_link/ro1_file').st_size, 3)
+		self.assertEqual(read_from_file('union/ro1_link/ro1_file'), 'ro1')
+		self.assertFalse(os.path.exists('union/ro1_link/not_existing'))
+		self.assertFalse(os.path.exists('union/ro1_file/not_existing'))
+
+	def test_copy_up(self):
+		write_to_file('union/ro1_dir/ro1_file', 'changed')
+		self.assertEqual(read_from_file('union/ro1_dir/ro1_file'), 'changed')
+		self.assertEqual(read_from_file('rw1/ro1_dir/ro1_file'), 'changed')
+
+	def test_stale_index(self):
+		write_to_file('ro1/new_file', 'new')
+		with self.assertRaises(subprocess.CalledProcessError):
+			call('%s -o branch_index=1:ro1.index rw1=rw:ro1=ro rw2 2>/dev/null' % self.unionfs_path)
+
+	def test_stale_index_below_root(self):
+		write_to_file('ro1/ro1_dir/new_file', 'new')
+		with self.assertRaises(subprocess.CalledProcessError):
+			call('%s -o branch_index=1:ro1.index,branch_index_verify rw1=rw:ro1=ro rw2 2>/dev/null' % self.unionfs_path)
+
+	def test_rw_branch(self):
+		call('%s rw1 rw1.index' % self.unionfs_index_path)
+		with self.assertRaises(subprocess.CalledProcessError):
+			call('%s -o branch_index=0:rw1.index rw1=rw:ro1=ro rw2 2>/dev/null' % self.unionfs_path)
+
+
+class UnionFS_RW_RO_RO_COW_BloomFilter_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		os.symlink('ro2_dir', 'ro2/ro2_link')
+		self.mount('-o cow,bloom_filter rw1=rw:ro1=ro:ro2=ro union')
+
+	def test_lookup(self):
+		self.assertEqual(read_from_file('union/common_file'), 'rw1')
+		self.assertEqual(read_from_file('union/ro2_dir/ro2_file'), 'ro2')
+		self.assertEqual(read_from_file('union/ro2_link/ro2_file'), 'ro2')
+		self.assertFalse(os.path.exists('union/not_existing'))
+		self.assertFalse(os.path.exists('union/ro1_dir/not_existing'))
+
+	def test_create(self):
+		write_to_file('union/new_file', 'new')
+		self.assertEqual(read_from_file('union/new_file'), 'new')
+		os.mkdir('union/new_dir')
+		os.symlink('new_file', 'union/new_dir/link')
+		self.assertEqual(read_from_file('union/new_dir/link'), 'new')
+		write_to_file('union/ro1_dir/ro1_file', 'changed')
+		self.assertEqual(read_from_file('union/ro1_dir/ro1_file'), 'changed')
+
+	def test_rename_dir(self):
+		os.rename('union/rw1_dir', 'union/renamed_dir')
+		self.assertEqual(read_from_file('union/renamed_dir/rw1_file'), 'rw1')
+		os.rename('union/ro1_dir', 'union/renamed_ro_dir')
+		self.assertEqual(read_from_file('union/renamed_ro_dir/ro1_file'), 'ro1')
+
+	@unittest.skipIf(os.environ.get('RUNNING_ON_TRAVIS_CI'), 'Not supported on Travis')
+	@unittest.skipIf(platform.system() == 'Darwin', 'Not supported on macOS')
+	def test_stats(self):
+		self.assertFalse(os.path.exists('union/not_existing'))
+		res = call('%s -s union' % self.unionfsctl_path).decode()
+		self.assertIn('bloom filter branch 2:', res)
+		self.assertIn('false positives', res)
+
+
+class UnionFS_RW_RO_RO_COW_ReaddirCache_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		# recently modified directories are not cached
+		for d in ['rw1', 'ro1', 'ro2']:
+			os.utime('%s/common_dir' % d, (0, 0))
+		self.mount('-o cow,readdir_cache=1 rw1=rw:ro1=ro:ro2=ro union')
+
+	def test_listing(self):
+		lst = ['ro1_file', 'ro2_file', 'rw1_file', 'ro_common_file', 'rw_common_file', 'common_file']
+		for i in range(3):
+			self.assertEqual(set(lst), set(os.listdir('union/common_dir')))
+
+	def test_change(self):
+		os.listdir('union/common_dir')
+		write_to_file('union/common_dir/new_file', 'new')
+		self.assertIn('new_file', os.listdir('union/common_dir'))
+		os.remove('union/common_dir/ro2_file')
+		self.assertNotIn('ro2_file', os.listdir('union/common_dir'))
+
+	def test_change_behind_back(self):
+		os.listdir('union/common_dir')
+		write_to_file('ro2/common_dir/new_file', 'new')
+		self.assertIn('new_file', os.listdir('union/common_dir'))
+
+	@unittest.skipIf(os.environ.get('RUNNING_ON_TRAVIS_CI'), 'Not supported on Travis')
+	@unittest.skipIf(platform.system() == 'Darwin', 'Not supported on macOS')
+	def test_stats(self):
+		os.listdir('union/common_dir')
+		os.listdir('union/common_dir')
+		res = call('%s -s union' % self.unionfsctl_path).decode()
+		self.assertIn('readdir cache: 1 directories', res)
+
+
+class UnionFS_RW_RO_COW_KernelDirCache_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		self.mount('-o cow,kernel_dir_cache rw1=rw:ro1=ro union')
+
+	def test_listing(self):
+		for i in range(3):
+			self.assertEqual(set(['ro1_file']), set(os.listdir('union/ro1_dir')))
+
+	def test_change(self):
+		os.listdir('union/ro1_dir')
+		write_to_file('union/ro1_dir/new_file', 'new')
+		self.assertEqual(set(['ro1_file', 'new_file']), set(os.listdir('union/ro1_dir')))
+		os.remove('union/ro1_dir/ro1_file')
+		self.assertEqual(set(['new_file']), set(os.listdir('union/ro1_dir')))
+
+
+@unittest.skipIf(platform.system() == 'Darwin', 'Not supported on macOS')
+class UnionFS_RW_RO_COW_WatchBranches_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		self.mount('-o cow,bloom_filter,lookup_cache=1000,lookup_cache_ttl=0,watch_branches rw1=rw:ro1=ro union')
+
+	def wait_for(self, cond):
+		for i in range(50):
+			if cond():
+				return
+			time.sleep(0.1)
+		self.fail('change to the branch not noticed')
+
+	def test_create_behind_back(self):
+		self.assertFalse(os.path.exists('union/new_file'))
+		write_to_file('rw1/new_file', 'new')
+		self.wait_for(lambda: os.path.exists('union/new_file'))
+		self.assertEqual(read_from_file('union/new_file'), 'new')
+
+	def test_create_in_new_dir_behind_back(self):
+		os.mkdir('rw1/new_dir')
+		self.wait_for(lambda: os.path.isdir('union/new_dir'))
+		self.assertFalse(os.path.exists('union/new_dir/new_file'))
+		write_to_file('rw1/new_dir/new_file', 'new')
+		self.wait_for(lambda: os.path.exists('union/new_dir/new_file'))
+
+	def test_remove_behind_back(self):
+		self.assertEqual(read_from_file('union/common_file'), 'rw1')
+		os.unlink('rw1/common_file')
+		self.wait_for(lambda: read_from_file('union/common_file') == 'ro1')
+
+	def test_whiteout_behind_back(self):
+		self.assertTrue(os.path.exists('union/ro1_file'))
+		os.mkdir('rw1/.unionfs')
+		write_to_file('rw1/.unionfs/ro1_file_HIDDEN~', '')
+		self.wait_for(lambda: not os.path.exists('union/ro1_file'))
+
+
+@unittest.skipIf(platform.system() == 'Darwin', 'Not supported on macOS')
+class UnionFS_RW_RO_COW_Passthrough_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		self.mount('-o cow,passthrough rw1=rw:ro1=ro union')
+
+	def test_read_write(self):
+		self.assertEqual(read_from_file('union/ro1_file'), 'ro1')
+		write_to_file('union/new_file', 'new')
+		with open('union/new_file', 'a') as f:
+			f.write('er')
+		self.assertEqual(read_from_file('union/new_file'), 'newer')
+		self.assertEqual(read_from_file('rw1/new_file'), 'newer')
+
+	def test_rename_open(self):
+		with open('union/rw1_file', 'r') as f:
+			os.rename('union/rw1_file', 'union/renamed')
+			self.assertEqual(read_from_file('union/renamed'), 'rw1')
+			self.assertEqual(f.read(), 'rw1')
+
+	def test_unlink_create_open(self):
+		with open('union/rw1_file', 'r') as f:
+			os.remove('union/rw1_file')
+			write_to_file('union/rw1_file', 'new')
+			self.assertEqual(read_from_file('union/rw1_file'), 'new')
+			self.assertEqual(f.read(), 'rw1')
+
+	def test_rename_over_open(self):
+		write_to_file('union/other_file', 'other')
+		with open('union/rw1_file', 'r') as f1, open('union/other_file', 'r') as f2:
+			os.rename('union/other_file', 'union/rw1_file')
+			f1.close()
+			os.rename('union/rw1_file', 'union/renamed')
+			self.assertEqual(read_from_file('union/renamed'), 'other')
+			self.assertEqual(f2.read(), 'other')
+
+	def test_write_while_open_ro(self):
+		with open('union/ro1_file', 'r') as f:
+			with open('union/ro1_file', 'a') as g:
+				g.write('xyz')
+			self.assertEqual(read_from_file('union/ro1_file'), 'ro1xyz')
+			self.assertEqual(read_from_file('rw1/ro1_file'), 'ro1xyz')
+			self.assertEqual(f.read(), 'ro1')
+
+	def test_mmap(self):
+		with open('union/rw1_file', 'r+b') as f:
+			with mmap.mmap(f.fileno(), 0) as m:
+				m[0:3] = b'RW1'
+		self.assertEqual(read_from_file('rw1/rw1_file'), 'RW1')
+
+
+class UnionFS_RW_RO_COW_Splice_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		self.mount('-o cow,splice rw1=rw:ro1=ro union')
+
+	def test_large_file(self):
+		data = os.urandom(4 * 1024 * 1024 + 123)
+		with open('union/large_file', 'wb') as f:
+			f.write(data)
+		with open('union/large_file', 'rb') as f:
+			self.assertEqual(f.read(), data)
+		with open('rw1/large_file', 'rb') as f:
+			self.assertEqual(f.read(), data)
+
+	def test_read_ro(self):
+		self.assertEqual(read_from_file('union/ro1_dir/ro1_file'), 'ro1')
+
+
+class UnionFS_RW_RO_COW_LazyCopyup_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		self.data = os.urandom(5 * 1024 * 1024 + 123)
+		with open('ro1/large_file', 'wb') as f:
+			f.write(self.data)
+		self.mount('-o cow,lazy_copyup=1,copyup_threads=2 rw1=rw:ro1=ro union')
+
+	def wait_for_copyup(self):
+		for i in range(50):
+			if ' 0 pending' in call('%s -s union' % self.unionfsctl_path).decode():
+				return
+			time.sleep(0.1)
+		self.fail('lazy copy-up not finished')
+
+	def test_write(self):
+		data = self.data[:3000000] + b'x' + self.data[3000001:]
+		with open('union/large_file', 'r+b') as f:
+			f.seek(3000000)
+			f.write(b'x')
+			f.seek(0)
+			self.assertEqual(f.read(), data)
+
+		self.assertEqual(os.path.getsize('rw1/large_file'), len(data))
+		self.wait_for_copyup()
+		with open('rw1/large_file', 'rb') as f:
+			self.assertEqual(f.read(), data)
+		with open('ro1/large_file', 'rb') as f:
+			self.assertEqual(f.read(), self.data)
+
+	def test_truncate(self):
+		with open('union/large_file', 'r+b') as f:
+			f.truncate(1000)
+			self.assertEqual(f.read(), self.data[:1000])
+		self.wait_for_copyup()
+		with open('rw1/large_file', 'rb') as f:
+			self.assertEqual(f.read(), self.data[:1000])
+
+	def test_small_file(self):
+		write_to_file('union/ro1_file', 'something')
+		self.assertEqual(read_from_file('rw1/ro1_file'), 'something')
+
+	def test_stats(self):
+		with open('union/large_file', 'r+b') as f:
+			f.write(b'x')
+		res = call('%s -s union' % self.unionfsctl_path).decode()
+		self.assertIn('lazy copy-up: 1 files', res)
+		self.assertIn('2 threads', res)
+
+	def leave_incomplete(self, first_chunk):
+		# large_file as left by a killed unionfs, with only the first chunk copied
+		call('fusermount -u union')
+		self.mounted = False
+		with open('rw1/large_file', 'wb') as f:
+			f.write(first_chunk)
+			f.truncate(len(self.data))
+		ino = os.stat('rw1/large_file').st_ino
+		os.makedirs('rw1/.unionfs/lazy_copyup~')
+		os.link('rw1/large_file', 'rw1/.unionfs/lazy_copyup~/%d' % ino)
+		lower = os.stat('ro1/large_file')
+		nchunks = (len(self.data) + 1024 * 1024 - 1) // (1024 * 1024)
+		with open('rw1/.unionfs/lazy_copyup~/%d.state' % ino, 'wb') as f:
+			f.write(struct.pack('=8sQQqQQII', b'UFSLAZY1', ino, lower.st_ino, lower.st_mtime_ns,
+				len(self.data), nchunks, 1, 0))
+			f.write(b'\x01' + bytes((nchunks + 7) // 8 - 1))
+			f.write(b'/large_file\0')
+
+	def test_resume(self):
+		first_chunk = b'x' + self.data[1:1024 * 1024]
+		self.leave_incomplete(first_chunk)
+		self.mount('-o cow,lazy_copyup=1 rw1=rw:ro1=ro union')
+		self.wait_for_copyup()
+		with open('rw1/large_file', 'rb') as f:
+			self.assertEqual(f.read(), first_chunk + self.data[1024 * 1024:])
+		self.assertEqual(os.listdir('rw1/.unionfs/lazy_copyup~'), [])
+		self.assertEqual(os.stat('rw1/large_file').st_nlink, 1)
+
+	def test_resume_without_lazy_copyup(self):
+		self.leave_incomplete(self.data[:1024 * 1024])
+		self.mount('-o cow rw1=rw:ro1=ro union')
+		with open('union/large_file', 'rb') as f:
+			self.assertEqual(f.read(), self.data)
+		self.assertEqual(os.listdir('rw1/.unionfs/lazy_copyup~'), [])
+
+	def test_resume_removed(self):
+		self.leave_incomplete(self.data[:1024 * 1024])
+		os.remove('rw1/large_file')
+		self.mount('-o cow,lazy_copyup=1 rw1=rw:ro1=ro union')
+		self.assertEqual(os.listdir('rw1/.unionfs/lazy_copyup~'), [])
+		with open('union/large_file', 'rb') as f:
+			self.assertEqual(f.read(), self.data)
+
+	def test_parallel(self):
+		with open('ro1/large_file2', 'wb') as f:
+			f.write(self.data[::-1])
+		with open('union/large_file', 'r+b') as f1, open('union/large_file2', 'r+b') as f2:
+			f1.write(b'1')
+			f2.write(b'2')
+		self.wait_for_copyup()
+		with open('rw1/large_file', 'rb') as f:
+			self.assertEqual(f.read(), b'1' + self.data[1:])
+		with open('rw1/large_file2', 'rb') as f:
+			self.assertEqual(f.read(), b'2' + self.data[::-1][1:])
+
+
 @unittest.skipIf(os.environ.get('RUNNING_ON_TRAVIS_CI'), 'Not supported on Travis')
 @unittest.skipIf(platform.system() == 'Darwin', 'Not supported on macOS')
 class IOCTL_TestCase(Common, unittest.TestCase):